@@ -0,0 +1,787 @@
+#include <linux/fs.h>
+#include <linux/bitmap.h>
+#include <linux/percpu.h>
+#include "osfs.h"
+
+/*
+ * Block allocator.
+ *
+ * block_bitmap holds one bit per data block. block_full_map is a summary
+ * level above it with one bit per bitmap word, set while every block in
+ * that word is in use, so a search skips BITS_PER_LONG full words per
+ * summary word instead of testing blocks one at a time. block_hint is a
+ * lower bound on the first free block: nothing below it is free.
+ *
+ * The data area itself is split into chunks of 1 << chunk_bits blocks.
+ * A chunk is vzalloc'ed when the first block in it is allocated and
+ * vfree'd when its last block is freed, so resident memory follows the
+ * blocks in use rather than the size given at mount. Free blocks inside
+ * a live chunk are kept zeroed, so new blocks always read back as zeros.
+ * With DAX the chunks are the device itself and stay for the whole
+ * mount; its free blocks hold whatever was there, so blocks are zeroed
+ * when claimed instead.
+ *
+ * All of this state is protected by sb_info->block_lock. It is a mutex
+ * rather than a spinlock because populating or releasing a chunk may
+ * sleep in vzalloc/vfree.
+ *
+ * So that allocating CPUs do not all queue on block_lock, each CPU keeps
+ * a pool: a run of up to OSFS_POOL_BLOCKS blocks it has already claimed
+ * from the bitmap, and which it hands out under its own spinlock. Small
+ * allocations without a goal come from the pool, and an allocation whose
+ * goal is the next block of the pool extends from it, so a file the same
+ * CPU keeps appending to stays contiguous. The bitmap only sees one
+ * claim per batch. nr_free_blocks counts blocks clear in the bitmap;
+ * the free_blocks percpu_counter counts blocks not handed out to a file
+ * and is what statfs and the preallocation heuristics read. When the
+ * bitmap runs out, every pool is drained back into it before giving up.
+ *
+ * Blocks set aside by osfs_reserve_blocks for delayed allocation are
+ * taken off free_blocks without leaving the bitmap. Every allocation
+ * checks free_blocks first, so it cannot take a block some pending write
+ * was promised; the delalloc flush gives its reservation back right
+ * before allocating the blocks for real.
+ *
+ * A save of the image snapshots the metadata under block_lock and then
+ * writes without it, reading data blocks straight from the chunks. Until
+ * it is done, osfs_free_extent only marks freed runs in block_deferred:
+ * they stay allocated, so their chunks are neither zeroed nor released
+ * and no other file is handed them while they are being written. They
+ * are freed when the save ends, and until then do not count as free.
+ * Runs coming back from the CPU pools wait the same way; a pool may have
+ * been refilled after the save drained it, and its chunks may hold
+ * blocks the save reads.
+ *
+ * For the journal, block_dirty records the data blocks written since the
+ * last save, so a save writes only those, and block_freed the blocks
+ * freed since then. A freed block that is handed out again must not be
+ * overwritten in place before the commit that frees it: its old owner
+ * would see the new data after a crash. The save journals such blocks
+ * instead of writing them in place, as explained in journal.c.
+ */
+
+/**
+ * Function: osfs_update_full_map
+ * Description: Recomputes the summary bits covering a range of blocks.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - start: First block of the range.
+ *   - count: Number of blocks in the range.
+ * Returns:
+ *   - None.
+ */
+static void osfs_update_full_map(struct osfs_sb_info *sb_info,
+                                 uint32_t start, uint32_t count)
+{
+    unsigned long word = start / BITS_PER_LONG;
+    unsigned long last = (start + count - 1) / BITS_PER_LONG;
+
+    for (; word <= last; word++) {
+        if (sb_info->block_bitmap[word] == ~0UL)
+            set_bit(word, sb_info->block_full_map);
+        else
+            clear_bit(word, sb_info->block_full_map);
+    }
+}
+
+/**
+ * Function: osfs_populate_chunks
+ * Description: Allocates the chunks backing a range of blocks and accounts
+ *              the range in their usage counts. With DAX the range is
+ *              zeroed instead.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - start: First block of the range.
+ *   - count: Number of blocks in the range.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOMEM if a chunk cannot be allocated; nothing is changed then.
+ */
+static int osfs_populate_chunks(struct osfs_sb_info *sb_info,
+                                uint32_t start, uint32_t count)
+{
+    uint32_t first = start >> sb_info->chunk_bits;
+    uint32_t last = (start + count - 1) >> sb_info->chunk_bits;
+    uint32_t chunk, block;
+
+    for (chunk = first; chunk <= last; chunk++) {
+        if (sb_info->chunks[chunk])
+            continue;
+        sb_info->chunks[chunk] = vzalloc(osfs_chunk_bytes(sb_info, chunk));
+        if (!sb_info->chunks[chunk])
+            goto out_release;
+    }
+
+    for (block = start; block < start + count; ) {
+        uint32_t n = min(count - (block - start), osfs_chunk_blocks_left(sb_info, block));
+
+        sb_info->chunk_used[block >> sb_info->chunk_bits] += n;
+        if (sb_info->dax_dev)
+            memset(osfs_block_addr(sb_info, block), 0, (size_t)n << sb_info->block_bits);
+        block += n;
+    }
+    return 0;
+
+out_release:
+    // Drop the chunks this call populated; an unused chunk is never kept
+    while (chunk-- > first) {
+        if (!sb_info->chunk_used[chunk]) {
+            vfree(sb_info->chunks[chunk]);
+            sb_info->chunks[chunk] = NULL;
+        }
+    }
+    return -ENOMEM;
+}
+
+/**
+ * Function: osfs_release_chunks
+ * Description: Drops a range of blocks from their chunks' usage counts,
+ *              returning chunks that become empty to the kernel and
+ *              zeroing the freed blocks of those that stay.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - start: First block of the range.
+ *   - count: Number of blocks in the range.
+ * Returns:
+ *   - None.
+ */
+static void osfs_release_chunks(struct osfs_sb_info *sb_info,
+                                uint32_t start, uint32_t count)
+{
+    uint32_t block;
+
+    for (block = start; block < start + count; ) {
+        uint32_t chunk = block >> sb_info->chunk_bits;
+        uint32_t n = min(count - (block - start), osfs_chunk_blocks_left(sb_info, block));
+
+        sb_info->chunk_used[chunk] -= n;
+        if (sb_info->dax_dev) {
+            // Zeroed when claimed again
+        } else if (!sb_info->chunk_used[chunk]) {
+            vfree(sb_info->chunks[chunk]);
+            sb_info->chunks[chunk] = NULL;
+        } else {
+            memset(osfs_block_addr(sb_info, block), 0, (size_t)n << sb_info->block_bits);
+        }
+        block += n;
+    }
+}
+
+/**
+ * Function: osfs_free_chunks
+ * Description: Frees every chunk of the data area at unmount. DAX chunks
+ *              belong to the device and are only forgotten.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ * Returns:
+ *   - None.
+ */
+void osfs_free_chunks(struct osfs_sb_info *sb_info)
+{
+    uint32_t chunk;
+
+    for (chunk = 0; chunk < sb_info->chunk_count; chunk++) {
+        if (!sb_info->dax_dev)
+            vfree(sb_info->chunks[chunk]);
+        sb_info->chunks[chunk] = NULL;
+    }
+}
+
+/**
+ * Function: osfs_find_free_run
+ * Description: Finds the first run of needed_blocks free blocks.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - needed_blocks: Length of the run to find.
+ *   - start: Set to the first block of the run on success.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOSPC if no run of that length exists.
+ */
+static int osfs_find_free_run(struct osfs_sb_info *sb_info,
+                              uint32_t needed_blocks, uint32_t *start)
+{
+    unsigned long nr_words = BITS_TO_LONGS(sb_info->block_count);
+    unsigned long pos = sb_info->block_hint;
+
+    while (pos + needed_blocks <= sb_info->block_count) {
+        unsigned long word, first, end;
+
+        // Skip words with no free block using the summary level
+        word = find_next_zero_bit(sb_info->block_full_map, nr_words,
+                                  pos / BITS_PER_LONG);
+        if (word >= nr_words)
+            break;
+
+        first = find_next_zero_bit(sb_info->block_bitmap, sb_info->block_count,
+                                   max(pos, word * BITS_PER_LONG));
+        if (first + needed_blocks > sb_info->block_count)
+            break;
+
+        // Length of the free run starting at first, capped at needed_blocks
+        end = find_next_bit(sb_info->block_bitmap, first + needed_blocks, first);
+        if (end - first >= needed_blocks) {
+            *start = first;
+            return 0;
+        }
+        pos = end;
+    }
+    return -ENOSPC;
+}
+
+/**
+ * Function: osfs_claim_blocks
+ * Description: Marks a free run of blocks in use and backs it with chunks.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - start: First block of the run.
+ *   - count: Number of blocks in the run.
+ *   - extent: Filled with the claimed range on success.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOMEM if the chunks backing the run cannot be allocated.
+ */
+static int osfs_claim_blocks(struct osfs_sb_info *sb_info, uint32_t start,
+                             uint32_t count, struct osfs_extent *extent)
+{
+    if (osfs_populate_chunks(sb_info, start, count)) {
+        pr_err("osfs: Could not populate data chunks for %u blocks\n", count);
+        return -ENOMEM;
+    }
+
+    // 標記為已使用
+    bitmap_set(sb_info->block_bitmap, start, count);
+    osfs_update_full_map(sb_info, start, count);
+    if (start == sb_info->block_hint)
+        sb_info->block_hint = start + count;
+
+    extent->start_block = start;
+    extent->block_count = count;
+    sb_info->nr_free_blocks -= count;
+
+    pr_debug("osfs: Allocated extent: start=%u, count=%u\n", start, count);
+    return 0;
+}
+
+/**
+ * Function: osfs_take_extent
+ * Description: Claims a run of exactly needed_blocks blocks from the bitmap.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - needed_blocks: Number of contiguous blocks to claim.
+ *   - extent: Filled with the claimed range on success.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOSPC if no contiguous run of that length is free.
+ *   - -ENOMEM if the chunks backing the run cannot be allocated.
+ */
+static int osfs_take_extent(struct osfs_sb_info *sb_info, uint32_t needed_blocks,
+                            struct osfs_extent *extent)
+{
+    uint32_t start;
+    int ret = -ENOSPC;
+
+    mutex_lock(&sb_info->block_lock);
+    // 先檢查是否有足夠的可用空間
+    if (needed_blocks <= sb_info->nr_free_blocks &&
+        !osfs_find_free_run(sb_info, needed_blocks, &start))
+        ret = osfs_claim_blocks(sb_info, start, needed_blocks, extent);
+    mutex_unlock(&sb_info->block_lock);
+    return ret;
+}
+
+/**
+ * Function: osfs_take_blocks
+ * Description: Claims up to needed_blocks contiguous blocks from the
+ *              bitmap, preferring the run that starts at goal. If goal is
+ *              free the free blocks from it onwards are taken even when
+ *              there are fewer than requested. Otherwise the first free
+ *              run of the full length is used, halving the length while
+ *              none is found.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - goal: The preferred first block, or U32_MAX for none.
+ *   - needed_blocks: Largest number of blocks to claim.
+ *   - extent: Filled with the claimed range on success.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOSPC if no block is free.
+ *   - -ENOMEM if the chunks backing the run cannot be allocated.
+ */
+static int osfs_take_blocks(struct osfs_sb_info *sb_info, uint32_t goal,
+                            uint32_t needed_blocks, struct osfs_extent *extent)
+{
+    uint32_t start, count;
+    int ret = -ENOSPC;
+
+    mutex_lock(&sb_info->block_lock);
+    if (sb_info->nr_free_blocks == 0)
+        goto out;
+
+    if (goal < sb_info->block_count && !test_bit(goal, sb_info->block_bitmap)) {
+        uint32_t limit = goal + min(needed_blocks, sb_info->block_count - goal);
+
+        count = find_next_bit(sb_info->block_bitmap, limit, goal) - goal;
+        ret = osfs_claim_blocks(sb_info, goal, count, extent);
+        goto out;
+    }
+
+    // 找不到夠長的連續空間就縮小要求
+    count = min(needed_blocks, sb_info->nr_free_blocks);
+    while (osfs_find_free_run(sb_info, count, &start)) {
+        if (count == 1)
+            goto out;
+        count /= 2;
+    }
+    ret = osfs_claim_blocks(sb_info, start, count, extent);
+out:
+    mutex_unlock(&sb_info->block_lock);
+    return ret;
+}
+
+/**
+ * Function: osfs_clear_blocks
+ * Description: Clears a run of blocks in the bitmap and releases its
+ *              chunks. The caller holds block_lock.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - start: First block of the run.
+ *   - count: Number of blocks in the run.
+ * Returns:
+ *   - None.
+ */
+static void osfs_clear_blocks(struct osfs_sb_info *sb_info, uint32_t start, uint32_t count)
+{
+    osfs_release_chunks(sb_info, start, count);
+    bitmap_clear(sb_info->block_bitmap, start, count);
+    osfs_update_full_map(sb_info, start, count);
+    if (start < sb_info->block_hint)
+        sb_info->block_hint = start;
+
+    sb_info->nr_free_blocks += count;
+}
+
+/**
+ * Function: osfs_return_blocks
+ * Description: Clears a run of pooled blocks in the bitmap and releases
+ *              its chunks. While a save is writing the image the run
+ *              stays allocated until osfs_release_deferred_blocks, like
+ *              the runs of osfs_free_extent. Pooled blocks already count
+ *              as free, so free_blocks is left alone.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - extent: The range to release; may be empty.
+ * Returns:
+ *   - None.
+ */
+static void osfs_return_blocks(struct osfs_sb_info *sb_info, struct osfs_extent *extent)
+{
+    if (extent->block_count == 0)
+        return;
+
+    mutex_lock(&sb_info->block_lock);
+    if (sb_info->image_saving) {
+        bitmap_set(sb_info->block_deferred, extent->start_block, extent->block_count);
+        sb_info->nr_deferred_pooled += extent->block_count;
+    } else {
+        osfs_clear_blocks(sb_info, extent->start_block, extent->block_count);
+    }
+    mutex_unlock(&sb_info->block_lock);
+}
+
+/**
+ * Function: osfs_pool_alloc
+ * Description: Allocates blocks from the calling CPU's pool. A goal equal
+ *              to the next block of the pool takes as much of the pool as
+ *              it can; a request without a goal of at most
+ *              OSFS_POOL_BLOCKS blocks takes exactly needed_blocks,
+ *              refilling the pool with a fresh run if it is too short.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - goal: The preferred first block, or U32_MAX for none.
+ *   - needed_blocks: Largest number of blocks to allocate.
+ *   - extent: Filled with the allocated range on success.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOSPC if the request has to go to the bitmap instead.
+ */
+static int osfs_pool_alloc(struct osfs_sb_info *sb_info, uint32_t goal,
+                           uint32_t needed_blocks, struct osfs_extent *extent)
+{
+    // Any pool will do; staying on the local CPU only keeps its lock uncontended
+    struct osfs_block_pool *pool = raw_cpu_ptr(sb_info->block_pools);
+    struct osfs_extent run, old;
+    uint32_t count = 0;
+
+    spin_lock(&pool->lock);
+    if (pool->count && goal == pool->start)
+        count = min(needed_blocks, pool->count);
+    else if (goal == U32_MAX && needed_blocks <= pool->count)
+        count = needed_blocks;
+    if (count) {
+        extent->start_block = pool->start;
+        extent->block_count = count;
+        pool->start += count;
+        pool->count -= count;
+    }
+    spin_unlock(&pool->lock);
+    if (count)
+        return 0;
+
+    if (goal != U32_MAX || needed_blocks > OSFS_POOL_BLOCKS)
+        return -ENOSPC;
+
+    // Claim a new batch outside the pool lock, since block_lock may sleep
+    if (osfs_take_blocks(sb_info, U32_MAX, OSFS_POOL_BLOCKS, &run))
+        return -ENOSPC;
+    if (run.block_count < needed_blocks) {
+        osfs_return_blocks(sb_info, &run);
+        return -ENOSPC;
+    }
+
+    spin_lock(&pool->lock);
+    old.start_block = pool->start;
+    old.block_count = pool->count;
+    pool->start = run.start_block + needed_blocks;
+    pool->count = run.block_count - needed_blocks;
+    spin_unlock(&pool->lock);
+
+    // Whatever was left of the old run goes back to the bitmap
+    osfs_return_blocks(sb_info, &old);
+
+    extent->start_block = run.start_block;
+    extent->block_count = needed_blocks;
+    return 0;
+}
+
+/**
+ * Function: osfs_drain_block_pools
+ * Description: Returns the blocks reserved in every CPU's pool to the
+ *              bitmap, so an allocation that found the bitmap full can
+ *              use them, or so the bitmap is exact for a saved image.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ * Returns:
+ *   - true if any block was returned.
+ */
+bool osfs_drain_block_pools(struct osfs_sb_info *sb_info)
+{
+    struct osfs_extent run;
+    bool drained = false;
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        struct osfs_block_pool *pool = per_cpu_ptr(sb_info->block_pools, cpu);
+
+        spin_lock(&pool->lock);
+        run.start_block = pool->start;
+        run.block_count = pool->count;
+        pool->count = 0;
+        spin_unlock(&pool->lock);
+
+        if (run.block_count) {
+            osfs_return_blocks(sb_info, &run);
+            drained = true;
+        }
+    }
+    return drained;
+}
+
+/**
+ * Function: osfs_init_block_pools
+ * Description: Allocates the empty per-CPU block pools at mount.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOMEM if the per-CPU allocation fails.
+ */
+int osfs_init_block_pools(struct osfs_sb_info *sb_info)
+{
+    int cpu;
+
+    sb_info->block_pools = alloc_percpu(struct osfs_block_pool);
+    if (!sb_info->block_pools)
+        return -ENOMEM;
+
+    for_each_possible_cpu(cpu)
+        spin_lock_init(&per_cpu_ptr(sb_info->block_pools, cpu)->lock);
+    return 0;
+}
+
+/**
+ * Function: osfs_destroy_block_pools
+ * Description: Frees the per-CPU block pools at unmount. The blocks they
+ *              hold go away with the data area.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ * Returns:
+ *   - None.
+ */
+void osfs_destroy_block_pools(struct osfs_sb_info *sb_info)
+{
+    free_percpu(sb_info->block_pools);
+    sb_info->block_pools = NULL;
+}
+
+/**
+ * Function: osfs_unreserved_blocks
+ * Description: Caps an allocation to the blocks free_blocks still covers,
+ *              so it cannot use blocks reserved for delayed allocation.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - needed_blocks: Number of blocks wanted.
+ * Returns:
+ *   - How many of them may be allocated, possibly 0.
+ */
+static uint32_t osfs_unreserved_blocks(struct osfs_sb_info *sb_info, uint32_t needed_blocks)
+{
+    // Sums the per-CPU deltas only when the count is close to the limit
+    if (percpu_counter_compare(&sb_info->free_blocks, needed_blocks) >= 0)
+        return needed_blocks;
+    return min_t(s64, needed_blocks, percpu_counter_sum_positive(&sb_info->free_blocks));
+}
+
+/**
+ * Function: osfs_alloc_extent
+ * Description: Allocates a run of contiguous data blocks.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - needed_blocks: Number of contiguous blocks to allocate.
+ *   - extent: Filled with the allocated range on success.
+ * Returns:
+ *   - 0 on success.
+ *   - -EINVAL if needed_blocks is zero or larger than the filesystem.
+ *   - -ENOSPC if fewer blocks than that are free outside reservations,
+ *     or no contiguous run of that length is free.
+ *   - -ENOMEM if the chunks backing the run cannot be allocated.
+ */
+int osfs_alloc_extent(struct osfs_sb_info *sb_info, uint32_t needed_blocks,
+                      struct osfs_extent *extent)
+{
+    int ret;
+
+    // 檢查請求的區塊數是否合理
+    if (needed_blocks == 0 || needed_blocks > sb_info->block_count) {
+        pr_err("osfs: Invalid number of blocks requested: %u\n", needed_blocks);
+        return -EINVAL;
+    }
+    if (osfs_unreserved_blocks(sb_info, needed_blocks) < needed_blocks)
+        return -ENOSPC;
+
+    ret = osfs_pool_alloc(sb_info, U32_MAX, needed_blocks, extent);
+    if (ret)
+        ret = osfs_take_extent(sb_info, needed_blocks, extent);
+    if (ret == -ENOSPC && osfs_drain_block_pools(sb_info))
+        ret = osfs_take_extent(sb_info, needed_blocks, extent);
+    if (ret) {
+        if (ret == -ENOSPC)
+            pr_err("osfs: Could not find %u contiguous free blocks\n", needed_blocks);
+        return ret;
+    }
+
+    percpu_counter_sub(&sb_info->free_blocks, extent->block_count);
+    // The image still holds whatever the blocks held before
+    osfs_mark_dirty(sb_info, extent->start_block, extent->block_count);
+    return 0;
+}
+
+/**
+ * Function: osfs_alloc_blocks
+ * Description: Allocates up to needed_blocks contiguous data blocks,
+ *              preferring the run that starts at goal. If goal is free the
+ *              free blocks from it onwards are taken even when there are
+ *              fewer than requested, so a file growing at its tail extends
+ *              its last extent in place. Otherwise the first free run of
+ *              the full length is used, halving the length while none is
+ *              found.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - goal: The preferred first block, or U32_MAX for none.
+ *   - needed_blocks: Largest number of blocks to allocate.
+ *   - extent: Filled with the allocated range on success; its
+ *             block_count may be less than needed_blocks.
+ * Returns:
+ *   - 0 on success.
+ *   - -EINVAL if needed_blocks is zero.
+ *   - -ENOSPC if no block is free outside reservations.
+ *   - -ENOMEM if the chunks backing the run cannot be allocated.
+ */
+int osfs_alloc_blocks(struct osfs_sb_info *sb_info, uint32_t goal,
+                      uint32_t needed_blocks, struct osfs_extent *extent)
+{
+    int ret;
+
+    if (needed_blocks == 0)
+        return -EINVAL;
+    needed_blocks = osfs_unreserved_blocks(sb_info, needed_blocks);
+    if (needed_blocks == 0)
+        return -ENOSPC;
+
+    ret = osfs_pool_alloc(sb_info, goal, needed_blocks, extent);
+    if (ret)
+        ret = osfs_take_blocks(sb_info, goal, needed_blocks, extent);
+    if (ret == -ENOSPC && osfs_drain_block_pools(sb_info))
+        ret = osfs_take_blocks(sb_info, goal, needed_blocks, extent);
+    if (ret)
+        return ret;
+
+    percpu_counter_sub(&sb_info->free_blocks, extent->block_count);
+    osfs_mark_dirty(sb_info, extent->start_block, extent->block_count);
+    return 0;
+}
+
+/**
+ * Function: osfs_free_extent
+ * Description: Returns a run of contiguous data blocks to the allocator.
+ *              While a save is writing the image the run stays allocated
+ *              until osfs_release_deferred_blocks, since the save may
+ *              still be reading it.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - extent: The range to release.
+ * Returns:
+ *   - None.
+ */
+void osfs_free_extent(struct osfs_sb_info *sb_info, struct osfs_extent *extent)
+{
+    if (extent->block_count == 0)
+        return;
+
+    mutex_lock(&sb_info->block_lock);
+    if (sb_info->image_saving) {
+        bitmap_set(sb_info->block_deferred, extent->start_block, extent->block_count);
+        mutex_unlock(&sb_info->block_lock);
+        return;
+    }
+    bitmap_set(sb_info->block_freed, extent->start_block, extent->block_count);
+    osfs_clear_blocks(sb_info, extent->start_block, extent->block_count);
+    mutex_unlock(&sb_info->block_lock);
+    percpu_counter_add(&sb_info->free_blocks, extent->block_count);
+}
+
+/**
+ * Function: osfs_release_deferred_blocks
+ * Description: Ends a save: frees the blocks osfs_free_extent and
+ *              osfs_return_blocks held back while it was writing the image.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ * Returns:
+ *   - None.
+ */
+void osfs_release_deferred_blocks(struct osfs_sb_info *sb_info)
+{
+    uint32_t start = 0, end, count = 0;
+
+    mutex_lock(&sb_info->block_lock);
+    sb_info->image_saving = false;
+    for (;;) {
+        start = find_next_bit(sb_info->block_deferred, sb_info->block_count, start);
+        if (start >= sb_info->block_count)
+            break;
+        end = find_next_zero_bit(sb_info->block_deferred, sb_info->block_count, start);
+        bitmap_clear(sb_info->block_deferred, start, end - start);
+        bitmap_set(sb_info->block_freed, start, end - start);
+        osfs_clear_blocks(sb_info, start, end - start);
+        count += end - start;
+        start = end;
+    }
+    // Pool runs never left free_blocks
+    count -= sb_info->nr_deferred_pooled;
+    sb_info->nr_deferred_pooled = 0;
+    mutex_unlock(&sb_info->block_lock);
+    if (count)
+        percpu_counter_add(&sb_info->free_blocks, count);
+}
+
+/**
+ * Function: osfs_mark_dirty
+ * Description: Records that blocks were written, so the next save writes
+ *              them to the image. Called after the data is in place. The
+ *              bits are set one at a time, since writers do not hold
+ *              block_lock and a save takes the words atomically.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - start: First block written.
+ *   - count: Number of blocks written.
+ * Returns:
+ *   - None.
+ */
+void osfs_mark_dirty(struct osfs_sb_info *sb_info, uint32_t start, uint32_t count)
+{
+    while (count--)
+        set_bit(start++, sb_info->block_dirty);
+}
+
+/**
+ * Function: osfs_reserve_blocks
+ * Description: Sets aside free blocks for data whose placement is delayed,
+ *              without choosing which blocks. They count as used until
+ *              osfs_unreserve_blocks gives them back, normally right
+ *              before they are allocated for real.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - count: Number of blocks to reserve.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOSPC if fewer than count blocks are free.
+ */
+int osfs_reserve_blocks(struct osfs_sb_info *sb_info, uint32_t count)
+{
+    if (percpu_counter_compare(&sb_info->free_blocks, count) < 0)
+        return -ENOSPC;
+
+    percpu_counter_sub(&sb_info->free_blocks, count);
+    return 0;
+}
+
+/**
+ * Function: osfs_reserve_blocks_nofail
+ * Description: Takes back a reservation just returned by
+ *              osfs_unreserve_blocks whose allocation failed, even if the
+ *              free count no longer covers it.
+ */
+void osfs_reserve_blocks_nofail(struct osfs_sb_info *sb_info, uint32_t count)
+{
+    percpu_counter_sub(&sb_info->free_blocks, count);
+}
+
+/**
+ * Function: osfs_unreserve_blocks
+ * Description: Returns blocks set aside by osfs_reserve_blocks.
+ */
+void osfs_unreserve_blocks(struct osfs_sb_info *sb_info, uint32_t count)
+{
+    percpu_counter_add(&sb_info->free_blocks, count);
+}
+
+/**
+ * Function: osfs_free_space_stats
+ * Description: Measures how fragmented the free space is. Blocks held in
+ *              the CPU pools are returned to the bitmap first, so they
+ *              count as free.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - runs: Set to the number of runs of free blocks.
+ *   - largest: Set to the length of the longest run.
+ * Returns:
+ *   - None.
+ */
+void osfs_free_space_stats(struct osfs_sb_info *sb_info, uint32_t *runs, uint32_t *largest)
+{
+    unsigned long pos = 0, end;
+
+    osfs_drain_block_pools(sb_info);
+
+    *runs = 0;
+    *largest = 0;
+    mutex_lock(&sb_info->block_lock);
+    while ((pos = find_next_zero_bit(sb_info->block_bitmap, sb_info->block_count, pos)) <
+           sb_info->block_count) {
+        end = find_next_bit(sb_info->block_bitmap, sb_info->block_count, pos);
+        (*runs)++;
+        *largest = max_t(uint32_t, *largest, end - pos);
+        pos = end;
+    }
+    mutex_unlock(&sb_info->block_lock);
+}
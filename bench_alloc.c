@@ -0,0 +1,278 @@
+// bench_alloc: times block allocation as a filesystem fills and fragments.
+//
+// Usage: bench_alloc [-s file_size[K|M]] [-f fill_percent] directory
+//
+// Each allocation is a fallocate() of one new file, which on osfs goes
+// straight to the block allocator. The tool fills the filesystem to the
+// given percentage (90 by default) with files of file_size (64K), then
+// removes every other file so that the free space is left in holes of
+// file_size, and fills it again with files of half that size. Latency is
+// reported for every tenth of each pass, so an allocator whose cost grows
+// with the number of used or fragmented blocks shows rising numbers.
+// At the peak of the second pass one and a half times as many files as the
+// first pass made exist at once, so the mount needs that many inodes:
+//
+//   sudo mount -t osfs -o size=1G,inodes=32768 none mnt/ && ./bench_alloc mnt/b
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+#define BENCH_DEFAULT_FILE_SIZE (64 << 10)
+#define BENCH_DEFAULT_FILL 90
+#define BENCH_STEPS 10
+
+/**
+ * Struct: bench_step
+ * Description: Latencies of the allocations in one tenth of a pass.
+ */
+struct bench_step {
+    uint64_t *ns;
+    uint32_t count;
+};
+
+/**
+ * Function: usage
+ * Description: Prints how to run the tool and exits with failure.
+ */
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-s file_size[K|M]] [-f fill_percent] directory\n", prog);
+    exit(1);
+}
+
+/**
+ * Function: parse_size
+ * Description: Parses a byte count with an optional K/M suffix.
+ * Returns:
+ *   - The number of bytes, or 0 if the text is not a size.
+ */
+static uint64_t parse_size(const char *text)
+{
+    char *rest;
+    uint64_t size = strtoull(text, &rest, 0);
+
+    switch (*rest) {
+    case 'M': case 'm':
+        size <<= 10;
+        /* fall through */
+    case 'K': case 'k':
+        size <<= 10;
+        rest++;
+        break;
+    }
+    return *rest ? 0 : size;
+}
+
+/**
+ * Function: now_ns
+ * Description: Returns a monotonic time stamp in nanoseconds.
+ */
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Function: cmp_u64
+ * Description: Orders latencies for qsort.
+ */
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Function: allocate
+ * Description: Creates file i of a pass and allocates size bytes for it.
+ * Returns:
+ *   - The time fallocate took in nanoseconds, or 0 with errno set.
+ */
+static uint64_t allocate(const char *dir, int pass, uint32_t i, uint64_t size)
+{
+    char path[4096];
+    uint64_t start, ns;
+    int fd, ret;
+
+    snprintf(path, sizeof(path), "%s/p%d.%u", dir, pass, i);
+    fd = open(path, O_CREAT | O_EXCL | O_WRONLY, 0644);
+    if (fd < 0)
+        return 0;
+    start = now_ns();
+    ret = posix_fallocate(fd, 0, size);
+    ns = now_ns() - start;
+    close(fd);
+    if (ret) {
+        unlink(path);
+        errno = ret;
+        return 0;
+    }
+    return ns ? ns : 1;
+}
+
+/**
+ * Function: report
+ * Description: Prints median, 99th percentile and worst latency of each step.
+ */
+static void report(const char *pass, struct bench_step *steps)
+{
+    int s;
+
+    printf("%s\n  %-9s %8s %10s %10s %10s\n", pass, "filled", "allocs", "p50 us", "p99 us", "max us");
+    for (s = 0; s < BENCH_STEPS; s++) {
+        struct bench_step *step = &steps[s];
+
+        if (!step->count)
+            continue;
+        qsort(step->ns, step->count, sizeof(*step->ns), cmp_u64);
+        printf("  %3d-%3d%% %8u %10.2f %10.2f %10.2f\n", s * 100 / BENCH_STEPS,
+               (s + 1) * 100 / BENCH_STEPS, step->count,
+               step->ns[step->count / 2] / 1e3,
+               step->ns[(uint64_t)step->count * 99 / 100] / 1e3,
+               step->ns[step->count - 1] / 1e3);
+    }
+}
+
+/**
+ * Function: fill
+ * Description: Allocates files of a given size until count of them exist
+ *              or the filesystem is full, recording each latency in the
+ *              step of the pass it falls in.
+ * Returns:
+ *   - The number of files allocated, or -1 on an error other than ENOSPC.
+ */
+static long fill(const char *dir, int pass, uint32_t count, uint64_t size,
+                 struct bench_step *steps)
+{
+    uint32_t i;
+    uint64_t ns;
+
+    for (i = 0; i < count; i++) {
+        struct bench_step *step = &steps[(uint64_t)i * BENCH_STEPS / count];
+
+        ns = allocate(dir, pass, i, size);
+        if (!ns) {
+            if (errno == ENOSPC)
+                break;
+            fprintf(stderr, "%s: pass %d file %u: %s\n", dir, pass, i, strerror(errno));
+            return -1;
+        }
+        step->ns[step->count++] = ns;
+    }
+    return i;
+}
+
+int main(int argc, char **argv)
+{
+    uint64_t file_size = BENCH_DEFAULT_FILE_SIZE, total;
+    struct bench_step steps[BENCH_STEPS];
+    unsigned int fill_percent = BENCH_DEFAULT_FILL;
+    uint32_t count, i, freed;
+    char path[4096];
+    struct statvfs st;
+    long filled, refilled;
+    int opt, s;
+
+    while ((opt = getopt(argc, argv, "s:f:")) != -1) {
+        switch (opt) {
+        case 's':
+            file_size = parse_size(optarg);
+            break;
+        case 'f':
+            fill_percent = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1 || file_size < 2 || !fill_percent || fill_percent > 100)
+        usage(argv[0]);
+
+    if (mkdir(argv[optind], 0755) < 0 && errno != EEXIST) {
+        perror(argv[optind]);
+        return 1;
+    }
+    if (statvfs(argv[optind], &st) < 0) {
+        perror(argv[optind]);
+        return 1;
+    }
+
+    // Size the passes from what is free now, so other files do not count
+    total = (uint64_t)st.f_bavail * st.f_frsize * fill_percent / 100;
+    count = total / file_size;
+    if (count < BENCH_STEPS) {
+        fprintf(stderr, "%s: room for only %u files of %llu bytes\n", argv[optind],
+                count, (unsigned long long)file_size);
+        return 1;
+    }
+    // Running out of inodes would end a pass early as if the blocks were full
+    if (st.f_favail < (uint64_t)count + (count + 1) / 2) {
+        fprintf(stderr, "%s: %llu free inodes, the passes need %u\n", argv[optind],
+                (unsigned long long)st.f_favail, count + (count + 1) / 2);
+        return 1;
+    }
+    for (s = 0; s < BENCH_STEPS; s++) {
+        steps[s].ns = malloc((count * 2 / BENCH_STEPS + 2) * sizeof(*steps[s].ns));
+        if (!steps[s].ns) {
+            perror("malloc");
+            return 1;
+        }
+    }
+    printf("%s: %u files of %llu bytes, %u%% of the free space\n", argv[optind], count,
+           (unsigned long long)file_size, fill_percent);
+
+    // Pass 1: fill an empty area with equal files
+    for (s = 0; s < BENCH_STEPS; s++)
+        steps[s].count = 0;
+    filled = fill(argv[optind], 1, count, file_size, steps);
+    if (filled < 0)
+        return 1;
+    report("fill", steps);
+
+    // Free every other file, leaving holes of one file between used runs
+    for (i = 0, freed = 0; i < filled; i += 2, freed++) {
+        snprintf(path, sizeof(path), "%s/p1.%u", argv[optind], i);
+        if (unlink(path) < 0) {
+            perror(path);
+            return 1;
+        }
+    }
+    sync();
+
+    // Pass 2: fill the holes again with files of half the size
+    for (s = 0; s < BENCH_STEPS; s++)
+        steps[s].count = 0;
+    refilled = fill(argv[optind], 2, freed * 2, file_size / 2, steps);
+    if (refilled < 0)
+        return 1;
+    report("refill fragmented", steps);
+
+    // Remove what the passes left
+    for (i = 1; i < filled; i += 2) {
+        snprintf(path, sizeof(path), "%s/p1.%u", argv[optind], i);
+        unlink(path);
+    }
+    for (i = 0; i < refilled; i++) {
+        snprintf(path, sizeof(path), "%s/p2.%u", argv[optind], i);
+        unlink(path);
+    }
+    for (s = 0; s < BENCH_STEPS; s++)
+        free(steps[s].ns);
+    if (rmdir(argv[optind]) < 0) {
+        perror(argv[optind]);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,180 @@
+// bench_dir: times create, lookup and unlink of many names in one directory.
+//
+// Usage: bench_dir [-n names] directory
+//
+// The directory must be empty or missing. All names go into it, and
+// creation is timed in ten batches, so a per-create cost that grows with
+// the directory shows up as later batches taking longer than the first.
+// The names are then stat()ed in random order, listed once, and removed.
+// Run it on an osfs mount and on another filesystem to compare:
+//
+// The default mount holds 64 inodes and 1 MiB of data, so give it room:
+//
+//   sudo mount -t osfs -o size=64M,inodes=200000 none mnt/ && ./bench_dir mnt/d
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define BENCH_DEFAULT_NAMES 100000
+#define BENCH_BATCHES 10
+
+/**
+ * Function: usage
+ * Description: Prints how to run the tool and exits with failure.
+ */
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-n names] directory\n", prog);
+    exit(1);
+}
+
+/**
+ * Function: now_ns
+ * Description: Returns a monotonic time stamp in nanoseconds.
+ */
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Function: name_of
+ * Description: Builds the name of entry i. The names vary in length so
+ *              that directory blocks fill unevenly, as real ones do.
+ */
+static void name_of(char *buf, size_t len, const char *dir, uint32_t i)
+{
+    snprintf(buf, len, "%s/f%0*u", dir, (int)(i % 24) + 1, i);
+}
+
+/**
+ * Function: report
+ * Description: Prints the total and per-operation time of a phase.
+ */
+static void report(const char *phase, uint32_t count, uint64_t ns)
+{
+    printf("%-8s %8u ops %10.3f s %10.2f us/op\n", phase, count,
+           ns / 1e9, count ? ns / 1e3 / count : 0.0);
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t names = BENCH_DEFAULT_NAMES, batch, i, j, listed = 0;
+    uint64_t start, first = 0, total = 0, ns;
+    char path[4096];
+    uint32_t *order;
+    struct dirent *de;
+    struct stat st;
+    DIR *dir;
+    int opt, fd;
+
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        switch (opt) {
+        case 'n':
+            names = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1 || names < BENCH_BATCHES)
+        usage(argv[0]);
+
+    if (mkdir(argv[optind], 0755) < 0 && errno != EEXIST) {
+        perror(argv[optind]);
+        return 1;
+    }
+    order = malloc(names * sizeof(*order));
+    if (!order) {
+        perror("malloc");
+        return 1;
+    }
+
+    // Create in batches; the last batch against the first shows the scaling
+    batch = names / BENCH_BATCHES;
+    for (i = 0; i < names; i += batch) {
+        uint32_t end = i + batch > names ? names : i + batch;
+
+        start = now_ns();
+        for (j = i; j < end; j++) {
+            name_of(path, sizeof(path), argv[optind], j);
+            fd = open(path, O_CREAT | O_EXCL | O_WRONLY, 0644);
+            if (fd < 0) {
+                perror(path);
+                return 1;
+            }
+            close(fd);
+        }
+        ns = now_ns() - start;
+        if (!i)
+            first = ns;
+        total += ns;
+        printf("create   %8u..%-8u %10.2f us/op\n", i, end - 1, ns / 1e3 / (end - i));
+    }
+    report("create", names, total);
+    printf("create   last batch / first batch: %.2f\n", first ? (double)ns / first : 0.0);
+
+    // Look the names up in random order so no cache of the last entry helps
+    for (i = 0; i < names; i++)
+        order[i] = i;
+    srand(1);
+    for (i = names - 1; i > 0; i--) {
+        uint32_t k = rand() % (i + 1), tmp = order[i];
+
+        order[i] = order[k];
+        order[k] = tmp;
+    }
+    start = now_ns();
+    for (i = 0; i < names; i++) {
+        name_of(path, sizeof(path), argv[optind], order[i]);
+        if (stat(path, &st) < 0) {
+            perror(path);
+            return 1;
+        }
+    }
+    report("stat", names, now_ns() - start);
+
+    start = now_ns();
+    dir = opendir(argv[optind]);
+    if (!dir) {
+        perror(argv[optind]);
+        return 1;
+    }
+    while ((de = readdir(dir)))
+        if (strcmp(de->d_name, ".") && strcmp(de->d_name, ".."))
+            listed++;
+    closedir(dir);
+    report("readdir", listed, now_ns() - start);
+    if (listed != names) {
+        fprintf(stderr, "%s: listed %u names, created %u\n", argv[optind], listed, names);
+        return 1;
+    }
+
+    start = now_ns();
+    for (i = 0; i < names; i++) {
+        name_of(path, sizeof(path), argv[optind], order[i]);
+        if (unlink(path) < 0) {
+            perror(path);
+            return 1;
+        }
+    }
+    report("unlink", names, now_ns() - start);
+
+    free(order);
+    if (rmdir(argv[optind]) < 0) {
+        perror(argv[optind]);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,779 @@
+#include <linux/fs.h>
+#include <linux/fileattr.h>
+#include <linux/lz4.h>
+#include <linux/mm.h>
+#include <linux/pagemap.h>
+#include "osfs.h"
+
+/*
+ * Transparent compression.
+ *
+ * A file marked with chattr +c (OSFS_COMPR_FL), or any file on a mount
+ * with the compress option, is compressed once it is cold: after the last
+ * writer closes it. chattr +c also compresses it at once. The close only
+ * queues the inode on the mount's workqueue, so its latency does not grow
+ * with the file; the work skips a file that has been unlinked since. A
+ * write that comes first only means the work packs the newer data.
+ *
+ * The file is cut into clusters of OSFS_CLUSTER_SHIFT bytes and each
+ * cluster is packed with LZ4 into an extent of its own, which starts at
+ * the cluster's first logical block and maps only the blocks the packed
+ * data needs. The packed data starts with a struct osfs_cluster_header. A
+ * cluster that LZ4 cannot shrink by a block is stored as it is, and is
+ * told apart by mapping all of its blocks. A cluster that is all hole
+ * stays a hole. OSFS_COMPRESSED_FL marks a file stored this way.
+ *
+ * Reads decompress a cluster into a buffer and copy out of it. The last
+ * OSFS_CLUSTER_CACHE_SIZE clusters read are kept in an LRU per mount, so
+ * a hot compressed file is not decompressed again on every read. Buffers
+ * are refcounted, so readers copy to user space without holding any lock.
+ *
+ * Anything that needs the data at block granularity expands the file
+ * back first: writes, fallocate, mmap and faults. Defrag skips the file.
+ *
+ * Like inline data, the flag and the clusters are read under the
+ * mapping's invalidate_lock shared and changed under it exclusive, since
+ * mmap and faults expand a file without i_rwsem. Compressing also needs
+ * i_rwsem exclusively. Plain files are walked without invalidate_lock, so
+ * the flag goes up before a file's tree is rebuilt packed, and comes down
+ * only once the expanded tree is complete. Cached clusters of a file are dropped whenever it
+ * stops being compressed, so a cache entry never outlives its data.
+ */
+
+/**
+ * Function: osfs_cluster_bits
+ * Description: Returns log2 of the cluster size, which is at least a block.
+ */
+static uint32_t osfs_cluster_bits(struct osfs_sb_info *sb_info)
+{
+    return max_t(uint32_t, OSFS_CLUSTER_SHIFT, sb_info->block_bits);
+}
+
+/**
+ * Function: osfs_cluster_len
+ * Description: Returns the number of file bytes in a cluster.
+ */
+static uint32_t osfs_cluster_len(struct inode *inode, uint32_t index)
+{
+    struct osfs_inode *osfs_inode = inode->i_private;
+    uint32_t bits = osfs_cluster_bits(inode->i_sb->s_fs_info);
+
+    return min_t(uint64_t, 1U << bits, osfs_inode->i_size - ((uint64_t)index << bits));
+}
+
+/**
+ * Function: osfs_blocks_copy
+ * Description: Copies bytes between a buffer and a run of blocks, which
+ *              may straddle chunks. Blocks written are marked dirty.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - block: The first block of the run.
+ *   - buf: The buffer.
+ *   - len: The number of bytes to copy.
+ *   - to_blocks: Copy from buf into the blocks rather than out of them.
+ * Returns:
+ *   - None.
+ */
+static void osfs_blocks_copy(struct osfs_sb_info *sb_info, uint32_t block, void *buf,
+                             size_t len, bool to_blocks)
+{
+    while (len > 0) {
+        size_t bytes = min_t(size_t, len,
+                             (size_t)osfs_chunk_blocks_left(sb_info, block) << sb_info->block_bits);
+
+        if (to_blocks) {
+            memcpy(osfs_block_addr(sb_info, block), buf, bytes);
+            osfs_mark_dirty(sb_info, block, DIV_ROUND_UP(bytes, sb_info->block_size));
+        } else {
+            memcpy(buf, osfs_block_addr(sb_info, block), bytes);
+        }
+        buf += bytes;
+        len -= bytes;
+        block += bytes >> sb_info->block_bits;
+    }
+}
+
+/**
+ * Function: osfs_cluster_put
+ * Description: Drops a reference to a decompressed cluster. NULL is ignored.
+ */
+void osfs_cluster_put(struct osfs_cluster *cluster)
+{
+    if (cluster && refcount_dec_and_test(&cluster->ref))
+        kvfree(cluster);
+}
+
+/**
+ * Function: osfs_cluster_find
+ * Description: Looks a cluster up in the cache and moves it to the front.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - ino: The inode number of the file.
+ *   - index: The cluster's index in the file.
+ * Returns:
+ *   - The cluster with a reference taken, or NULL if it is not cached.
+ */
+static struct osfs_cluster *osfs_cluster_find(struct osfs_sb_info *sb_info,
+                                              unsigned long ino, uint32_t index)
+{
+    struct osfs_cluster *cluster;
+
+    spin_lock(&sb_info->cluster_lock);
+    list_for_each_entry(cluster, &sb_info->cluster_lru, lru) {
+        if (cluster->ino == ino && cluster->index == index) {
+            list_move(&cluster->lru, &sb_info->cluster_lru);
+            refcount_inc(&cluster->ref);
+            spin_unlock(&sb_info->cluster_lock);
+            return cluster;
+        }
+    }
+    spin_unlock(&sb_info->cluster_lock);
+    return NULL;
+}
+
+/**
+ * Function: osfs_cluster_add
+ * Description: Caches a freshly decompressed cluster, pushing out the
+ *              least recently used one if the cache is full. If another
+ *              reader cached the same cluster first, that copy is used.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - cluster: The new cluster, with the caller's reference.
+ * Returns:
+ *   - The cached cluster, with the caller's reference moved to it.
+ */
+static struct osfs_cluster *osfs_cluster_add(struct osfs_sb_info *sb_info,
+                                             struct osfs_cluster *cluster)
+{
+    struct osfs_cluster *cached, *old = NULL;
+
+    spin_lock(&sb_info->cluster_lock);
+    list_for_each_entry(cached, &sb_info->cluster_lru, lru) {
+        if (cached->ino == cluster->ino && cached->index == cluster->index) {
+            refcount_inc(&cached->ref);
+            spin_unlock(&sb_info->cluster_lock);
+            osfs_cluster_put(cluster);
+            return cached;
+        }
+    }
+
+    // The cache holds a reference of its own
+    refcount_inc(&cluster->ref);
+    list_add(&cluster->lru, &sb_info->cluster_lru);
+    if (++sb_info->nr_cached_clusters > OSFS_CLUSTER_CACHE_SIZE) {
+        old = list_last_entry(&sb_info->cluster_lru, struct osfs_cluster, lru);
+        list_del(&old->lru);
+        sb_info->nr_cached_clusters--;
+    }
+    spin_unlock(&sb_info->cluster_lock);
+
+    // Freeing a vmalloc'ed buffer may sleep
+    osfs_cluster_put(old);
+    return cluster;
+}
+
+/**
+ * Function: osfs_cluster_drop
+ * Description: Removes cached clusters from the cache and drops the
+ *              cache's references to them.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - ino: Only drop the clusters of this inode, or 0 for every cluster.
+ * Returns:
+ *   - None.
+ */
+static void osfs_cluster_drop(struct osfs_sb_info *sb_info, unsigned long ino)
+{
+    struct osfs_cluster *cluster, *next;
+    LIST_HEAD(dropped);
+
+    spin_lock(&sb_info->cluster_lock);
+    list_for_each_entry_safe(cluster, next, &sb_info->cluster_lru, lru) {
+        if (ino && cluster->ino != ino)
+            continue;
+        list_move(&cluster->lru, &dropped);
+        sb_info->nr_cached_clusters--;
+    }
+    spin_unlock(&sb_info->cluster_lock);
+
+    list_for_each_entry_safe(cluster, next, &dropped, lru)
+        osfs_cluster_put(cluster);
+}
+
+/**
+ * Function: osfs_cluster_read
+ * Description: Reads one cluster of a compressed file into a new buffer,
+ *              decompressing it if it is packed. The caller holds
+ *              invalidate_lock.
+ * Inputs:
+ *   - inode: The inode of the file.
+ *   - index: The cluster's index in the file.
+ * Returns:
+ *   - The cluster with one reference on success.
+ *   - NULL if the whole cluster is a hole.
+ *   - ERR_PTR(-ENOMEM) if memory allocation fails.
+ *   - ERR_PTR(-EIO) if the extent or the packed data is corrupted.
+ */
+static struct osfs_cluster *osfs_cluster_read(struct inode *inode, uint32_t index)
+{
+    struct osfs_sb_info *sb_info = inode->i_sb->s_fs_info;
+    uint32_t lblk = index << (osfs_cluster_bits(sb_info) - sb_info->block_bits);
+    const struct osfs_extent *extent;
+    const struct osfs_cluster_header *header;
+    struct osfs_cluster *cluster;
+    uint32_t len, raw_blocks;
+    size_t stored;
+    void *packed;
+
+    extent = osfs_lookup_extent(inode, lblk, NULL, NULL);
+    if (IS_ERR_OR_NULL(extent))
+        return ERR_CAST(extent);
+    if (extent->file_block != lblk || extent->start_block >= sb_info->block_count ||
+        extent->block_count > sb_info->block_count - extent->start_block)
+        goto corrupt;
+
+    len = osfs_cluster_len(inode, index);
+    cluster = kvmalloc(struct_size(cluster, data, len), GFP_KERNEL);
+    if (!cluster)
+        return ERR_PTR(-ENOMEM);
+    refcount_set(&cluster->ref, 1);
+    cluster->ino = inode->i_ino;
+    cluster->index = index;
+    cluster->len = len;
+
+    // A cluster that did not shrink maps all of its blocks and is kept as is
+    raw_blocks = DIV_ROUND_UP(len, sb_info->block_size);
+    if (extent->block_count >= raw_blocks) {
+        osfs_blocks_copy(sb_info, extent->start_block, cluster->data, len, false);
+        return cluster;
+    }
+
+    // Packed data that straddles two chunks is gathered first
+    stored = (size_t)extent->block_count << sb_info->block_bits;
+    if (extent->block_count <= osfs_chunk_blocks_left(sb_info, extent->start_block)) {
+        packed = osfs_block_addr(sb_info, extent->start_block);
+    } else {
+        packed = kvmalloc(stored, GFP_KERNEL);
+        if (!packed) {
+            osfs_cluster_put(cluster);
+            return ERR_PTR(-ENOMEM);
+        }
+        osfs_blocks_copy(sb_info, extent->start_block, packed, stored, false);
+    }
+
+    header = packed;
+    if (header->ch_len > stored - sizeof(*header) ||
+        LZ4_decompress_safe((const char *)(header + 1), cluster->data, header->ch_len, len) != len) {
+        if (packed != osfs_block_addr(sb_info, extent->start_block))
+            kvfree(packed);
+        osfs_cluster_put(cluster);
+        goto corrupt;
+    }
+    if (packed != osfs_block_addr(sb_info, extent->start_block))
+        kvfree(packed);
+    return cluster;
+
+corrupt:
+    pr_err("osfs: Corrupted compressed cluster %u of inode %lu\n", index, inode->i_ino);
+    return ERR_PTR(-EIO);
+}
+
+/**
+ * Function: osfs_compress_map
+ * Description: Resolves a position in a compressed file to its bytes in a
+ *              decompressed cluster, from the cache if it is there.
+ * Inputs:
+ *   - inode: The inode of the file.
+ *   - pos: The file position to resolve, below the file size.
+ *   - cluster: Set to the cluster the address points into, with a
+ *              reference for the caller to drop with osfs_cluster_put;
+ *              NULL if none.
+ *   - contig: Set to the number of bytes from pos up to the end of the
+ *             cluster's data, or of the hole.
+ * Returns:
+ *   - The address of the byte at pos on success.
+ *   - NULL if pos lies in a hole.
+ *   - ERR_PTR(-ENODATA) if the file is not compressed.
+ *   - ERR_PTR(-ENOMEM) or ERR_PTR(-EIO) from osfs_cluster_read.
+ */
+void *osfs_compress_map(struct inode *inode, loff_t pos, struct osfs_cluster **cluster,
+                        size_t *contig)
+{
+    struct osfs_sb_info *sb_info = inode->i_sb->s_fs_info;
+    uint32_t bits = osfs_cluster_bits(sb_info);
+    uint32_t index = pos >> bits;
+    uint32_t offset = pos & ((1U << bits) - 1);
+    struct osfs_cluster *found;
+    void *addr;
+
+    *cluster = NULL;
+    filemap_invalidate_lock_shared(inode->i_mapping);
+    if (!osfs_is_compressed(inode->i_private)) {
+        addr = ERR_PTR(-ENODATA);
+        goto out;
+    }
+
+    found = osfs_cluster_find(sb_info, inode->i_ino, index);
+    if (!found) {
+        found = osfs_cluster_read(inode, index);
+        if (IS_ERR_OR_NULL(found)) {
+            // Holes read back as zeros up to the end of the cluster
+            *contig = (1U << bits) - offset;
+            addr = ERR_CAST(found);
+            goto out;
+        }
+        found = osfs_cluster_add(sb_info, found);
+    }
+
+    *cluster = found;
+    *contig = found->len - offset;
+    addr = found->data + offset;
+out:
+    filemap_invalidate_unlock_shared(inode->i_mapping);
+    return addr;
+}
+
+/**
+ * Function: osfs_compress_swap
+ * Description: Replaces every extent of a file with a new set whose
+ *              blocks already hold the data. The caller holds
+ *              invalidate_lock exclusively, and i_rwsem too when
+ *              compressing. An expanded file is only marked plain once
+ *              its whole tree is in place.
+ * Inputs:
+ *   - inode: The inode of the file.
+ *   - extents: The new extents, in file order.
+ *   - count: The number of new extents.
+ *   - compressed: Whether the new extents are compressed clusters.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOSPC if the new tree might not find blocks for its nodes; the
+ *     file is unchanged and the new extents are still the caller's.
+ *   - A negative error code from the tree if an insert fails; the rest
+ *     of the new extents are freed and their data is lost.
+ */
+static int osfs_compress_swap(struct inode *inode, struct osfs_extent *extents, uint32_t count,
+                              bool compressed)
+{
+    struct osfs_inode *osfs_inode = inode->i_private;
+    struct osfs_sb_info *sb_info = inode->i_sb->s_fs_info;
+    uint32_t leaf_max = (sb_info->block_size - sizeof(struct osfs_extent_header)) /
+                        sizeof(struct osfs_extent);
+    uint32_t nodes = 0, i, k;
+    int ret = 0;
+
+    // Half-full leaves, plus as many index nodes again, bound what the
+    // inserts may allocate once the old blocks are back
+    if (count > OSFS_ROOT_EXTENT_COUNT)
+        nodes = DIV_ROUND_UP(count, leaf_max / 2) * 2;
+    if (percpu_counter_sum(&sb_info->free_blocks) + osfs_inode->i_blocks < nodes)
+        return -ENOSPC;
+
+    // Readers walk the tree without invalidate_lock only while the flag is
+    // clear, so it is raised before the tree is rebuilt and dropped after.
+    // Packing holds i_rwsem exclusively, so no such walk is under way.
+    if (compressed)
+        WRITE_ONCE(osfs_inode->i_flags, osfs_inode->i_flags | OSFS_COMPRESSED_FL);
+    osfs_truncate_extents(inode, 0);
+
+    for (k = 0; k < count; k++) {
+        // Clusters go in backwards, so none merges into the one before it
+        i = compressed ? count - 1 - k : k;
+        ret = osfs_insert_extent(inode, &extents[i]);
+        if (ret) {
+            pr_err("osfs: %s inode %lu lost its data from block %u\n",
+                   compressed ? "Compressing" : "Expanding", inode->i_ino,
+                   extents[i].file_block);
+            for (; k < count; k++)
+                osfs_free_extent(sb_info, &extents[compressed ? count - 1 - k : k]);
+            break;
+        }
+    }
+
+    // i_blocks counts 512-byte sectors
+    inode->i_blocks = (blkcnt_t)osfs_inode->i_blocks << (sb_info->block_bits - 9);
+    if (!compressed) {
+        // Pairs with the acquire in osfs_is_compressed
+        smp_store_release(&osfs_inode->i_flags, osfs_inode->i_flags & ~OSFS_COMPRESSED_FL);
+    }
+    osfs_cluster_drop(sb_info, inode->i_ino);
+    return ret;
+}
+
+/**
+ * Function: osfs_compress_pack
+ * Description: Packs every cluster of a plain file into new extents and
+ *              swaps them in, if that saves any block. The caller holds
+ *              i_rwsem and invalidate_lock exclusively.
+ * Inputs:
+ *   - inode: The inode of the file, with no inline or delayed data.
+ * Returns:
+ *   - 0 on success, including when no cluster shrinks.
+ *   - -ENOMEM if memory allocation fails.
+ *   - -ENOSPC if blocks for the packed clusters cannot be found.
+ *   - -EIO if the file's extents are corrupted.
+ */
+static int osfs_compress_pack(struct inode *inode)
+{
+    struct osfs_inode *osfs_inode = inode->i_private;
+    struct osfs_sb_info *sb_info = inode->i_sb->s_fs_info;
+    uint32_t bits = osfs_cluster_bits(sb_info);
+    uint32_t nr_clusters = DIV_ROUND_UP(osfs_inode->i_size, 1U << bits);
+    struct osfs_extent_cursor cursor = { 0 };
+    struct osfs_cluster_header *header;
+    struct osfs_extent *packed;
+    uint32_t index, count = 0;
+    void *raw, *buf, *wrkmem;
+    bool saved = false;
+    int ret = -ENOMEM;
+
+    packed = kvmalloc_array(nr_clusters, sizeof(*packed), GFP_KERNEL);
+    raw = kvmalloc(1U << bits, GFP_KERNEL);
+    buf = kvmalloc(sizeof(*header) + LZ4_COMPRESSBOUND(1U << bits), GFP_KERNEL);
+    wrkmem = kvmalloc(LZ4_MEM_COMPRESS, GFP_KERNEL);
+    if (!packed || !raw || !buf || !wrkmem)
+        goto out;
+    header = buf;
+
+    for (index = 0; index < nr_clusters; index++) {
+        loff_t start = (loff_t)index << bits;
+        uint32_t len = osfs_cluster_len(inode, index);
+        uint32_t raw_blocks = DIV_ROUND_UP(len, sb_info->block_size);
+        uint32_t offset, blocks;
+        bool mapped = false;
+        void *src = raw;
+        int packed_len;
+
+        // Gather the cluster; holes come back as zeros
+        for (offset = 0; offset < len; ) {
+            size_t contig;
+            void *addr;
+
+            addr = osfs_map_pos(inode, start + offset, &cursor, &contig);
+            if (IS_ERR(addr)) {
+                ret = PTR_ERR(addr);
+                goto out_free;
+            }
+            contig = min_t(size_t, contig, len - offset);
+            if (addr) {
+                memcpy(raw + offset, addr, contig);
+                mapped = true;
+            } else {
+                memset(raw + offset, 0, contig);
+            }
+            offset += contig;
+        }
+        // A cluster that is all hole stays one
+        if (!mapped)
+            continue;
+
+        blocks = raw_blocks;
+        packed_len = LZ4_compress_default(raw, (char *)(header + 1), len,
+                                          LZ4_COMPRESSBOUND(1U << bits), wrkmem);
+        if (packed_len > 0 &&
+            DIV_ROUND_UP(sizeof(*header) + packed_len, sb_info->block_size) < raw_blocks) {
+            header->ch_len = packed_len;
+            header->ch_reserved = 0;
+            blocks = DIV_ROUND_UP(sizeof(*header) + packed_len, sb_info->block_size);
+            len = sizeof(*header) + packed_len;
+            src = buf;
+            saved = true;
+        }
+
+        // Free blocks are kept zeroed, so only the bytes used are copied
+        ret = osfs_alloc_extent(sb_info, blocks, &packed[count]);
+        if (ret)
+            goto out_free;
+        packed[count].file_block = index << (bits - sb_info->block_bits);
+        osfs_blocks_copy(sb_info, packed[count].start_block, src, len, true);
+        count++;
+    }
+
+    ret = 0;
+    if (saved) {
+        ret = osfs_compress_swap(inode, packed, count, true);
+        if (ret != -ENOSPC)
+            goto out;
+    }
+
+out_free:
+    while (count-- > 0)
+        osfs_free_extent(sb_info, &packed[count]);
+out:
+    kvfree(wrkmem);
+    kvfree(buf);
+    kvfree(raw);
+    kvfree(packed);
+    return ret;
+}
+
+/**
+ * Function: osfs_compress_file
+ * Description: Compresses a file, unless it is inline, already compressed,
+ *              empty or mapped; a mapped file is left for a later close.
+ *              The caller holds i_rwsem exclusively.
+ * Inputs:
+ *   - inode: The inode of the file.
+ * Returns:
+ *   - 0 on success or if the file is left as it is.
+ *   - -EOPNOTSUPP on a DAX file, whose blocks are the device's own.
+ *   - A negative error code from osfs_delalloc_flush or packing on failure.
+ */
+int osfs_compress_file(struct inode *inode)
+{
+    struct osfs_inode *osfs_inode = inode->i_private;
+    int ret;
+
+    if (IS_DAX(inode))
+        return -EOPNOTSUPP;
+    if (osfs_has_inline_data(osfs_inode) || osfs_is_compressed(osfs_inode) ||
+        !osfs_inode->i_size)
+        return 0;
+
+    ret = osfs_delalloc_flush(inode, false);
+    if (ret)
+        return ret;
+
+    filemap_invalidate_lock(inode->i_mapping);
+    // Faults on a mapping would map packed blocks as data
+    if (!mapping_mapped(inode->i_mapping))
+        ret = osfs_compress_pack(inode);
+    filemap_invalidate_unlock(inode->i_mapping);
+    return ret;
+}
+
+/**
+ * Function: osfs_compress_work
+ * Description: Compresses a file queued by osfs_compress_schedule, unless
+ *              it was unlinked or is no longer marked for compression.
+ *              Failures are logged. Drops the reference the queueing took.
+ */
+void osfs_compress_work(struct work_struct *work)
+{
+    struct osfs_inode_info *info = container_of(work, struct osfs_inode_info, i_compress_work);
+    struct inode *inode = &info->vfs_inode;
+    struct osfs_sb_info *sb_info = inode->i_sb->s_fs_info;
+    struct osfs_inode *osfs_inode = inode->i_private;
+    int ret = 0;
+
+    // The closing file may still count as a writer here, so that is not
+    // checked; a later write expands the file again under i_rwsem
+    inode_lock(inode);
+    if (inode->i_nlink && (sb_info->compress || (osfs_inode->i_flags & OSFS_COMPR_FL)))
+        ret = osfs_compress_file(inode);
+    inode_unlock(inode);
+    if (ret)
+        pr_err("osfs: Could not compress inode %lu: %d\n", inode->i_ino, ret);
+    iput(inode);
+}
+
+/**
+ * Function: osfs_compress_schedule
+ * Description: Queues a file to be compressed in the background. The work
+ *              holds a reference, so the inode stays until it has run; a
+ *              file already queued is not queued twice.
+ */
+void osfs_compress_schedule(struct inode *inode)
+{
+    struct osfs_sb_info *sb_info = inode->i_sb->s_fs_info;
+
+    if (!igrab(inode))
+        return;
+    if (!queue_work(sb_info->compress_wq, &OSFS_I(inode)->i_compress_work))
+        iput(inode);
+}
+
+/**
+ * Function: osfs_compress_expand
+ * Description: Decompresses every cluster of a file into new blocks and
+ *              swaps them in, leaving a plain file. Does nothing for a
+ *              file that is not compressed. May be called without i_rwsem.
+ * Inputs:
+ *   - inode: The inode of the file.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOMEM if memory allocation fails.
+ *   - -ENOSPC if the plain data does not fit; the file stays compressed.
+ *   - -EIO if a cluster is corrupted.
+ */
+int osfs_compress_expand(struct inode *inode)
+{
+    struct osfs_inode *osfs_inode = inode->i_private;
+    struct osfs_sb_info *sb_info = inode->i_sb->s_fs_info;
+    uint32_t bits = osfs_cluster_bits(sb_info);
+    struct osfs_extent *plain = NULL;
+    uint32_t index, nr_clusters, count = 0, max = 0;
+    uint32_t goal = U32_MAX;
+    int ret = 0;
+
+    filemap_invalidate_lock(inode->i_mapping);
+    if (!osfs_is_compressed(osfs_inode))
+        goto out;
+
+    nr_clusters = DIV_ROUND_UP(osfs_inode->i_size, 1U << bits);
+    for (index = 0; index < nr_clusters; index++) {
+        uint32_t lblk = index << (bits - sb_info->block_bits);
+        struct osfs_cluster *cluster;
+        uint32_t offset = 0;
+
+        cluster = osfs_cluster_find(sb_info, inode->i_ino, index);
+        if (!cluster)
+            cluster = osfs_cluster_read(inode, index);
+        if (IS_ERR(cluster)) {
+            ret = PTR_ERR(cluster);
+            goto out_free;
+        }
+        if (!cluster)
+            continue;
+
+        // Place the cluster after the previous one where there is room
+        while (offset < cluster->len) {
+            struct osfs_extent extent;
+
+            ret = osfs_alloc_blocks(sb_info, goal,
+                                    DIV_ROUND_UP(cluster->len - offset, sb_info->block_size),
+                                    &extent);
+            if (ret) {
+                osfs_cluster_put(cluster);
+                goto out_free;
+            }
+            osfs_blocks_copy(sb_info, extent.start_block, cluster->data + offset,
+                             min_t(size_t, cluster->len - offset,
+                                   (size_t)extent.block_count << sb_info->block_bits),
+                             true);
+            extent.file_block = lblk + (offset >> sb_info->block_bits);
+            offset += extent.block_count << sb_info->block_bits;
+            goal = extent.start_block + extent.block_count;
+
+            if (count && plain[count - 1].file_block + plain[count - 1].block_count ==
+                             extent.file_block &&
+                plain[count - 1].start_block + plain[count - 1].block_count ==
+                    extent.start_block) {
+                plain[count - 1].block_count += extent.block_count;
+                continue;
+            }
+            if (count == max) {
+                struct osfs_extent *grown;
+
+                max = max ? max * 2 : OSFS_ROOT_EXTENT_COUNT;
+                grown = kvmalloc_array(max, sizeof(*grown), GFP_KERNEL);
+                if (!grown) {
+                    osfs_free_extent(sb_info, &extent);
+                    osfs_cluster_put(cluster);
+                    ret = -ENOMEM;
+                    goto out_free;
+                }
+                if (count)
+                    memcpy(grown, plain, count * sizeof(*grown));
+                kvfree(plain);
+                plain = grown;
+            }
+            plain[count++] = extent;
+        }
+        osfs_cluster_put(cluster);
+    }
+
+    ret = osfs_compress_swap(inode, plain, count, false);
+    if (ret != -ENOSPC)
+        goto out;
+
+out_free:
+    while (count-- > 0)
+        osfs_free_extent(sb_info, &plain[count]);
+out:
+    filemap_invalidate_unlock(inode->i_mapping);
+    kvfree(plain);
+    return ret;
+}
+
+/**
+ * Function: osfs_compress_forget
+ * Description: Drops the cached clusters of an inode being evicted, so a
+ *              new file that reuses the inode number cannot hit them.
+ */
+void osfs_compress_forget(struct inode *inode)
+{
+    osfs_cluster_drop(inode->i_sb->s_fs_info, inode->i_ino);
+}
+
+/**
+ * Function: osfs_compress_init
+ * Description: Creates the workqueue that compresses closed files.
+ * Returns:
+ *   - 0 on success, or -ENOMEM.
+ */
+int osfs_compress_init(struct osfs_sb_info *sb_info)
+{
+    sb_info->compress_wq = alloc_workqueue("osfs-compress", WQ_UNBOUND, 0);
+    return sb_info->compress_wq ? 0 : -ENOMEM;
+}
+
+/**
+ * Function: osfs_compress_destroy
+ * Description: Frees every cached cluster and the workqueue at unmount.
+ */
+void osfs_compress_destroy(struct osfs_sb_info *sb_info)
+{
+    osfs_cluster_drop(sb_info, 0);
+    if (sb_info->compress_wq)
+        destroy_workqueue(sb_info->compress_wq);
+}
+
+/**
+ * Function: osfs_fileattr_get
+ * Description: Reports FS_COMPR_FL for a file that is marked for
+ *              compression or is compressed, for lsattr.
+ * Inputs:
+ *   - dentry: The dentry of the file.
+ *   - fa: The attributes to fill in.
+ * Returns:
+ *   - 0.
+ */
+int osfs_fileattr_get(struct dentry *dentry, struct fileattr *fa)
+{
+    struct osfs_inode *osfs_inode = d_inode(dentry)->i_private;
+    uint32_t flags = 0;
+
+    if (READ_ONCE(osfs_inode->i_flags) & (OSFS_COMPR_FL | OSFS_COMPRESSED_FL))
+        flags |= FS_COMPR_FL;
+    fileattr_fill_flags(fa, flags);
+    return 0;
+}
+
+/**
+ * Function: osfs_fileattr_set
+ * Description: Handles chattr +c and -c. Setting FS_COMPR_FL marks the
+ *              file and compresses it at once; clearing it expands the
+ *              file. The VFS holds i_rwsem exclusively.
+ * Inputs:
+ *   - idmap: The idmap of the mount.
+ *   - dentry: The dentry of the file.
+ *   - fa: The new attributes.
+ * Returns:
+ *   - 0 on success.
+ *   - -EOPNOTSUPP for any flag but FS_COMPR_FL, or +c on a DAX file.
+ *   - A negative error code from compressing or expanding on failure.
+ */
+int osfs_fileattr_set(struct mnt_idmap *idmap, struct dentry *dentry, struct fileattr *fa)
+{
+    struct inode *inode = d_inode(dentry);
+    struct osfs_inode *osfs_inode = inode->i_private;
+    int ret;
+
+    if (fileattr_has_fsx(fa) || (fa->flags & ~FS_COMPR_FL))
+        return -EOPNOTSUPP;
+
+    if (fa->flags & FS_COMPR_FL) {
+        if (IS_DAX(inode))
+            return -EOPNOTSUPP;
+        WRITE_ONCE(osfs_inode->i_flags, osfs_inode->i_flags | OSFS_COMPR_FL);
+        ret = osfs_compress_file(inode);
+    } else {
+        WRITE_ONCE(osfs_inode->i_flags, osfs_inode->i_flags & ~OSFS_COMPR_FL);
+        ret = osfs_compress_expand(inode);
+    }
+
+    inode_set_ctime_current(inode);
+    mark_inode_dirty(inode);
+    return ret;
+}
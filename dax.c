@@ -0,0 +1,208 @@
+#include <linux/fs.h>
+#include <linux/dax.h>
+#include <linux/mm.h>
+#include <linux/pagemap.h>
+#include <linux/pfn_t.h>
+#include "osfs.h"
+
+/*
+ * Direct access.
+ *
+ * With the dax option, a filesystem mounted from a DAX-capable block
+ * device does not copy its data area into memory. Such a device is pmem,
+ * including the emulated pmem of the memmap= boot option. The chunks point
+ * straight into the device's own mapping, so read_iter and write_iter copy
+ * between the user buffer and the device, and mmap faults insert the
+ * device's pfns. No page cache or vmalloc copy sits in between.
+ *
+ * Blocks must be one page, so that a fault maps exactly one block. The
+ * whole data area is mapped once at mount; the device stays open while
+ * the filesystem is mounted, so the mapping cannot go away under it.
+ *
+ * Writes to a hole allocate their blocks at once rather than through
+ * delayed allocation, and the data goes out with cache-bypassing stores.
+ * Freed blocks keep their old contents on the device, so blocks are
+ * zeroed when they are claimed instead of when they are freed. A sync
+ * saves the metadata as usual. For the data blocks it only writes the
+ * CPU cache back; fsync does the same for the blocks of one file.
+ *
+ * Directory and extent-tree blocks are updated in place on the device
+ * too, so between syncs they run ahead of the bitmaps and the inode table
+ * in the image, and no journal transaction could cover them. A DAX mount
+ * is therefore not journaled and not crash-safe. The header is marked
+ * incomplete at mount, every sync is a full save that leaves it so, and
+ * only the save at unmount marks it clean. After a crash while mounted,
+ * the next mount refuses the image.
+ */
+
+/**
+ * Function: osfs_dax_open
+ * Description: Opens the DAX device behind the block device a filesystem
+ *              is mounted from.
+ * Inputs:
+ *   - sb: The superblock of the mounted device; s_fs_info is set.
+ * Returns:
+ *   - 0 on success.
+ *   - -EOPNOTSUPP if the device does not support DAX.
+ */
+int osfs_dax_open(struct super_block *sb)
+{
+    struct osfs_sb_info *sb_info = sb->s_fs_info;
+
+    sb_info->dax_dev = fs_dax_get_by_bdev(sb->s_bdev, &sb_info->dax_off, sb_info, NULL);
+    if (!sb_info->dax_dev) {
+        pr_err("osfs: %s does not support DAX\n", sb->s_id);
+        return -EOPNOTSUPP;
+    }
+    return 0;
+}
+
+/**
+ * Function: osfs_dax_map
+ * Description: Points every chunk of the data area at the device. Called
+ *              at mount once the layout of the device is known.
+ * Inputs:
+ *   - sb: The superblock of the filesystem.
+ *   - data_off: The byte offset of data block 0 on the device.
+ * Returns:
+ *   - 0 on success.
+ *   - -EINVAL if the data area is not page aligned or cannot be mapped
+ *     in one piece.
+ *   - A negative error code from dax_direct_access.
+ */
+int osfs_dax_map(struct super_block *sb, uint64_t data_off)
+{
+    struct osfs_sb_info *sb_info = sb->s_fs_info;
+    uint32_t chunk;
+    void *kaddr;
+    long mapped;
+    int id;
+
+    if (!PAGE_ALIGNED(sb_info->dax_off + data_off)) {
+        pr_err("osfs: Data area of %s is not page aligned\n", sb->s_id);
+        return -EINVAL;
+    }
+
+    id = dax_read_lock();
+    mapped = dax_direct_access(sb_info->dax_dev, (sb_info->dax_off + data_off) >> PAGE_SHIFT,
+                               sb_info->block_count, DAX_ACCESS, &kaddr, &sb_info->dax_pfn);
+    dax_read_unlock(id);
+    if (mapped < 0)
+        return mapped;
+    if (mapped < sb_info->block_count) {
+        pr_err("osfs: %s cannot map its data area in one piece\n", sb->s_id);
+        return -EINVAL;
+    }
+
+    for (chunk = 0; chunk < sb_info->chunk_count; chunk++)
+        sb_info->chunks[chunk] = (char *)kaddr + ((size_t)chunk << OSFS_CHUNK_SHIFT);
+    return 0;
+}
+
+/**
+ * Function: osfs_dax_close
+ * Description: Drops the DAX device at unmount, if there is one.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ * Returns:
+ *   - None.
+ */
+void osfs_dax_close(struct osfs_sb_info *sb_info)
+{
+    if (!sb_info->dax_dev)
+        return;
+    fs_put_dax(sb_info->dax_dev, sb_info);
+    sb_info->dax_dev = NULL;
+}
+
+/**
+ * Function: osfs_dax_fault
+ * Description: Maps the device page of a data block into a faulting
+ *              mapping.
+ * Inputs:
+ *   - vmf: The fault being handled.
+ *   - addr: The address of the block in the data area.
+ * Returns:
+ *   - VM_FAULT_NOPAGE once the pfn is mapped.
+ *   - VM_FAULT_OOM or VM_FAULT_SIGBUS if it cannot be.
+ */
+vm_fault_t osfs_dax_fault(struct vm_fault *vmf, void *addr)
+{
+    struct osfs_sb_info *sb_info = file_inode(vmf->vma->vm_file)->i_sb->s_fs_info;
+    unsigned long index = ((char *)addr - (char *)sb_info->chunks[0]) >> PAGE_SHIFT;
+    pfn_t pfn = __pfn_to_pfn_t(pfn_t_to_pfn(sb_info->dax_pfn) + index,
+                               sb_info->dax_pfn.val & PFN_FLAGS_MASK);
+
+    if (vmf->flags & FAULT_FLAG_WRITE)
+        return vmf_insert_mixed_mkwrite(vmf->vma, vmf->address, pfn);
+    return vmf_insert_mixed(vmf->vma, vmf->address, pfn);
+}
+
+/**
+ * Function: osfs_dax_alloc
+ * Description: Maps blocks into a hole of a DAX file for a write, since
+ *              DAX writes go straight to the device instead of through
+ *              delayed allocation. The caller holds i_rwsem exclusively.
+ * Inputs:
+ *   - inode: The inode of the file.
+ *   - pos: The position of the write, inside a hole.
+ *   - len: The length of the write.
+ *   - extent: Filled with the new mapping; it may end before the write does.
+ * Returns:
+ *   - 0 on success.
+ *   - A negative error code from the allocator or the tree on failure.
+ */
+int osfs_dax_alloc(struct inode *inode, loff_t pos, size_t len, struct osfs_extent *extent)
+{
+    struct osfs_sb_info *sb_info = inode->i_sb->s_fs_info;
+    uint32_t lblk = pos >> sb_info->block_bits;
+    uint32_t last_lblk = (pos + len - 1) >> sb_info->block_bits;
+    const struct osfs_extent *current_extent;
+    uint32_t next_lblk;
+    int ret;
+
+    // Faults walk the tree under invalidate_lock
+    filemap_invalidate_lock(inode->i_mapping);
+    current_extent = osfs_lookup_extent(inode, lblk, NULL, &next_lblk);
+    if (IS_ERR(current_extent))
+        ret = PTR_ERR(current_extent);
+    else
+        ret = osfs_alloc_file_blocks(inode, lblk, min(last_lblk - lblk + 1, next_lblk - lblk),
+                                     extent);
+    filemap_invalidate_unlock(inode->i_mapping);
+    return ret;
+}
+
+/**
+ * Function: osfs_dax_flush_file
+ * Description: Writes the CPU cache back over the blocks of a range of a
+ *              DAX file, so that stores made through a mapping are on
+ *              the device.
+ * Inputs:
+ *   - inode: The inode of the file.
+ *   - start: The start of the range.
+ *   - end: The last byte of the range.
+ * Returns:
+ *   - 0 on success.
+ *   - -EIO if the file's extents are corrupted.
+ */
+int osfs_dax_flush_file(struct inode *inode, loff_t start, loff_t end)
+{
+    struct osfs_sb_info *sb_info = inode->i_sb->s_fs_info;
+    loff_t pos = start;
+
+    end = min(end, i_size_read(inode) - 1);
+    while (pos <= end) {
+        size_t contig;
+        void *addr;
+
+        addr = osfs_map_pos(inode, pos, NULL, &contig);
+        if (IS_ERR(addr))
+            return PTR_ERR(addr);
+        contig = min_t(uint64_t, contig, end - pos + 1);
+        if (addr)
+            dax_flush(sb_info->dax_dev, addr, contig);
+        pos += contig;
+    }
+    return 0;
+}
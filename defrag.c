@@ -0,0 +1,214 @@
+#include <linux/fs.h>
+#include <linux/pagemap.h>
+#include <linux/uaccess.h>
+#include "osfs.h"
+
+/*
+ * Online defragmentation.
+ *
+ * OSFS_IOC_DEFRAG rewrites one file so that each run of logically
+ * adjacent blocks is a single extent. Every run gets a new contiguous
+ * range from the allocator's first fit, which lies as low in the data
+ * area as free space allows. The data is copied over, the old extent
+ * tree is freed, and the new extents are inserted. A file is only moved
+ * if that merges extents or brings a run lower. Running the ioctl over
+ * every file, e.g. from find(1), therefore packs the data towards the
+ * start of the area and coalesces the free space above it.
+ *
+ * The file is held with i_rwsem and invalidate_lock exclusive, so reads,
+ * writes and faults wait while it moves; stale extent cursors are caught
+ * by i_ext_generation. Mapped files are refused, since their pages would
+ * keep pointing at the old blocks. Only files whose runs all fit in the
+ * root of the tree are moved, so rebuilding the tree never needs a block
+ * and cannot fail once the old blocks are gone. Compressed files are left
+ * alone, since their extents are clusters rather than runs.
+ */
+
+/**
+ * Function: osfs_defrag_runs
+ * Description: Collects the logical runs of a file, merging extents that
+ *              are adjacent in the file.
+ * Inputs:
+ *   - inode: The inode of the file.
+ *   - runs: Filled with up to OSFS_ROOT_EXTENT_COUNT runs; start_block
+ *           holds the physical start of the first extent of each.
+ *   - nr_runs: Set to the number of runs.
+ *   - nr_extents: Set to the number of extents.
+ * Returns:
+ *   - 0 on success.
+ *   - -EOPNOTSUPP if the file has more runs than the root holds.
+ *   - -EIO if the extent tree is corrupted.
+ */
+static int osfs_defrag_runs(struct inode *inode, struct osfs_extent *runs,
+                            uint32_t *nr_runs, uint32_t *nr_extents)
+{
+    const struct osfs_extent *extent;
+    uint32_t lblk = 0, next_lblk;
+
+    *nr_runs = 0;
+    *nr_extents = 0;
+    for (;;) {
+        extent = osfs_lookup_extent(inode, lblk, NULL, &next_lblk);
+        if (IS_ERR(extent))
+            return PTR_ERR(extent);
+        if (!extent) {
+            if (next_lblk == U32_MAX)
+                return 0;
+            lblk = next_lblk;
+            continue;
+        }
+
+        if (*nr_runs && runs[*nr_runs - 1].file_block +
+                        runs[*nr_runs - 1].block_count == extent->file_block) {
+            runs[*nr_runs - 1].block_count += extent->block_count;
+        } else {
+            if (*nr_runs == OSFS_ROOT_EXTENT_COUNT)
+                return -EOPNOTSUPP;
+            runs[(*nr_runs)++] = *extent;
+        }
+        (*nr_extents)++;
+
+        lblk = extent->file_block + extent->block_count;
+        if (lblk == 0)
+            return 0;
+    }
+}
+
+/**
+ * Function: osfs_defrag_file
+ * Description: Moves each run of a file into one new extent. The caller
+ *              holds i_rwsem and invalidate_lock exclusively.
+ * Inputs:
+ *   - inode: The inode of the file.
+ *   - report: extents_before, extents_after and moved_blocks are filled in.
+ * Returns:
+ *   - 0 on success, including when there is nothing to gain.
+ *   - -EOPNOTSUPP if the file has more runs than the root holds.
+ *   - -ENOSPC if a run finds no contiguous free range.
+ *   - -EIO if the extent tree is corrupted.
+ */
+static int osfs_defrag_file(struct inode *inode, struct osfs_defrag_report *report)
+{
+    struct osfs_inode *osfs_inode = inode->i_private;
+    struct osfs_sb_info *sb_info = inode->i_sb->s_fs_info;
+    struct osfs_extent runs[OSFS_ROOT_EXTENT_COUNT];
+    struct osfs_extent moved[OSFS_ROOT_EXTENT_COUNT];
+    struct osfs_extent_cursor cursor = { 0 };
+    uint32_t nr_runs, nr_extents, prealloc_start, i, j;
+    bool gain;
+    int ret;
+
+    ret = osfs_defrag_runs(inode, runs, &nr_runs, &nr_extents);
+    if (ret)
+        return ret;
+    report->extents_before = nr_extents;
+    report->extents_after = nr_extents;
+
+    // Take the new ranges first; nothing changes if one cannot be found
+    gain = nr_extents > nr_runs;
+    for (i = 0; i < nr_runs; i++) {
+        ret = osfs_alloc_extent(sb_info, runs[i].block_count, &moved[i]);
+        if (ret)
+            goto out_free;
+        moved[i].file_block = runs[i].file_block;
+        if (moved[i].start_block < runs[i].start_block)
+            gain = true;
+    }
+    if (!gain)
+        goto out_free;
+
+    for (i = 0; i < nr_runs; i++) {
+        for (j = 0; j < moved[i].block_count; j++) {
+            loff_t pos = (loff_t)(moved[i].file_block + j) << sb_info->block_bits;
+            size_t contig;
+            void *src;
+
+            src = osfs_map_pos(inode, pos, &cursor, &contig);
+            if (IS_ERR_OR_NULL(src)) {
+                ret = -EIO;
+                i = nr_runs;
+                goto out_free;
+            }
+            memcpy(osfs_block_addr(sb_info, moved[i].start_block + j), src,
+                   sb_info->block_size);
+        }
+        osfs_mark_dirty(sb_info, moved[i].start_block, moved[i].block_count);
+    }
+
+    // Swap the trees; with the root empty the inserts need no new node
+    prealloc_start = osfs_inode->i_prealloc_start;
+    osfs_truncate_extents(inode, 0);
+    for (i = 0; i < nr_runs; i++) {
+        ret = osfs_insert_extent(inode, &moved[i]);
+        if (ret) {
+            pr_err("osfs: Defragmenting inode %lu lost its data from block %u\n",
+                   inode->i_ino, moved[i].file_block);
+            for (; i < nr_runs; i++)
+                osfs_free_extent(sb_info, &moved[i]);
+            return ret;
+        }
+        report->moved_blocks += moved[i].block_count;
+    }
+    osfs_inode->i_prealloc_start = prealloc_start;
+    report->extents_after = osfs_inode->i_extent_count;
+    return 0;
+
+out_free:
+    // Give back the first i new ranges
+    while (i-- > 0)
+        osfs_free_extent(sb_info, &moved[i]);
+    return ret;
+}
+
+/**
+ * Function: osfs_ioc_defrag
+ * Description: Handles OSFS_IOC_DEFRAG on an open file.
+ * Inputs:
+ *   - filp: The file to defragment, open for writing.
+ *   - arg: User pointer to the struct osfs_defrag_report to fill.
+ * Returns:
+ *   - 0 on success.
+ *   - -EBADF if the file is not open for writing.
+ *   - -EBUSY if the file is memory-mapped.
+ *   - -EFAULT if the report cannot be copied out.
+ *   - A negative error code from osfs_defrag_file on failure.
+ */
+long osfs_ioc_defrag(struct file *filp, struct osfs_defrag_report __user *arg)
+{
+    struct inode *inode = file_inode(filp);
+    struct osfs_sb_info *sb_info = inode->i_sb->s_fs_info;
+    struct osfs_defrag_report report = { 0 };
+    int ret;
+
+    if (!(filp->f_mode & FMODE_WRITE))
+        return -EBADF;
+
+    osfs_free_space_stats(sb_info, &report.free_runs_before, &report.largest_free_before);
+
+    inode_lock(inode);
+    // Delayed blocks are placed first so they are part of the layout
+    ret = osfs_delalloc_flush(inode, false);
+    if (ret)
+        goto out_unlock;
+
+    filemap_invalidate_lock(inode->i_mapping);
+    if (mapping_mapped(inode->i_mapping))
+        ret = -EBUSY;
+    else if (!osfs_has_inline_data(inode->i_private) && !osfs_is_compressed(inode->i_private))
+        ret = osfs_defrag_file(inode, &report);
+    filemap_invalidate_unlock(inode->i_mapping);
+out_unlock:
+    inode_unlock(inode);
+    if (ret)
+        return ret;
+
+    osfs_free_space_stats(sb_info, &report.free_runs_after, &report.largest_free_after);
+    pr_info("osfs: Defragmented inode %lu: %u -> %u extents, free runs %u -> %u, largest free run %u -> %u blocks\n",
+            inode->i_ino, report.extents_before, report.extents_after,
+            report.free_runs_before, report.free_runs_after,
+            report.largest_free_before, report.largest_free_after);
+
+    if (copy_to_user(arg, &report, sizeof(report)))
+        return -EFAULT;
+    return 0;
+}
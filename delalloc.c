@@ -0,0 +1,237 @@
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/pagemap.h>
+#include <linux/xarray.h>
+#include "osfs.h"
+
+/*
+ * Delayed allocation.
+ *
+ * A write to a block that no extent maps does not pick a physical block.
+ * The data goes into a zeroed page kept in the inode's i_delalloc xarray,
+ * indexed by logical block, and one block is reserved from the
+ * free_blocks counter so the write still fails with -ENOSPC up front.
+ * Reads, splice and faults find those pages through osfs_map_pos.
+ *
+ * The blocks are placed when the file is flushed: on close, on fsync,
+ * before fallocate, and by the writer itself once OSFS_DELALLOC_MAX_BLOCKS
+ * blocks are pending, which bounds the memory an open file can pin. A
+ * flush hands every run of consecutive pending blocks to the allocator
+ * in one request, so a file written in many small pieces still gets one
+ * extent per run. The goal of that request is the block after the
+ * previous one, so the run continues the file's last extent in place.
+ *
+ * Pages are added under i_rwsem. A flush holds i_rwsem exclusively and
+ * also takes invalidate_lock, so no fault can map a page while it is
+ * being placed. Mappings of the page are torn down first and fault in
+ * again on the new block.
+ */
+
+/**
+ * Function: osfs_prealloc_window
+ * Description: Sizes the speculative preallocation mapped past a run
+ *              placed at the tail of a file. The window follows the size
+ *              of the file, so small files stay small while streaming
+ *              appenders get long extents; it is capped by
+ *              OSFS_PREALLOC_MAX_BYTES and by a quarter of the free space.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - lblk: The first logical block of the run.
+ *   - blocks_needed: The number of blocks in the run.
+ * Returns:
+ *   - The number of extra blocks to map, possibly 0.
+ */
+static uint32_t osfs_prealloc_window(struct osfs_sb_info *sb_info, uint32_t lblk,
+                                     uint32_t blocks_needed)
+{
+    uint32_t spare = percpu_counter_read_positive(&sb_info->free_blocks) / 4;
+
+    if (blocks_needed >= spare)
+        return 0;
+    return min3(lblk, (uint32_t)(OSFS_PREALLOC_MAX_BYTES >> sb_info->block_bits),
+                spare - blocks_needed);
+}
+
+/**
+ * Function: osfs_delalloc_block
+ * Description: Returns the page holding the pending data of a logical
+ *              block, creating it and reserving a block for it if there
+ *              is none. The caller holds i_rwsem exclusively.
+ * Inputs:
+ *   - inode: The inode of the file.
+ *   - lblk: The logical block, which no extent maps.
+ *   - nowait: Fail instead of allocating a new page.
+ * Returns:
+ *   - The kernel address of the block's data on success.
+ *   - ERR_PTR(-EAGAIN) if nowait is set and the page does not exist yet.
+ *   - ERR_PTR(-ENOSPC) if no block can be reserved.
+ *   - ERR_PTR(-ENOMEM) if memory allocation fails.
+ */
+void *osfs_delalloc_block(struct inode *inode, uint32_t lblk, bool nowait)
+{
+    struct osfs_inode_info *info = OSFS_I(inode);
+    struct osfs_sb_info *sb_info = inode->i_sb->s_fs_info;
+    struct page *page;
+    int ret;
+
+    page = xa_load(&info->i_delalloc, lblk);
+    if (page)
+        return page_address(page);
+    if (nowait)
+        return ERR_PTR(-EAGAIN);
+
+    ret = osfs_reserve_blocks(sb_info, 1);
+    if (ret)
+        return ERR_PTR(ret);
+
+    page = alloc_page(GFP_KERNEL | __GFP_ZERO);
+    if (!page) {
+        ret = -ENOMEM;
+        goto out_unreserve;
+    }
+    ret = xa_err(xa_store(&info->i_delalloc, lblk, page, GFP_KERNEL));
+    if (ret) {
+        put_page(page);
+        goto out_unreserve;
+    }
+
+    info->i_delalloc_count++;
+    return page_address(page);
+
+out_unreserve:
+    osfs_unreserve_blocks(sb_info, 1);
+    return ERR_PTR(ret);
+}
+
+/**
+ * Function: osfs_delalloc_lookup
+ * Description: Finds the pending data of a logical block that no extent maps.
+ * Inputs:
+ *   - inode: The inode of the file.
+ *   - lblk: The logical block.
+ *   - next_lblk: The first mapped block after lblk, or U32_MAX. If lblk
+ *                has no pending data, lowered to the first block after it
+ *                that has, should that come first.
+ * Returns:
+ *   - The kernel address of the block's data, or NULL if there is none.
+ */
+void *osfs_delalloc_lookup(struct inode *inode, uint32_t lblk, uint32_t *next_lblk)
+{
+    unsigned long index = lblk;
+    struct page *page;
+
+    page = xa_find(&OSFS_I(inode)->i_delalloc, &index, *next_lblk, XA_PRESENT);
+    if (!page)
+        return NULL;
+    if (index == lblk)
+        return page_address(page);
+
+    *next_lblk = index;
+    return NULL;
+}
+
+/**
+ * Function: osfs_delalloc_flush
+ * Description: Places every pending block of a file, copying the data
+ *              into the new extents and freeing the pages. The caller
+ *              holds i_rwsem exclusively, or is evicting the inode.
+ * Inputs:
+ *   - inode: The inode of the file.
+ *   - prealloc: Map an append window past a run at the tail of the file,
+ *               for a writer that is still going.
+ * Returns:
+ *   - 0 on success.
+ *   - A negative error code from the allocator or the tree. Blocks that
+ *     could not be placed stay pending and reserved.
+ */
+int osfs_delalloc_flush(struct inode *inode, bool prealloc)
+{
+    struct osfs_inode_info *info = OSFS_I(inode);
+    struct osfs_inode *osfs_inode = inode->i_private;
+    struct osfs_sb_info *sb_info = inode->i_sb->s_fs_info;
+    unsigned long index = 0;
+    int ret = 0;
+
+    if (xa_empty(&info->i_delalloc))
+        return 0;
+
+    filemap_invalidate_lock(inode->i_mapping);
+    while (xa_find(&info->i_delalloc, &index, ULONG_MAX, XA_PRESENT)) {
+        uint32_t lblk = index, count = 1, window = 0;
+
+        // The run of consecutive pending blocks starting here
+        while (xa_load(&info->i_delalloc, lblk + count))
+            count++;
+
+        if (prealloc && !osfs_inode->i_prealloc_start) {
+            unsigned long after = lblk + count;
+            uint32_t next_lblk;
+
+            if (!xa_find(&info->i_delalloc, &after, ULONG_MAX, XA_PRESENT) &&
+                !osfs_lookup_extent(inode, lblk + count, NULL, &next_lblk) &&
+                next_lblk == U32_MAX)
+                window = osfs_prealloc_window(sb_info, lblk, count);
+        }
+
+        // Pages of the run mapped by a fault would go stale
+        unmap_mapping_range(inode->i_mapping, (loff_t)lblk << sb_info->block_bits,
+                            (loff_t)count << sb_info->block_bits, 1);
+
+        // The allocator takes the blocks from the free count again
+        osfs_unreserve_blocks(sb_info, count);
+        while (count) {
+            struct osfs_extent extent;
+            uint32_t placed, i;
+
+            ret = osfs_alloc_file_blocks(inode, lblk, count + window, &extent);
+            if (ret) {
+                osfs_reserve_blocks_nofail(sb_info, count);
+                goto out;
+            }
+
+            placed = min(extent.block_count, count);
+            for (i = 0; i < placed; i++) {
+                struct page *page = xa_erase(&info->i_delalloc, lblk + i);
+
+                memcpy(osfs_block_addr(sb_info, extent.start_block + i),
+                       page_address(page), sb_info->block_size);
+                put_page(page);
+            }
+            osfs_mark_dirty(sb_info, extent.start_block, placed);
+            info->i_delalloc_count -= placed;
+
+            if (extent.block_count > count)
+                osfs_inode->i_prealloc_start = lblk + count;
+            lblk += placed;
+            count -= placed;
+            window = 0;
+        }
+        index = lblk;
+    }
+out:
+    filemap_invalidate_unlock(inode->i_mapping);
+    return ret;
+}
+
+/**
+ * Function: osfs_delalloc_drop
+ * Description: Frees every pending page of a file and returns its
+ *              reservation, discarding the data.
+ * Inputs:
+ *   - inode: The inode of the file.
+ * Returns:
+ *   - None.
+ */
+void osfs_delalloc_drop(struct inode *inode)
+{
+    struct osfs_inode_info *info = OSFS_I(inode);
+    struct page *page;
+    unsigned long index;
+
+    xa_for_each(&info->i_delalloc, index, page)
+        put_page(page);
+    xa_destroy(&info->i_delalloc);
+
+    osfs_unreserve_blocks(inode->i_sb->s_fs_info, info->i_delalloc_count);
+    info->i_delalloc_count = 0;
+}
@@ -3,6 +3,241 @@
 #include <linux/slab.h>
 #include "osfs.h"
 
+/*
+ * Directories are stored in their data blocks as chains of variable-length
+ * osfs_dir_entry records, as in ext2. A directory's size is always a whole
+ * number of blocks. An entry is found at its byte offset in the directory,
+ * which is what the name index records. Removing a name merges its record
+ * into the one before it, or frees it if it starts its block, so no other
+ * entry moves.
+ */
+
+/**
+ * Function: osfs_dir_block
+ * Description: Returns a data block holding part of a directory's entries.
+ * Inputs:
+ *   - dir: The inode of the directory.
+ *   - lblk: The logical block of the directory.
+ *   - cursor: The caller's extent cursor, or NULL. Walks over consecutive
+ *             blocks stay in the cursor's extent and skip the tree descent.
+ * Returns:
+ *   - The kernel address of the block.
+ *   - NULL if the block is not mapped.
+ *   - ERR_PTR(-EIO) if the directory's extents are corrupted.
+ */
+static void *osfs_dir_block(struct inode *dir, uint32_t lblk,
+                            struct osfs_extent_cursor *cursor)
+{
+    struct osfs_sb_info *sb_info = dir->i_sb->s_fs_info;
+    const struct osfs_extent *extent;
+
+    extent = osfs_lookup_extent(dir, lblk, cursor, NULL);
+    if (IS_ERR_OR_NULL(extent))
+        return ERR_CAST(extent);
+    return osfs_block_addr(sb_info, extent->start_block + (lblk - extent->file_block));
+}
+
+/**
+ * Function: osfs_dir_entry_ok
+ * Description: Checks that a record stays inside its block and can hold its name.
+ * Inputs:
+ *   - dir: The inode of the directory.
+ *   - de: The record.
+ *   - offset: The offset of the record in its block.
+ * Returns:
+ *   - true if the record can be trusted.
+ */
+static bool osfs_dir_entry_ok(struct inode *dir, struct osfs_dir_entry *de, uint32_t offset)
+{
+    struct osfs_sb_info *sb_info = dir->i_sb->s_fs_info;
+    uint32_t rec_len = osfs_rec_len(de);
+
+    if (rec_len >= OSFS_DIR_REC_LEN(0) && rec_len % 4 == 0 &&
+        rec_len <= sb_info->block_size - offset &&
+        (!de->inode_no || (rec_len >= OSFS_DIR_REC_LEN(de->name_len) &&
+                           de->inode_no < sb_info->inode_count)))
+        return true;
+
+    pr_err("osfs: Corrupted entry in directory %lu at offset %u\n", dir->i_ino, offset);
+    return false;
+}
+
+/**
+ * Function: osfs_dir_slack
+ * Description: Returns the largest new record that fits in the space of a record.
+ */
+static inline uint32_t osfs_dir_slack(const struct osfs_dir_entry *de)
+{
+    return osfs_rec_len(de) - (de->inode_no ? OSFS_DIR_REC_LEN(de->name_len) : 0);
+}
+
+/**
+ * Function: osfs_dir_block_free
+ * Description: Walks the records of a directory block for the largest free space.
+ * Inputs:
+ *   - dir: The inode of the directory.
+ *   - block: The directory block.
+ *   - free: Set to the largest record that fits in the block.
+ * Returns:
+ *   - 0 on success.
+ *   - -EIO if a record is corrupted.
+ */
+static int osfs_dir_block_free(struct inode *dir, void *block, uint32_t *free)
+{
+    struct osfs_sb_info *sb_info = dir->i_sb->s_fs_info;
+    uint32_t offset;
+
+    *free = 0;
+    for (offset = 0; offset < sb_info->block_size; ) {
+        struct osfs_dir_entry *de = block + offset;
+
+        if (!osfs_dir_entry_ok(dir, de, offset))
+            return -EIO;
+        *free = max(*free, osfs_dir_slack(de));
+        offset += osfs_rec_len(de);
+    }
+    return 0;
+}
+
+/**
+ * Function: osfs_dir_build_index
+ * Description: Builds the name index of a directory from its entries.
+ * Inputs:
+ *   - dir: The inode of the directory.
+ * Returns:
+ *   - The index on success.
+ *   - ERR_PTR(-ENOMEM) if memory allocation fails.
+ *   - ERR_PTR(-EIO) if the directory's blocks are missing or corrupted.
+ */
+static struct osfs_dir_index *osfs_dir_build_index(struct inode *dir)
+{
+    struct osfs_inode *osfs_inode = dir->i_private;
+    struct osfs_sb_info *sb_info = dir->i_sb->s_fs_info;
+    struct osfs_extent_cursor cursor = {};
+    struct osfs_dir_index *index;
+    uint32_t nr_blocks, lblk;
+    int ret = 0;
+
+    index = osfs_dirhash_create();
+    if (!index)
+        return ERR_PTR(-ENOMEM);
+
+    nr_blocks = osfs_inode->i_size >> sb_info->block_bits;
+    for (lblk = 0; lblk < nr_blocks && !ret; lblk++) {
+        void *block = osfs_dir_block(dir, lblk, &cursor);
+        uint32_t offset, free = 0;
+
+        if (IS_ERR_OR_NULL(block)) {
+            ret = -EIO;
+            break;
+        }
+
+        for (offset = 0; offset < sb_info->block_size; ) {
+            struct osfs_dir_entry *de = block + offset;
+
+            if (!osfs_dir_entry_ok(dir, de, offset)) {
+                ret = -EIO;
+                break;
+            }
+            free = max(free, osfs_dir_slack(de));
+            if (de->inode_no) {
+                ret = osfs_dirhash_add(index, osfs_dirhash_name(de->name, de->name_len),
+                                       (lblk << sb_info->block_bits) + offset);
+                if (ret)
+                    break;
+            }
+            offset += osfs_rec_len(de);
+        }
+        if (!ret)
+            ret = osfs_dirhash_set_free(index, lblk, free);
+    }
+
+    if (ret) {
+        osfs_dirhash_free(index);
+        return ERR_PTR(ret);
+    }
+    return index;
+}
+
+/**
+ * Function: osfs_dir_get_index
+ * Description: Returns the name index of a directory, building it on first
+ *              use. Parallel lookups hold i_rwsem shared, so the build is
+ *              serialized by i_dir_index_lock; once published the index is
+ *              only changed under an exclusive i_rwsem.
+ * Inputs:
+ *   - dir: The inode of the directory.
+ * Returns:
+ *   - The index on success.
+ *   - ERR_PTR(-ENOMEM) if memory allocation fails.
+ *   - ERR_PTR(-EIO) if the directory's blocks are missing or corrupted.
+ */
+static struct osfs_dir_index *osfs_dir_get_index(struct inode *dir)
+{
+    struct osfs_inode_info *info = OSFS_I(dir);
+    struct osfs_dir_index *index;
+
+    index = smp_load_acquire(&info->i_dir_index);
+    if (index)
+        return index;
+
+    mutex_lock(&info->i_dir_index_lock);
+    index = info->i_dir_index;
+    if (!index) {
+        index = osfs_dir_build_index(dir);
+        if (!IS_ERR(index))
+            smp_store_release(&info->i_dir_index, index);
+    }
+    mutex_unlock(&info->i_dir_index_lock);
+    return index;
+}
+
+/**
+ * Function: osfs_find_entry
+ * Description: Finds the entry for a name in a directory through its index.
+ * Inputs:
+ *   - dir: The inode of the directory.
+ *   - name: The name to look for.
+ *   - name_len: The length of the name.
+ *   - pos: If not NULL, set to the byte offset of the entry in the directory.
+ * Returns:
+ *   - The directory entry on success.
+ *   - NULL if the name is not in the directory.
+ *   - ERR_PTR(-ENOMEM) if the index cannot be built.
+ *   - ERR_PTR(-EIO) if the directory's blocks are missing or corrupted.
+ */
+static struct osfs_dir_entry *osfs_find_entry(struct inode *dir, const char *name,
+                                              size_t name_len, uint32_t *pos)
+{
+    struct osfs_sb_info *sb_info = dir->i_sb->s_fs_info;
+    uint32_t hash = osfs_dirhash_name(name, name_len);
+    struct osfs_dir_index *index;
+    struct osfs_dir_hnode *hnode;
+
+    index = osfs_dir_get_index(dir);
+    if (IS_ERR(index))
+        return ERR_CAST(index);
+
+    // Only entries whose name hashes the same need a string compare
+    hlist_for_each_entry(hnode, osfs_dirhash_bucket(index, hash), node) {
+        struct osfs_dir_entry *de;
+        void *block;
+
+        if (hnode->hash != hash)
+            continue;
+        block = osfs_dir_block(dir, hnode->pos >> sb_info->block_bits, NULL);
+        if (IS_ERR_OR_NULL(block))
+            return block ? block : ERR_PTR(-EIO);
+        de = block + (hnode->pos & (sb_info->block_size - 1));
+        if (de->name_len == name_len && memcmp(de->name, name, name_len) == 0) {
+            if (pos)
+                *pos = hnode->pos;
+            return de;
+        }
+    }
+    return NULL;
+}
+
 /**
  * Function: osfs_lookup
  * Description: Looks up a file within a directory.
@@ -16,44 +251,26 @@
  */
 static struct dentry *osfs_lookup(struct inode *dir, struct dentry *dentry, unsigned int flags)
 {
-    struct osfs_sb_info *sb_info = dir->i_sb->s_fs_info;
-    struct osfs_inode *parent_inode = dir->i_private;
-    void *dir_data_block;
-    struct osfs_dir_entry *dir_entries;
-    int dir_entry_count;
-    int i;
+    struct osfs_dir_entry *entry;
     struct inode *inode = NULL;
 
-    pr_info("osfs_lookup: Looking up '%.*s' in inode %lu\n",
-            (int)dentry->d_name.len, dentry->d_name.name, dir->i_ino);
+    pr_debug("osfs_lookup: Looking up '%.*s' in inode %lu\n",
+             (int)dentry->d_name.len, dentry->d_name.name, dir->i_ino);
 
-    // 檢查目錄是否有 extent
-    if (parent_inode->i_extent_count == 0)
+    // Find a matching filename through the directory's name index
+    entry = osfs_find_entry(dir, dentry->d_name.name, dentry->d_name.len, NULL);
+    if (IS_ERR(entry))
+        return ERR_CAST(entry);
+    if (!entry)
         return NULL;
 
-    // Read the parent directory's data block
-    dir_data_block = sb_info->data_blocks + 
-                    parent_inode->i_extents[0].start_block * BLOCK_SIZE;
-
-    // Calculate the number of directory entries
-    dir_entry_count = parent_inode->i_size / sizeof(struct osfs_dir_entry);
-    dir_entries = (struct osfs_dir_entry *)dir_data_block;
-
-    // Traverse the directory entries to find a matching filename
-    for (i = 0; i < dir_entry_count; i++) {
-        if (strlen(dir_entries[i].filename) == dentry->d_name.len &&
-            strncmp(dir_entries[i].filename, dentry->d_name.name, dentry->d_name.len) == 0) {
-            // File found, get inode
-            inode = osfs_iget(dir->i_sb, dir_entries[i].inode_no);
-            if (IS_ERR(inode)) {
-                pr_err("osfs_lookup: Error getting inode %u\n", dir_entries[i].inode_no);
-                return ERR_CAST(inode);
-            }
-            return d_splice_alias(inode, dentry);
-        }
+    // File found, get inode
+    inode = osfs_iget(dir->i_sb, entry->inode_no);
+    if (IS_ERR(inode)) {
+        pr_err("osfs_lookup: Error getting inode %u\n", entry->inode_no);
+        return ERR_CAST(inode);
     }
-
-    return NULL;
+    return d_splice_alias(inode, dentry);
 }
 
 
@@ -70,42 +287,46 @@ static struct dentry *osfs_lookup(struct inode *dir, struct dentry *dentry, unsi
 static int osfs_iterate(struct file *filp, struct dir_context *ctx)
 {
     struct inode *inode = file_inode(filp);
-    struct osfs_sb_info *sb_info = inode->i_sb->s_fs_info;
     struct osfs_inode *osfs_inode = inode->i_private;
-    void *dir_data_block;
-    struct osfs_dir_entry *dir_entries;
-    int dir_entry_count;
-    int i;
+    struct osfs_sb_info *sb_info = inode->i_sb->s_fs_info;
+    struct osfs_extent_cursor cursor = {};
+    loff_t pos;
 
     if (ctx->pos == 0) {
         if (!dir_emit_dots(filp, ctx))
             return 0;
     }
 
-    if (osfs_inode->i_extent_count == 0)
-        return 0;
-
-    dir_data_block = sb_info->data_blocks + 
-                    osfs_inode->i_extents[0].start_block * BLOCK_SIZE;
-    
-    dir_entry_count = osfs_inode->i_size / sizeof(struct osfs_dir_entry);
-    dir_entries = (struct osfs_dir_entry *)dir_data_block;
-
-    /* Adjust the index based on ctx->pos */
-    i = ctx->pos - 2;
-
-    for (; i < dir_entry_count; i++) {
-        struct osfs_dir_entry *entry = &dir_entries[i];
-        unsigned int type = DT_UNKNOWN;
-
-        if (!dir_emit(ctx, entry->filename, strlen(entry->filename), 
-                     entry->inode_no, type)) {
-            pr_err("osfs_iterate: dir_emit failed for entry '%s'\n", 
-                   entry->filename);
-            return -EINVAL;
+    /* Positions past the dots are byte offsets into the directory, plus 2 */
+    pos = ctx->pos - 2;
+
+    while (pos < osfs_inode->i_size) {
+        uint32_t lblk = pos >> sb_info->block_bits;
+        uint32_t start = pos & (sb_info->block_size - 1);
+        uint32_t offset;
+        void *block;
+
+        block = osfs_dir_block(inode, lblk, &cursor);
+        if (IS_ERR_OR_NULL(block))
+            return block ? PTR_ERR(block) : -EIO;
+
+        // Walk from the start of the block, since pos may not be on a record
+        for (offset = 0; offset < sb_info->block_size; ) {
+            struct osfs_dir_entry *de = block + offset;
+
+            if (!osfs_dir_entry_ok(inode, de, offset))
+                return -EIO;
+            offset += osfs_rec_len(de);
+            if (offset <= start)
+                continue;
+
+            if (de->inode_no &&
+                !dir_emit(ctx, de->name, de->name_len, de->inode_no,
+                          fs_ftype_to_dtype(de->file_type)))
+                return 0;
+            ctx->pos = 2 + ((loff_t)lblk << sb_info->block_bits) + offset;
         }
-
-        ctx->pos++;
+        pos = (loff_t)(lblk + 1) << sb_info->block_bits;
     }
 
     return 0;
@@ -131,7 +352,7 @@ struct inode *osfs_new_inode(const struct inode *dir, umode_t mode)
     struct inode *inode;
     struct osfs_inode *osfs_inode;
     int ino;
-    struct osfs_extent *extent;
+    struct osfs_extent extent;
 
     /* Check if the mode is supported */
     if (!S_ISDIR(mode) && !S_ISREG(mode) && !S_ISLNK(mode)) {
@@ -139,10 +360,6 @@ struct inode *osfs_new_inode(const struct inode *dir, umode_t mode)
         return ERR_PTR(-EINVAL);
     }
 
-    /* Check if there are free inodes and blocks */
-    if (sb_info->nr_free_inodes == 0 || sb_info->nr_free_blocks == 0)
-        return ERR_PTR(-ENOSPC);
-
     /* Allocate a new inode number */
     ino = osfs_get_free_inode(sb_info);
     if (ino < 0 || ino >= sb_info->inode_count)
@@ -150,8 +367,10 @@ struct inode *osfs_new_inode(const struct inode *dir, umode_t mode)
 
     /* Allocate a new VFS inode */
     inode = new_inode(sb);
-    if (!inode)
+    if (!inode) {
+        osfs_put_free_inode(sb_info, ino);
         return ERR_PTR(-ENOMEM);
+    }
 
     /* Initialize inode owner and permissions */
     inode_init_owner(&nop_mnt_idmap, inode, dir, mode);
@@ -169,6 +388,8 @@ struct inode *osfs_new_inode(const struct inode *dir, umode_t mode)
     } else if (S_ISREG(mode)) {
         inode->i_op = &osfs_file_inode_operations;
         inode->i_fop = &osfs_file_operations;
+        if (sb_info->dax_dev)
+            inode->i_flags |= S_DAX;
         set_nlink(inode, 1);
         inode->i_size = 0;
     } else if (S_ISLNK(mode)) {
@@ -191,21 +412,25 @@ struct inode *osfs_new_inode(const struct inode *dir, umode_t mode)
     osfs_inode->i_gid = i_gid_read(inode);
     osfs_inode->i_size = inode->i_size;
     osfs_inode->i_extent_count = 0;
+    osfs_init_extent_root(osfs_inode);
+    // Regular files start with their data inside the inode
+    if (S_ISREG(mode))
+        osfs_init_inline_data(osfs_inode);
     inode->i_private = osfs_inode;
+    osfs_sync_inode(inode);
 
     /* Allocate data block */
     if (S_ISDIR(mode)) {
-        extent = &osfs_inode->i_extents[0];
-        if (osfs_alloc_extent(sb_info, 1, extent)) {
+        if (osfs_alloc_file_blocks(inode, 0, 1, &extent)) {
+            // Without links, eviction hands the inode number back
+            clear_nlink(inode);
             iput(inode);
             return ERR_PTR(-ENOSPC);
         }
-        osfs_inode->i_extent_count = 1;
-        osfs_inode->i_blocks = 1;
     }
 
-    /* Update superblock information */
-    sb_info->nr_free_inodes--;
+    /* Make the inode visible to osfs_iget */
+    insert_inode_hash(inode);
 
     /* Mark inode as dirty */
     mark_inode_dirty(inode);
@@ -213,51 +438,142 @@ struct inode *osfs_new_inode(const struct inode *dir, umode_t mode)
     return inode;
 }
 
-static int osfs_add_dir_entry(struct inode *dir, uint32_t inode_no, 
-                            const char *name, size_t name_len)
+/**
+ * Function: osfs_dir_add_block
+ * Description: Appends a block holding one empty record to a directory.
+ *              A block already mapped past the end, like the one
+ *              osfs_new_inode gives every directory, is reused.
+ * Inputs:
+ *   - dir: The inode of the directory.
+ *   - lblk: Set to the logical block added.
+ * Returns:
+ *   - 0 on success.
+ *   - A negative error code from the allocator or the tree on failure.
+ */
+static int osfs_dir_add_block(struct inode *dir, uint32_t *lblk)
 {
     struct osfs_sb_info *sb_info = dir->i_sb->s_fs_info;
-    struct osfs_inode *parent_inode = dir->i_private;
-    void *dir_data_block;
-    struct osfs_dir_entry *dir_entries;
-    int dir_entry_count;
-    int i;
-
-    if (parent_inode->i_extent_count == 0) {
-        pr_err("osfs_add_dir_entry: Directory has no extent\n");
-        return -EIO;
-    }
-
-    // Read the parent directory's data block
-    dir_data_block = sb_info->data_blocks + 
-                    parent_inode->i_extents[0].start_block * BLOCK_SIZE;
+    struct osfs_inode *osfs_inode = dir->i_private;
+    struct osfs_dir_entry *de;
+    int ret;
 
-    // Calculate the existing number of directory entries
-    dir_entry_count = parent_inode->i_size / sizeof(struct osfs_dir_entry);
-    if (dir_entry_count >= MAX_DIR_ENTRIES) {
-        pr_err("osfs_add_dir_entry: Parent directory is full\n");
+    if (osfs_inode->i_size > U32_MAX - sb_info->block_size)
         return -ENOSPC;
+
+    *lblk = osfs_inode->i_size >> sb_info->block_bits;
+    de = osfs_dir_block(dir, *lblk, NULL);
+    if (IS_ERR(de))
+        return PTR_ERR(de);
+    if (!de) {
+        struct osfs_extent extent;
+
+        ret = osfs_alloc_file_blocks(dir, *lblk, 1, &extent);
+        if (ret)
+            return ret;
+        de = osfs_block_addr(sb_info, extent.start_block);
     }
 
-    dir_entries = (struct osfs_dir_entry *)dir_data_block;
+    de->inode_no = 0;
+    de->name_len = 0;
+    de->file_type = 0;
+    osfs_set_rec_len(de, sb_info->block_size);
+
+    osfs_inode->i_size += sb_info->block_size;
+    dir->i_size = osfs_inode->i_size;
+    return 0;
+}
+
+/**
+ * Function: osfs_add_dir_entry
+ * Description: Adds a name to a directory, reusing free space inside its
+ *              blocks before growing it.
+ * Inputs:
+ *   - dir: The inode of the directory.
+ *   - inode_no: The inode the name refers to.
+ *   - mode: The mode of that inode, for the entry's file type.
+ *   - name: The name.
+ *   - name_len: The length of the name.
+ * Returns:
+ *   - 0 on success.
+ *   - -EEXIST if the name is already in the directory.
+ *   - -ENOSPC if the directory cannot grow.
+ *   - -EIO if the directory is corrupted.
+ */
+static int osfs_add_dir_entry(struct inode *dir, uint32_t inode_no, umode_t mode,
+                              const char *name, size_t name_len)
+{
+    struct osfs_sb_info *sb_info = dir->i_sb->s_fs_info;
+    uint32_t needed = OSFS_DIR_REC_LEN(name_len);
+    struct osfs_dir_index *index;
+    struct osfs_dir_entry *de;
+    uint32_t lblk, offset, free;
+    void *block;
+    int ret;
 
     // Check if a file with the same name exists
-    for (i = 0; i < dir_entry_count; i++) {
-        if (strlen(dir_entries[i].filename) == name_len &&
-            strncmp(dir_entries[i].filename, name, name_len) == 0) {
-            pr_warn("osfs_add_dir_entry: File '%.*s' already exists\n", 
-                   (int)name_len, name);
-            return -EEXIST;
-        }
+    de = osfs_find_entry(dir, name, name_len, NULL);
+    if (IS_ERR(de))
+        return PTR_ERR(de);
+    if (de) {
+        pr_warn("osfs_add_dir_entry: File '%.*s' already exists\n",
+               (int)name_len, name);
+        return -EEXIST;
+    }
+    index = OSFS_I(dir)->i_dir_index;
+
+    // Find a block with room, or grow the directory by one
+    lblk = osfs_dirhash_find_space(index, needed);
+    if (lblk == U32_MAX) {
+        ret = osfs_dir_add_block(dir, &lblk);
+        if (ret)
+            return ret;
     }
 
-    // Add a new directory entry
-    strncpy(dir_entries[dir_entry_count].filename, name, name_len);
-    dir_entries[dir_entry_count].filename[name_len] = '\0';
-    dir_entries[dir_entry_count].inode_no = inode_no;
+    block = osfs_dir_block(dir, lblk, NULL);
+    if (IS_ERR_OR_NULL(block))
+        return -EIO;
+
+    for (offset = 0; offset < sb_info->block_size; offset += osfs_rec_len(de)) {
+        de = block + offset;
+        if (!osfs_dir_entry_ok(dir, de, offset))
+            return -EIO;
+        if (osfs_dir_slack(de) >= needed)
+            break;
+    }
+    if (offset >= sb_info->block_size) {
+        pr_err("osfs_add_dir_entry: Free space of directory %lu is out of date\n", dir->i_ino);
+        return -EIO;
+    }
 
-    // Update the size of the parent directory
-    parent_inode->i_size += sizeof(struct osfs_dir_entry);
+    // A live record gives up the space after its own name
+    if (de->inode_no) {
+        struct osfs_dir_entry *next;
+        uint32_t used = OSFS_DIR_REC_LEN(de->name_len);
+
+        next = (void *)de + used;
+        osfs_set_rec_len(next, osfs_rec_len(de) - used);
+        osfs_set_rec_len(de, used);
+        de = next;
+        offset += used;
+    }
+
+    // Add a new directory entry
+    de->inode_no = inode_no;
+    de->name_len = name_len;
+    de->file_type = fs_umode_to_ftype(mode);
+    memcpy(de->name, name, name_len);
+
+    // An index missing an entry would hide it, so drop it to be rebuilt
+    ret = osfs_dir_block_free(dir, block, &free);
+    if (!ret)
+        ret = osfs_dirhash_set_free(index, lblk, free);
+    if (!ret)
+        ret = osfs_dirhash_add(index, osfs_dirhash_name(name, name_len),
+                               (lblk << sb_info->block_bits) + offset);
+    if (ret) {
+        WRITE_ONCE(OSFS_I(dir)->i_dir_index, NULL);
+        osfs_dirhash_free(index);
+    }
 
     return 0;
 }
@@ -282,10 +598,8 @@ static int osfs_add_dir_entry(struct inode *dir, uint32_t inode_no,
 static int osfs_create(struct mnt_idmap *idmap, struct inode *dir, struct dentry *dentry, umode_t mode, bool excl)
 {   
     // Step1: Parse the parent directory passed by the VFS 
-    struct osfs_inode *parent_inode = dir->i_private;
     struct osfs_inode *osfs_inode;
     struct inode *inode;
-    struct osfs_sb_info *sb_info = dir->i_sb->s_fs_info;
     int ret;
 
     // Step2: Validate the file name length
@@ -313,49 +627,234 @@ static int osfs_create(struct mnt_idmap *idmap, struct inode *dir, struct dentry
     osfs_inode->i_blocks = 0; 
     osfs_inode->i_size = 0;
     osfs_inode->i_blocks = 0;
-
-    // 分配初始 extent（1 個區塊）
-    ret = osfs_alloc_extent(sb_info, 1, &osfs_inode->i_extents[0]);
-    if (ret) {
-        pr_err("osfs_create: Failed to allocate initial extent\n");
-        iput(inode);
-        return ret;
-    }
-
-    osfs_inode->i_extent_count = 1;
-    osfs_inode->i_blocks = 1;
-    
-    pr_info("osfs_create: Allocated initial extent for file: start=%u, count=%u\n",
-            osfs_inode->i_extents[0].start_block,
-            osfs_inode->i_extents[0].block_count);
+    // No block yet: the data stays inline until the file outgrows the inode
 
     // Step4: Parent directory entry update for the new file
-    ret = osfs_add_dir_entry(dir, inode->i_ino, dentry->d_name.name, dentry->d_name.len); //在Parent directory加入new file directory
+    ret = osfs_add_dir_entry(dir, inode->i_ino, inode->i_mode, dentry->d_name.name, dentry->d_name.len); //在Parent directory加入new file directory
     if (ret) {
         pr_err("osfs_create: Failed to add directory entry\n");
-        // 清理已分配的 extent
-        osfs_free_extent(sb_info, &osfs_inode->i_extents[0]);
+        // The inode number is released on eviction
+        clear_nlink(inode);
         iput(inode);
         return ret;
     }
 
     // Step 5: Update the parent directory's metadata 
-    parent_inode->__i_mtime = parent_inode->__i_ctime = current_time(dir); //更新修改時間
+    inode_set_mtime_to_ts(dir, inode_set_ctime_current(dir)); //更新修改時間
     mark_inode_dirty(dir); //告訴VFS新inode的數據需要被寫回磁盤
     
     // Step 6: Bind the inode to the VFS dentry
     d_instantiate(dentry, inode); //將新的inode和dentry連接
-    pr_info("osfs_create: File '%.*s' created with inode %lu\n",
-            (int)dentry->d_name.len, dentry->d_name.name, inode->i_ino);
+    pr_debug("osfs_create: File '%.*s' created with inode %lu\n",
+             (int)dentry->d_name.len, dentry->d_name.name, inode->i_ino);
+
+    return 0;
+}
+
+
+/**
+ * Function: osfs_delete_entry
+ * Description: Removes a record from a directory block and from the
+ *              directory's name index.
+ * Inputs:
+ *   - dir: The inode of the directory.
+ *   - de: The record, as found by osfs_find_entry.
+ *   - pos: The byte offset of the record in the directory.
+ * Returns:
+ *   - 0 on success.
+ *   - -EIO if the directory is corrupted.
+ */
+static int osfs_delete_entry(struct inode *dir, struct osfs_dir_entry *de, uint32_t pos)
+{
+    struct osfs_sb_info *sb_info = dir->i_sb->s_fs_info;
+    struct osfs_dir_index *index = OSFS_I(dir)->i_dir_index;
+    uint32_t lblk = pos >> sb_info->block_bits;
+    uint32_t start = pos & (sb_info->block_size - 1);
+    struct osfs_dir_entry *prev = NULL;
+    void *block = (void *)de - start;
+    uint32_t offset, free;
+    int ret;
+
+    // Records only chain forwards, so walk up to this one for the one before
+    for (offset = 0; offset < start; offset += osfs_rec_len(prev)) {
+        prev = block + offset;
+        if (!osfs_dir_entry_ok(dir, prev, offset))
+            return -EIO;
+    }
+    if (offset != start) {
+        pr_err("osfs: Corrupted entry in directory %lu at offset %u\n", dir->i_ino, start);
+        return -EIO;
+    }
+
+    osfs_dirhash_del(index, osfs_dirhash_name(de->name, de->name_len), pos);
+    if (prev)
+        osfs_set_rec_len(prev, osfs_rec_len(prev) + osfs_rec_len(de));
+    else
+        de->inode_no = 0;
+
+    // An index with stale free space would send creates to full blocks
+    ret = osfs_dir_block_free(dir, block, &free);
+    if (!ret)
+        ret = osfs_dirhash_set_free(index, lblk, free);
+    if (ret) {
+        WRITE_ONCE(OSFS_I(dir)->i_dir_index, NULL);
+        osfs_dirhash_free(index);
+    }
+
+    return 0;
+}
+
+/**
+ * Function: osfs_dir_empty
+ * Description: Checks that a directory holds no entries.
+ * Inputs:
+ *   - dir: The inode of the directory.
+ * Returns:
+ *   - 0 if the directory is empty.
+ *   - -ENOTEMPTY if it still holds an entry.
+ *   - -EIO if the directory is corrupted.
+ */
+static int osfs_dir_empty(struct inode *dir)
+{
+    struct osfs_inode *osfs_inode = dir->i_private;
+    struct osfs_sb_info *sb_info = dir->i_sb->s_fs_info;
+    struct osfs_extent_cursor cursor = {};
+    uint32_t nr_blocks, lblk, offset;
+
+    nr_blocks = osfs_inode->i_size >> sb_info->block_bits;
+    for (lblk = 0; lblk < nr_blocks; lblk++) {
+        void *block = osfs_dir_block(dir, lblk, &cursor);
+
+        if (IS_ERR_OR_NULL(block))
+            return -EIO;
+        for (offset = 0; offset < sb_info->block_size; ) {
+            struct osfs_dir_entry *de = block + offset;
+
+            if (!osfs_dir_entry_ok(dir, de, offset))
+                return -EIO;
+            if (de->inode_no)
+                return -ENOTEMPTY;
+            offset += osfs_rec_len(de);
+        }
+    }
+    return 0;
+}
+
+/**
+ * Function: osfs_unlink
+ * Description: Removes a name from a directory. The file is freed on
+ *              eviction once its last link and last user are gone.
+ * Inputs:
+ *   - dir: The inode of the parent directory.
+ *   - dentry: The dentry of the name to remove.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOENT if the name is no longer in the directory.
+ *   - -ENOMEM if the directory's index cannot be built.
+ *   - -EIO if the directory is corrupted.
+ */
+static int osfs_unlink(struct inode *dir, struct dentry *dentry)
+{
+    struct inode *inode = d_inode(dentry);
+    struct osfs_dir_entry *de;
+    uint32_t pos;
+    int ret;
+
+    de = osfs_find_entry(dir, dentry->d_name.name, dentry->d_name.len, &pos);
+    if (IS_ERR(de))
+        return PTR_ERR(de);
+    if (!de || de->inode_no != inode->i_ino)
+        return -ENOENT;
 
+    ret = osfs_delete_entry(dir, de, pos);
+    if (ret)
+        return ret;
+
+    inode_set_mtime_to_ts(dir, inode_set_ctime_current(dir));
+    mark_inode_dirty(dir);
+    inode_set_ctime_to_ts(inode, inode_get_ctime(dir));
+    drop_nlink(inode);
+    mark_inode_dirty(inode);
     return 0;
 }
 
+/**
+ * Function: osfs_mkdir
+ * Description: Creates a new directory within a directory.
+ * Inputs:
+ *   - idmap: The mount namespace ID map.
+ *   - dir: The inode of the parent directory.
+ *   - dentry: The dentry representing the new directory.
+ *   - mode: The permissions for the new directory.
+ * Returns:
+ *   - 0 on successful creation.
+ *   - -ENAMETOOLONG if the name is too long.
+ *   - A negative error code from osfs_new_inode or osfs_add_dir_entry on failure.
+ */
+static int osfs_mkdir(struct mnt_idmap *idmap, struct inode *dir, struct dentry *dentry,
+                      umode_t mode)
+{
+    struct inode *inode;
+    int ret;
+
+    if (dentry->d_name.len > MAX_FILENAME_LEN)
+        return -ENAMETOOLONG;
+
+    inode = osfs_new_inode(dir, S_IFDIR | (mode & ~S_IFMT));
+    if (IS_ERR(inode))
+        return PTR_ERR(inode);
 
+    ret = osfs_add_dir_entry(dir, inode->i_ino, inode->i_mode, dentry->d_name.name,
+                             dentry->d_name.len);
+    if (ret) {
+        // The inode number and the directory's block are released on eviction
+        clear_nlink(inode);
+        iput(inode);
+        return ret;
+    }
+
+    // The new directory's ".." links its parent
+    inc_nlink(dir);
+    inode_set_mtime_to_ts(dir, inode_set_ctime_current(dir));
+    mark_inode_dirty(dir);
+    d_instantiate(dentry, inode);
+    return 0;
+}
+
+/**
+ * Function: osfs_rmdir
+ * Description: Removes an empty directory.
+ * Inputs:
+ *   - dir: The inode of the parent directory.
+ *   - dentry: The dentry of the directory to remove.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOTEMPTY if the directory still holds an entry.
+ *   - A negative error code from osfs_unlink on failure.
+ */
+static int osfs_rmdir(struct inode *dir, struct dentry *dentry)
+{
+    struct inode *inode = d_inode(dentry);
+    int ret;
+
+    ret = osfs_dir_empty(inode);
+    if (!ret)
+        ret = osfs_unlink(dir, dentry);
+    if (ret)
+        return ret;
+
+    // Its "." link goes with it, and so does the parent link of its ".."
+    clear_nlink(inode);
+    drop_nlink(dir);
+    return 0;
+}
 
 const struct inode_operations osfs_dir_inode_operations = {
     .lookup = osfs_lookup,
     .create = osfs_create,
+    .unlink = osfs_unlink,
+    .mkdir = osfs_mkdir,
+    .rmdir = osfs_rmdir,
     // Add other operations as needed
 };
 
@@ -0,0 +1,275 @@
+#include <linux/fs.h>
+#include <linux/hash.h>
+#include <linux/slab.h>
+#include "osfs.h"
+
+/*
+ * Directory name index.
+ *
+ * Directory entries are stored unordered, so finding a name on disk means
+ * comparing it against every entry. Each directory therefore gets an
+ * in-memory hash table the first time it is searched, mapping the hash
+ * of every name to the position of its entry. Lookups and the
+ * duplicate check on create compare names only for entries whose hash
+ * matches. The table doubles whenever it holds as many entries as it
+ * has buckets, so chains stay short. It is never written out; it is
+ * rebuilt from the entries after the inode is evicted.
+ *
+ * The index also keeps, per directory block, the largest record that
+ * would still fit in it. Blocks are linked into one list per class of
+ * free space, 4 bytes apart as records are, with every block that can
+ * take the longest name in the last class. Create takes the head of the
+ * first non-empty class that fits its record, so finding room costs at
+ * most OSFS_DIR_SPACE_CLASSES steps however large the directory is.
+ */
+
+#define OSFS_DIRHASH_MIN_BITS 4
+#define OSFS_DIR_SPACE_NONE U32_MAX
+
+/**
+ * Function: osfs_dirhash_name
+ * Description: Returns the hash of a file name used to key the index.
+ */
+uint32_t osfs_dirhash_name(const char *name, size_t name_len)
+{
+    return full_name_hash(NULL, name, name_len);
+}
+
+/**
+ * Function: osfs_dirhash_create
+ * Description: Allocates an empty directory index.
+ * Returns:
+ *   - The new index on success.
+ *   - NULL if memory allocation fails.
+ */
+struct osfs_dir_index *osfs_dirhash_create(void)
+{
+    struct osfs_dir_index *index;
+
+    index = kzalloc(sizeof(*index), GFP_KERNEL);
+    if (!index)
+        return NULL;
+
+    index->bits = OSFS_DIRHASH_MIN_BITS;
+    memset(index->space_head, 0xff, sizeof(index->space_head));
+    index->buckets = kvcalloc(1U << index->bits, sizeof(*index->buckets), GFP_KERNEL);
+    if (!index->buckets) {
+        kfree(index);
+        return NULL;
+    }
+    return index;
+}
+
+/**
+ * Function: osfs_dirhash_bucket
+ * Description: Returns the chain holding the entries with a given hash.
+ */
+struct hlist_head *osfs_dirhash_bucket(struct osfs_dir_index *index, uint32_t hash)
+{
+    return &index->buckets[hash_32(hash, index->bits)];
+}
+
+/**
+ * Function: osfs_dirhash_grow
+ * Description: Doubles the number of buckets and rehashes every entry.
+ *              A failed allocation leaves the table as it is; it just
+ *              keeps longer chains.
+ */
+static void osfs_dirhash_grow(struct osfs_dir_index *index)
+{
+    unsigned int new_bits = index->bits + 1;
+    struct hlist_head *buckets;
+    struct osfs_dir_hnode *hnode;
+    struct hlist_node *tmp;
+    uint32_t i;
+
+    buckets = kvcalloc(1U << new_bits, sizeof(*buckets), GFP_KERNEL);
+    if (!buckets)
+        return;
+
+    for (i = 0; i < (1U << index->bits); i++) {
+        hlist_for_each_entry_safe(hnode, tmp, &index->buckets[i], node) {
+            hlist_del(&hnode->node);
+            hlist_add_head(&hnode->node, &buckets[hash_32(hnode->hash, new_bits)]);
+        }
+    }
+
+    kvfree(index->buckets);
+    index->buckets = buckets;
+    index->bits = new_bits;
+}
+
+/**
+ * Function: osfs_dirhash_add
+ * Description: Records the position of a directory entry in the index.
+ * Inputs:
+ *   - index: The directory index.
+ *   - hash: The hash of the entry's name.
+ *   - pos: The byte offset of the entry in the directory.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOMEM if memory allocation fails.
+ */
+int osfs_dirhash_add(struct osfs_dir_index *index, uint32_t hash, uint32_t pos)
+{
+    struct osfs_dir_hnode *hnode;
+
+    if (index->count >= (1U << index->bits))
+        osfs_dirhash_grow(index);
+
+    hnode = kmalloc(sizeof(*hnode), GFP_KERNEL);
+    if (!hnode)
+        return -ENOMEM;
+
+    hnode->hash = hash;
+    hnode->pos = pos;
+    hlist_add_head(&hnode->node, osfs_dirhash_bucket(index, hash));
+    index->count++;
+    return 0;
+}
+
+/**
+ * Function: osfs_dirhash_del
+ * Description: Drops the index record of a directory entry being removed.
+ * Inputs:
+ *   - index: The directory index.
+ *   - hash: The hash of the entry's name.
+ *   - pos: The byte offset of the entry in the directory.
+ * Returns:
+ *   - None.
+ */
+void osfs_dirhash_del(struct osfs_dir_index *index, uint32_t hash, uint32_t pos)
+{
+    struct osfs_dir_hnode *hnode;
+
+    hlist_for_each_entry(hnode, osfs_dirhash_bucket(index, hash), node) {
+        if (hnode->pos == pos) {
+            hlist_del(&hnode->node);
+            kfree(hnode);
+            index->count--;
+            return;
+        }
+    }
+}
+
+/**
+ * Function: osfs_dir_space_class
+ * Description: Returns the class of a block that can take records up to free bytes.
+ */
+static inline uint32_t osfs_dir_space_class(uint32_t free)
+{
+    return min_t(uint32_t, free, OSFS_DIR_REC_LEN(MAX_FILENAME_LEN)) / 4;
+}
+
+/**
+ * Function: osfs_dir_space_unlink
+ * Description: Takes a block out of the list of its class, if it is in one.
+ */
+static void osfs_dir_space_unlink(struct osfs_dir_index *index, uint32_t lblk)
+{
+    struct osfs_dir_space *space = &index->space[lblk];
+    uint32_t *head = &index->space_head[osfs_dir_space_class(space->free)];
+
+    if (space->prev != OSFS_DIR_SPACE_NONE)
+        index->space[space->prev].next = space->next;
+    else if (*head == lblk)
+        *head = space->next;
+    else
+        return;
+    if (space->next != OSFS_DIR_SPACE_NONE)
+        index->space[space->next].prev = space->prev;
+    space->prev = OSFS_DIR_SPACE_NONE;
+    space->next = OSFS_DIR_SPACE_NONE;
+}
+
+/**
+ * Function: osfs_dirhash_set_free
+ * Description: Records the largest record a directory block can still
+ *              take and moves the block to the list of that class.
+ * Inputs:
+ *   - index: The directory index.
+ *   - lblk: The logical block of the directory.
+ *   - free: The length of the largest record that fits in the block.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOMEM if the per-block array cannot grow.
+ */
+int osfs_dirhash_set_free(struct osfs_dir_index *index, uint32_t lblk, uint32_t free)
+{
+    struct osfs_dir_space *space;
+    uint32_t *head, i;
+
+    if (lblk >= index->nr_blocks) {
+        uint32_t nr_blocks = max3(lblk + 1, index->nr_blocks * 2, 8U);
+
+        // The lists link blocks by number, so they survive the move
+        space = kvmalloc_array(nr_blocks, sizeof(*space), GFP_KERNEL);
+        if (!space)
+            return -ENOMEM;
+        if (index->space)
+            memcpy(space, index->space, index->nr_blocks * sizeof(*space));
+        for (i = index->nr_blocks; i < nr_blocks; i++) {
+            space[i].free = 0;
+            space[i].prev = OSFS_DIR_SPACE_NONE;
+            space[i].next = OSFS_DIR_SPACE_NONE;
+        }
+        kvfree(index->space);
+        index->space = space;
+        index->nr_blocks = nr_blocks;
+    }
+
+    osfs_dir_space_unlink(index, lblk);
+    space = &index->space[lblk];
+    space->free = free;
+    head = &index->space_head[osfs_dir_space_class(free)];
+    space->next = *head;
+    if (*head != OSFS_DIR_SPACE_NONE)
+        index->space[*head].prev = lblk;
+    *head = lblk;
+    return 0;
+}
+
+/**
+ * Function: osfs_dirhash_find_space
+ * Description: Finds a directory block with room for a record.
+ * Inputs:
+ *   - index: The directory index.
+ *   - needed: The length of the record.
+ * Returns:
+ *   - The logical block, or U32_MAX if every block is too full.
+ */
+uint32_t osfs_dirhash_find_space(struct osfs_dir_index *index, uint32_t needed)
+{
+    uint32_t class;
+
+    // Every block of a class can take any record up to 4 times the class
+    for (class = DIV_ROUND_UP(needed, 4); class < OSFS_DIR_SPACE_CLASSES; class++)
+        if (index->space_head[class] != OSFS_DIR_SPACE_NONE)
+            return index->space_head[class];
+    return U32_MAX;
+}
+
+/**
+ * Function: osfs_dirhash_free
+ * Description: Frees a directory index and every record in it.
+ * Inputs:
+ *   - index: The directory index, or NULL.
+ * Returns:
+ *   - None.
+ */
+void osfs_dirhash_free(struct osfs_dir_index *index)
+{
+    struct osfs_dir_hnode *hnode;
+    struct hlist_node *tmp;
+    uint32_t i;
+
+    if (!index)
+        return;
+
+    for (i = 0; i < (1U << index->bits); i++)
+        hlist_for_each_entry_safe(hnode, tmp, &index->buckets[i], node)
+            kfree(hnode);
+    kvfree(index->buckets);
+    kvfree(index->space);
+    kfree(index);
+}
@@ -0,0 +1,709 @@
+#include <linux/fs.h>
+#include "osfs.h"
+
+/*
+ * Extent tree.
+ *
+ * A file's extents live in a B+tree in the style of ext4. Every node is
+ * an osfs_extent_header followed by entries sorted by logical block:
+ * osfs_extent leaves at depth 0, osfs_extent_idx entries above that.
+ * The root node is embedded in the inode (i_ext_header + i_extents);
+ * all other nodes take one data block each. When the root fills up its
+ * entries move to a new block and the root becomes a one-entry index,
+ * so the tree grows from the top and stays balanced.
+ *
+ * Each open file also carries an osfs_extent_cursor holding a copy of
+ * the last extent it hit; sequential and strided I/O stay inside that
+ * extent most of the time and skip the descent entirely.
+ * i_ext_generation is bumped on every change to the tree so that stale
+ * cursors are never trusted.
+ */
+
+#define OSFS_ROOT_INDEX_COUNT \
+    (sizeof(((struct osfs_inode *)0)->i_extents) / (sizeof(struct osfs_extent_idx)))
+
+static inline struct osfs_extent *osfs_ext_leaves(struct osfs_extent_header *hdr)
+{
+    return (struct osfs_extent *)(hdr + 1);
+}
+
+static inline struct osfs_extent_idx *osfs_ext_index(struct osfs_extent_header *hdr)
+{
+    return (struct osfs_extent_idx *)(hdr + 1);
+}
+
+static inline size_t osfs_ext_entry_size(struct osfs_extent_header *hdr)
+{
+    return hdr->eh_depth ? sizeof(struct osfs_extent_idx) : sizeof(struct osfs_extent);
+}
+
+/**
+ * Function: osfs_ext_key
+ * Description: Returns the first logical block of entry i of a node.
+ */
+static inline uint32_t osfs_ext_key(struct osfs_extent_header *hdr, int i)
+{
+    return hdr->eh_depth ? osfs_ext_index(hdr)[i].ei_block : osfs_ext_leaves(hdr)[i].file_block;
+}
+
+/**
+ * Function: osfs_extent_contains
+ * Description: Tests whether an extent maps a logical block.
+ */
+static inline bool osfs_extent_contains(const struct osfs_extent *extent, uint32_t lblk)
+{
+    return lblk >= extent->file_block && lblk - extent->file_block < extent->block_count;
+}
+
+/**
+ * Function: osfs_ext_node
+ * Description: Returns the tree node stored in a data block after checking it.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - block: The data block holding the node.
+ *   - depth: The depth the node is expected to have.
+ * Returns:
+ *   - The node header on success.
+ *   - ERR_PTR(-EIO) if the block does not hold a valid node, including
+ *     one claiming more entries than the block has room for.
+ */
+static struct osfs_extent_header *osfs_ext_node(struct osfs_sb_info *sb_info,
+                                                uint32_t block, uint16_t depth)
+{
+    struct osfs_extent_header *hdr;
+
+    if (block >= sb_info->block_count)
+        goto corrupted;
+
+    hdr = osfs_block_addr(sb_info, block);
+    if (hdr->eh_magic != OSFS_EXT_MAGIC || hdr->eh_depth != depth ||
+        hdr->eh_max == 0 ||
+        hdr->eh_max > (sb_info->block_size - sizeof(*hdr)) / osfs_ext_entry_size(hdr) ||
+        hdr->eh_entries > hdr->eh_max)
+        goto corrupted;
+    return hdr;
+
+corrupted:
+    pr_err("osfs: Corrupted extent node in block %u\n", block);
+    return ERR_PTR(-EIO);
+}
+
+/**
+ * Function: osfs_ext_search
+ * Description: Binary search for the number of entries of a node whose
+ *              first logical block is at or below lblk.
+ */
+static int osfs_ext_search(struct osfs_extent_header *hdr, uint32_t lblk)
+{
+    int lo = 0, hi = hdr->eh_entries;
+
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+
+        if (osfs_ext_key(hdr, mid) <= lblk)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/**
+ * Function: osfs_init_extent_root
+ * Description: Resets the extent tree root embedded in an inode to an empty leaf.
+ */
+void osfs_init_extent_root(struct osfs_inode *osfs_inode)
+{
+    osfs_inode->i_ext_header.eh_magic = OSFS_EXT_MAGIC;
+    osfs_inode->i_ext_header.eh_entries = 0;
+    osfs_inode->i_ext_header.eh_max = OSFS_ROOT_EXTENT_COUNT;
+    osfs_inode->i_ext_header.eh_depth = 0;
+}
+
+/**
+ * Function: osfs_lookup_extent
+ * Description: Finds the extent mapping a logical block of a file.
+ * Inputs:
+ *   - inode: The inode of the file.
+ *   - lblk: The logical block to resolve.
+ *   - cursor: The caller's lookup cursor, or NULL.
+ *   - next_lblk: If not NULL and lblk is unmapped, set to the first logical
+ *                block of the next extent, or U32_MAX if there is none.
+ * Returns:
+ *   - The extent covering lblk.
+ *   - NULL if lblk lies in a hole.
+ *   - ERR_PTR(-EIO) if a tree node is corrupted.
+ */
+const struct osfs_extent *osfs_lookup_extent(struct inode *inode, uint32_t lblk,
+                                             struct osfs_extent_cursor *cursor,
+                                             uint32_t *next_lblk)
+{
+    struct osfs_inode *osfs_inode = inode->i_private;
+    struct osfs_sb_info *sb_info = inode->i_sb->s_fs_info;
+    struct osfs_extent_header *hdr = &osfs_inode->i_ext_header;
+    struct osfs_extent *leaves;
+    uint32_t next = U32_MAX;
+    int i;
+
+    // Inline data maps no blocks; the root area holds file bytes instead
+    if (osfs_has_inline_data(osfs_inode))
+        goto hole;
+
+    if (cursor && cursor->generation == osfs_inode->i_ext_generation &&
+        osfs_extent_contains(&cursor->extent, lblk))
+        return &cursor->extent;
+
+    while (hdr->eh_depth > 0) {
+        struct osfs_extent_idx *idx = osfs_ext_index(hdr);
+
+        i = osfs_ext_search(hdr, lblk);
+        if (i == 0) {
+            // lblk lies before everything in this subtree
+            if (hdr->eh_entries)
+                next = idx[0].ei_block;
+            goto hole;
+        }
+        if (i < hdr->eh_entries)
+            next = idx[i].ei_block;
+
+        hdr = osfs_ext_node(sb_info, idx[i - 1].ei_leaf, hdr->eh_depth - 1);
+        if (IS_ERR(hdr))
+            return ERR_CAST(hdr);
+    }
+
+    leaves = osfs_ext_leaves(hdr);
+    i = osfs_ext_search(hdr, lblk);
+    if (i > 0 && osfs_extent_contains(&leaves[i - 1], lblk)) {
+        if (cursor) {
+            cursor->extent = leaves[i - 1];
+            cursor->generation = osfs_inode->i_ext_generation;
+        }
+        return &leaves[i - 1];
+    }
+    if (i < hdr->eh_entries)
+        next = leaves[i].file_block;
+
+hole:
+    if (next_lblk)
+        *next_lblk = next;
+    return NULL;
+}
+
+/**
+ * Function: osfs_ext_new_node
+ * Description: Allocates a data block for a tree node and initializes its header.
+ */
+static struct osfs_extent_header *osfs_ext_new_node(struct inode *inode, uint16_t depth,
+                                                    uint32_t *block)
+{
+    struct osfs_inode *osfs_inode = inode->i_private;
+    struct osfs_sb_info *sb_info = inode->i_sb->s_fs_info;
+    struct osfs_extent_header *hdr;
+    struct osfs_extent node_extent;
+    int ret;
+
+    ret = osfs_alloc_extent(sb_info, 1, &node_extent);
+    if (ret)
+        return ERR_PTR(ret);
+
+    hdr = osfs_block_addr(sb_info, node_extent.start_block);
+    hdr->eh_magic = OSFS_EXT_MAGIC;
+    hdr->eh_entries = 0;
+    hdr->eh_depth = depth;
+    hdr->eh_max = (sb_info->block_size - sizeof(*hdr)) /
+                  (depth ? sizeof(struct osfs_extent_idx) : sizeof(struct osfs_extent));
+
+    osfs_inode->i_blocks++;
+    *block = node_extent.start_block;
+    return hdr;
+}
+
+/**
+ * Function: osfs_ext_grow
+ * Description: Moves the root's entries into a new block and turns the root
+ *              into a one-entry index above it, adding a level to the tree.
+ * Inputs:
+ *   - inode: The inode of the file.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOSPC if the tree is at its maximum depth or no block is free.
+ */
+static int osfs_ext_grow(struct inode *inode)
+{
+    struct osfs_inode *osfs_inode = inode->i_private;
+    struct osfs_extent_header *root = &osfs_inode->i_ext_header;
+    struct osfs_extent_header *node;
+    struct osfs_extent_idx *idx;
+    uint32_t block;
+
+    if (root->eh_depth >= OSFS_EXT_MAX_DEPTH)
+        return -ENOSPC;
+
+    node = osfs_ext_new_node(inode, root->eh_depth, &block);
+    if (IS_ERR(node))
+        return PTR_ERR(node);
+
+    memcpy(node + 1, root + 1, root->eh_entries * osfs_ext_entry_size(root));
+    node->eh_entries = root->eh_entries;
+
+    idx = osfs_ext_index(root);
+    idx[0].ei_block = node->eh_entries ? osfs_ext_key(node, 0) : 0;
+    idx[0].ei_leaf = block;
+    root->eh_depth++;
+    root->eh_entries = 1;
+    root->eh_max = OSFS_ROOT_INDEX_COUNT;
+    return 0;
+}
+
+/**
+ * Function: osfs_ext_split
+ * Description: Splits a full node, linking the new right half into its parent.
+ * Inputs:
+ *   - inode: The inode of the file.
+ *   - parent: The parent of the full node; must have a free slot.
+ *   - slot: The position of the full node in the parent.
+ *   - child: The full node.
+ *   - lblk: The logical block being inserted. Appends beyond the last key
+ *           move only the last entry, so append-only files fill their
+ *           nodes instead of leaving them half empty.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOSPC if no block is free for the new node.
+ */
+static int osfs_ext_split(struct inode *inode, struct osfs_extent_header *parent, int slot,
+                          struct osfs_extent_header *child, uint32_t lblk)
+{
+    struct osfs_extent_header *node;
+    struct osfs_extent_idx *pidx = osfs_ext_index(parent);
+    size_t entry_size = osfs_ext_entry_size(child);
+    int split_at, moved;
+    uint32_t block;
+
+    if (lblk > osfs_ext_key(child, child->eh_entries - 1))
+        split_at = child->eh_entries - 1;
+    else
+        split_at = child->eh_entries / 2;
+    moved = child->eh_entries - split_at;
+
+    node = osfs_ext_new_node(inode, child->eh_depth, &block);
+    if (IS_ERR(node))
+        return PTR_ERR(node);
+
+    memcpy(node + 1, (char *)(child + 1) + split_at * entry_size, moved * entry_size);
+    node->eh_entries = moved;
+    child->eh_entries = split_at;
+
+    memmove(&pidx[slot + 2], &pidx[slot + 1],
+            (parent->eh_entries - slot - 1) * sizeof(*pidx));
+    pidx[slot + 1].ei_block = osfs_ext_key(node, 0);
+    pidx[slot + 1].ei_leaf = block;
+    parent->eh_entries++;
+    return 0;
+}
+
+/**
+ * Function: osfs_insert_extent
+ * Description: Adds an extent to a file's tree at its logical position,
+ *              merging it into the preceding extent when both the logical
+ *              and the physical ranges are adjacent. The extent must not
+ *              overlap any existing one.
+ * Inputs:
+ *   - inode: The inode of the file.
+ *   - extent: The extent to add, with file_block set.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOSPC if the tree cannot grow to hold the extent.
+ *   - -EIO if a tree node is corrupted.
+ */
+int osfs_insert_extent(struct inode *inode, const struct osfs_extent *extent)
+{
+    struct osfs_inode *osfs_inode = inode->i_private;
+    struct osfs_sb_info *sb_info = inode->i_sb->s_fs_info;
+    struct osfs_extent_header *path[OSFS_EXT_MAX_DEPTH + 1];
+    int slots[OSFS_EXT_MAX_DEPTH + 1];
+    struct osfs_extent *leaves;
+    int depth, level, i, ret;
+
+    for (;;) {
+        // Descend to the leaf that should hold the extent
+        depth = osfs_inode->i_ext_header.eh_depth;
+        path[0] = &osfs_inode->i_ext_header;
+        for (level = 0; level < depth; level++) {
+            slots[level] = max(osfs_ext_search(path[level], extent->file_block) - 1, 0);
+            path[level + 1] = osfs_ext_node(sb_info,
+                                            osfs_ext_index(path[level])[slots[level]].ei_leaf,
+                                            depth - level - 1);
+            if (IS_ERR(path[level + 1]))
+                return PTR_ERR(path[level + 1]);
+        }
+
+        leaves = osfs_ext_leaves(path[depth]);
+        i = osfs_ext_search(path[depth], extent->file_block);
+        if (i > 0) {
+            struct osfs_extent *prev = &leaves[i - 1];
+
+            if (prev->file_block + prev->block_count == extent->file_block &&
+                prev->start_block + prev->block_count == extent->start_block) {
+                prev->block_count += extent->block_count;
+                goto out;
+            }
+        }
+        if (path[depth]->eh_entries < path[depth]->eh_max)
+            break;
+
+        // Split below the deepest node with a free slot, or grow the tree
+        // if even the root is full, then descend again
+        for (level = depth - 1; level >= 0; level--)
+            if (path[level]->eh_entries < path[level]->eh_max)
+                break;
+        if (level < 0)
+            ret = osfs_ext_grow(inode);
+        else
+            ret = osfs_ext_split(inode, path[level], slots[level], path[level + 1],
+                                 extent->file_block);
+        osfs_inode->i_ext_generation++;
+        if (ret)
+            return ret;
+    }
+
+    // An extent placed before a subtree's first key becomes its new first key
+    for (level = 0; level < depth; level++) {
+        struct osfs_extent_idx *idx = &osfs_ext_index(path[level])[slots[level]];
+
+        if (idx->ei_block > extent->file_block)
+            idx->ei_block = extent->file_block;
+    }
+
+    memmove(&leaves[i + 1], &leaves[i], (path[depth]->eh_entries - i) * sizeof(*leaves));
+    leaves[i] = *extent;
+    path[depth]->eh_entries++;
+    osfs_inode->i_extent_count++;
+
+out:
+    osfs_inode->i_blocks += extent->block_count;
+    osfs_inode->i_ext_generation++;
+    return 0;
+}
+
+/**
+ * Function: osfs_alloc_file_blocks
+ * Description: Allocates contiguous blocks and maps them into a file. The
+ *              blocks right after the ones mapping lblk - 1 are tried first,
+ *              so a file growing at its tail extends that extent in place
+ *              instead of taking a new one.
+ * Inputs:
+ *   - inode: The inode of the file.
+ *   - lblk: The first logical block to map.
+ *   - count: The largest number of blocks to map.
+ *   - extent: Filled with the new mapping on success; it may map fewer
+ *             than count blocks if free space is fragmented.
+ * Returns:
+ *   - 0 on success.
+ *   - A negative error code from the allocator or the tree on failure.
+ */
+int osfs_alloc_file_blocks(struct inode *inode, uint32_t lblk, uint32_t count,
+                           struct osfs_extent *extent)
+{
+    struct osfs_sb_info *sb_info = inode->i_sb->s_fs_info;
+    uint32_t goal = U32_MAX;
+    int ret;
+
+    if (lblk > 0) {
+        const struct osfs_extent *prev = osfs_lookup_extent(inode, lblk - 1, NULL, NULL);
+
+        if (!IS_ERR_OR_NULL(prev))
+            goal = prev->start_block + (lblk - prev->file_block);
+    }
+
+    ret = osfs_alloc_blocks(sb_info, goal, count, extent);
+    if (ret)
+        return ret;
+
+    extent->file_block = lblk;
+    ret = osfs_insert_extent(inode, extent);
+    if (ret)
+        osfs_free_extent(sb_info, extent);
+    return ret;
+}
+
+/**
+ * Function: osfs_ext_trim_node
+ * Description: Unmaps every block at or after lblk below a node, freeing
+ *              child nodes that become empty.
+ * Inputs:
+ *   - inode: The inode of the file.
+ *   - hdr: The node to trim.
+ *   - lblk: The first logical block to unmap.
+ * Returns:
+ *   - 0 on success.
+ *   - -EIO if a tree node is corrupted.
+ */
+static int osfs_ext_trim_node(struct inode *inode, struct osfs_extent_header *hdr,
+                              uint32_t lblk)
+{
+    struct osfs_inode *osfs_inode = inode->i_private;
+    struct osfs_sb_info *sb_info = inode->i_sb->s_fs_info;
+    int i, ret;
+
+    // Entries are sorted, so walk back from the last until one starts before lblk
+    for (i = hdr->eh_entries - 1; i >= 0; i--) {
+        if (hdr->eh_depth == 0) {
+            struct osfs_extent *extent = &osfs_ext_leaves(hdr)[i];
+            struct osfs_extent tail = *extent;
+
+            if (extent->file_block >= lblk) {
+                osfs_free_extent(sb_info, &tail);
+                osfs_inode->i_blocks -= tail.block_count;
+                osfs_inode->i_extent_count--;
+                hdr->eh_entries--;
+                continue;
+            }
+            if (extent->file_block + extent->block_count > lblk) {
+                extent->block_count = lblk - extent->file_block;
+                tail.start_block += extent->block_count;
+                tail.block_count -= extent->block_count;
+                osfs_free_extent(sb_info, &tail);
+                osfs_inode->i_blocks -= tail.block_count;
+            }
+            break;
+        } else {
+            struct osfs_extent_idx *idx = &osfs_ext_index(hdr)[i];
+            struct osfs_extent_header *child;
+
+            child = osfs_ext_node(sb_info, idx->ei_leaf, hdr->eh_depth - 1);
+            if (IS_ERR(child))
+                return PTR_ERR(child);
+            ret = osfs_ext_trim_node(inode, child, lblk);
+            if (ret)
+                return ret;
+            if (child->eh_entries == 0) {
+                struct osfs_extent node_extent = {
+                    .start_block = idx->ei_leaf,
+                    .block_count = 1,
+                };
+
+                osfs_free_extent(sb_info, &node_extent);
+                osfs_inode->i_blocks--;
+                hdr->eh_entries--;
+                continue;
+            }
+            if (idx->ei_block < lblk)
+                break;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Function: osfs_truncate_extents
+ * Description: Unmaps and frees every block of a file from lblk onwards.
+ * Inputs:
+ *   - inode: The inode of the file.
+ *   - lblk: The first logical block to unmap.
+ * Returns:
+ *   - 0 on success.
+ *   - -EIO if a tree node is corrupted.
+ */
+int osfs_truncate_extents(struct inode *inode, uint32_t lblk)
+{
+    struct osfs_inode *osfs_inode = inode->i_private;
+    int ret;
+
+    if (osfs_has_inline_data(osfs_inode))
+        return 0;
+
+    ret = osfs_ext_trim_node(inode, &osfs_inode->i_ext_header, lblk);
+    // An index root left without children goes back to being an empty leaf
+    if (osfs_inode->i_ext_header.eh_entries == 0)
+        osfs_init_extent_root(osfs_inode);
+    if (osfs_inode->i_prealloc_start >= lblk)
+        osfs_inode->i_prealloc_start = 0;
+    osfs_inode->i_ext_generation++;
+    return ret;
+}
+
+/**
+ * Function: osfs_ext_free_node
+ * Description: Frees every extent below a node and the blocks of its child nodes.
+ */
+static void osfs_ext_free_node(struct osfs_sb_info *sb_info, struct osfs_extent_header *hdr)
+{
+    int i;
+
+    if (hdr->eh_depth == 0) {
+        for (i = 0; i < hdr->eh_entries; i++)
+            osfs_free_extent(sb_info, &osfs_ext_leaves(hdr)[i]);
+        return;
+    }
+
+    for (i = 0; i < hdr->eh_entries; i++) {
+        struct osfs_extent node_extent = {
+            .start_block = osfs_ext_index(hdr)[i].ei_leaf,
+            .block_count = 1,
+        };
+        struct osfs_extent_header *child;
+
+        child = osfs_ext_node(sb_info, node_extent.start_block, hdr->eh_depth - 1);
+        if (!IS_ERR(child))
+            osfs_ext_free_node(sb_info, child);
+        osfs_free_extent(sb_info, &node_extent);
+    }
+}
+
+/**
+ * Function: osfs_ext_mark_node
+ * Description: Marks the blocks of the child nodes below a node and, if
+ *              data is set, the blocks its leaves map.
+ */
+static void osfs_ext_mark_node(struct osfs_sb_info *sb_info, struct osfs_extent_header *hdr,
+                               bool data, unsigned long *map)
+{
+    int i;
+
+    if (hdr->eh_depth == 0) {
+        if (!data)
+            return;
+        for (i = 0; i < hdr->eh_entries; i++) {
+            struct osfs_extent *extent = &osfs_ext_leaves(hdr)[i];
+
+            if (extent->start_block < sb_info->block_count &&
+                extent->block_count <= sb_info->block_count - extent->start_block)
+                bitmap_set(map, extent->start_block, extent->block_count);
+        }
+        return;
+    }
+
+    for (i = 0; i < hdr->eh_entries; i++) {
+        uint32_t block = osfs_ext_index(hdr)[i].ei_leaf;
+        struct osfs_extent_header *child;
+
+        child = osfs_ext_node(sb_info, block, hdr->eh_depth - 1);
+        if (IS_ERR(child))
+            continue;
+        set_bit(block, map);
+        osfs_ext_mark_node(sb_info, child, data, map);
+    }
+}
+
+/**
+ * Function: osfs_ext_mark_meta
+ * Description: Marks the data blocks of an inode that hold filesystem
+ *              structure rather than file data: the nodes of its extent
+ *              tree and, for a directory, every block it maps.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - osfs_inode: The inode.
+ *   - map: Bitmap over the data blocks to set the blocks in.
+ * Returns:
+ *   - None.
+ */
+void osfs_ext_mark_meta(struct osfs_sb_info *sb_info, struct osfs_inode *osfs_inode,
+                        unsigned long *map)
+{
+    if (!osfs_has_inline_data(osfs_inode))
+        osfs_ext_mark_node(sb_info, &osfs_inode->i_ext_header,
+                           S_ISDIR(osfs_inode->i_mode), map);
+}
+
+/**
+ * Function: osfs_ext_claim
+ * Description: Checks that a run of blocks lies in the data area, is
+ *              allocated and is not used twice, then marks it seen.
+ */
+static bool osfs_ext_claim(struct osfs_sb_info *sb_info, uint32_t start, uint32_t count,
+                           unsigned long *seen)
+{
+    if (!count || start >= sb_info->block_count || count > sb_info->block_count - start ||
+        find_next_zero_bit(sb_info->block_bitmap, start + count, start) < start + count ||
+        find_next_bit(seen, start + count, start) < start + count)
+        return false;
+    bitmap_set(seen, start, count);
+    return true;
+}
+
+/**
+ * Function: osfs_ext_check_node
+ * Description: Checks a node and everything below it. next is the lowest
+ *              logical block the next leaf extent may start at.
+ */
+static int osfs_ext_check_node(struct osfs_sb_info *sb_info, struct osfs_extent_header *hdr,
+                               unsigned long *seen, uint64_t *next)
+{
+    int i, ret;
+
+    for (i = 0; i < hdr->eh_entries; i++) {
+        if (hdr->eh_depth == 0) {
+            struct osfs_extent *extent = &osfs_ext_leaves(hdr)[i];
+
+            if (extent->file_block < *next ||
+                !osfs_ext_claim(sb_info, extent->start_block, extent->block_count, seen))
+                return -EUCLEAN;
+            *next = (uint64_t)extent->file_block + extent->block_count;
+        } else {
+            struct osfs_extent_idx *idx = &osfs_ext_index(hdr)[i];
+            struct osfs_extent_header *child;
+
+            if ((i && idx->ei_block < idx[-1].ei_block) ||
+                !osfs_ext_claim(sb_info, idx->ei_leaf, 1, seen))
+                return -EUCLEAN;
+            child = osfs_ext_node(sb_info, idx->ei_leaf, hdr->eh_depth - 1);
+            if (IS_ERR(child))
+                return -EUCLEAN;
+            ret = osfs_ext_check_node(sb_info, child, seen, next);
+            if (ret)
+                return ret;
+        }
+    }
+    // Logical blocks past U32_MAX cannot be addressed
+    return *next > U32_MAX ? -EUCLEAN : 0;
+}
+
+/**
+ * Function: osfs_ext_check
+ * Description: Checks the extent tree of an inode loaded from an image:
+ *              node headers fit their root or block, keys are sorted,
+ *              and every node and extent lies in the data area, is
+ *              allocated and is used by no other node or extent so far.
+ *              The blocks are then marked in seen.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - osfs_inode: The inode, which must not keep its data inline.
+ *   - seen: Bitmap over the data blocks of everything checked so far.
+ * Returns:
+ *   - 0 if the tree can be trusted.
+ *   - -EUCLEAN if it is corrupted.
+ */
+int osfs_ext_check(struct osfs_sb_info *sb_info, struct osfs_inode *osfs_inode,
+                   unsigned long *seen)
+{
+    struct osfs_extent_header *root = &osfs_inode->i_ext_header;
+    uint64_t next = 0;
+
+    if (root->eh_magic != OSFS_EXT_MAGIC || root->eh_depth > OSFS_EXT_MAX_DEPTH ||
+        root->eh_max != (root->eh_depth ? OSFS_ROOT_INDEX_COUNT : OSFS_ROOT_EXTENT_COUNT) ||
+        root->eh_entries > root->eh_max)
+        return -EUCLEAN;
+    return osfs_ext_check_node(sb_info, root, seen, &next);
+}
+
+/**
+ * Function: osfs_free_extents
+ * Description: Releases all blocks of a file, data and tree nodes alike.
+ * Inputs:
+ *   - inode: The inode of the file.
+ * Returns:
+ *   - None.
+ */
+void osfs_free_extents(struct inode *inode)
+{
+    struct osfs_inode *osfs_inode = inode->i_private;
+
+    if (!osfs_has_inline_data(osfs_inode))
+        osfs_ext_free_node(inode->i_sb->s_fs_info, &osfs_inode->i_ext_header);
+    osfs_init_extent_root(osfs_inode);
+    osfs_inode->i_flags &= ~(OSFS_INLINE_DATA_FL | OSFS_COMPRESSED_FL);
+    osfs_inode->i_extent_count = 0;
+    osfs_inode->i_blocks = 0;
+    osfs_inode->i_prealloc_start = 0;
+    osfs_inode->i_ext_generation++;
+}
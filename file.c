@@ -1,206 +1,396 @@
 #include <linux/fs.h>
 #include <linux/uaccess.h>
+#include <linux/uio.h>
+#include <linux/mm.h>
+#include <linux/pagemap.h>
 #include "osfs.h"
 
 /**
- * Function: osfs_read
- * Description: Reads data from a file.
+ * Function: osfs_extent_addr
+ * Description: Resolves a file position inside an extent to the data block
+ *              memory backing it.
  * Inputs:
- *   - filp: The file pointer representing the file to read from.
- *   - buf: The user-space buffer to copy the data into.
- *   - len: The number of bytes to read.
- *   - ppos: The file position pointer.
+ *   - sb_info: The superblock information of the filesystem.
+ *   - current_extent: The extent covering pos.
+ *   - pos: The file position to resolve.
+ *   - contig: Set to the number of bytes from pos that are contiguous in
+ *             memory, bounded by the end of the extent and of its chunk.
+ * Returns:
+ *   - The kernel address of the byte at pos on success.
+ *   - ERR_PTR(-EIO) if the extent lies outside the data area.
+ */
+static void *osfs_extent_addr(struct osfs_sb_info *sb_info,
+                              const struct osfs_extent *current_extent,
+                              loff_t pos, size_t *contig)
+{
+    uint64_t offset_in_extent;
+    uint32_t block, block_offset;
+
+    // 確保數據區塊位置合法
+    if (current_extent->start_block >= sb_info->block_count ||
+        current_extent->block_count > sb_info->block_count - current_extent->start_block) {
+        pr_err("osfs_extent_addr: Invalid block number: %u\n", current_extent->start_block);
+        return ERR_PTR(-EIO);
+    }
+
+    offset_in_extent = pos - ((uint64_t)current_extent->file_block << sb_info->block_bits);
+    block = current_extent->start_block + (offset_in_extent >> sb_info->block_bits);
+    block_offset = offset_in_extent & (sb_info->block_size - 1);
+
+    // extent中剩下的空間; an extent may also straddle two chunks, which are
+    // not adjacent in memory
+    *contig = min_t(uint64_t,
+                    ((uint64_t)current_extent->block_count << sb_info->block_bits) - offset_in_extent,
+                    ((uint64_t)osfs_chunk_blocks_left(sb_info, block) << sb_info->block_bits) - block_offset);
+
+    return (char *)osfs_block_addr(sb_info, block) + block_offset;
+}
+
+/**
+ * Function: osfs_map_pos
+ * Description: Resolves a file position to the data block memory backing it.
+ * Inputs:
+ *   - inode: The inode of the file.
+ *   - pos: The file position to resolve.
+ *   - cursor: The extent cursor of the open file, or NULL.
+ *   - contig: Set to the number of bytes from pos that are contiguous in
+ *             memory, bounded by the end of the extent and of its chunk.
+ *             If pos lies in a hole, set to the length of the hole instead
+ *             (SIZE_MAX if no extent follows).
+ * Returns:
+ *   - The kernel address of the byte at pos on success; for a block
+ *     whose placement is delayed, the address in its pending page.
+ *   - NULL if pos lies in a hole.
+ *   - ERR_PTR(-EIO) if the covering extent lies outside the data area or
+ *     the extent tree is corrupted.
+ */
+void *osfs_map_pos(struct inode *inode, loff_t pos,
+                   struct osfs_extent_cursor *cursor, size_t *contig)
+{
+    struct osfs_sb_info *sb_info = inode->i_sb->s_fs_info;
+    const struct osfs_extent *current_extent;
+    uint32_t next_lblk;
+
+    current_extent = osfs_lookup_extent(inode, pos >> sb_info->block_bits, cursor, &next_lblk);
+    if (IS_ERR(current_extent))
+        return ERR_CAST(current_extent);
+    if (!current_extent) {
+        char *pending = osfs_delalloc_lookup(inode, pos >> sb_info->block_bits, &next_lblk);
+        uint32_t offset = pos & (sb_info->block_size - 1);
+
+        if (pending) {
+            *contig = sb_info->block_size - offset;
+            return pending + offset;
+        }
+        *contig = next_lblk == U32_MAX ? SIZE_MAX :
+                  ((uint64_t)next_lblk << sb_info->block_bits) - pos;
+        return NULL;
+    }
+
+    return osfs_extent_addr(sb_info, current_extent, pos, contig);
+}
+
+/**
+ * Function: osfs_cursor_load
+ * Description: Copies the extent cursor of an open file. Threads sharing
+ *              the file work on private copies, since readers run in
+ *              parallel and must not tear each other's cursor.
+ */
+static void osfs_cursor_load(struct file *filp, struct osfs_extent_cursor *cursor)
+{
+    spin_lock(&filp->f_lock);
+    *cursor = *(struct osfs_extent_cursor *)filp->private_data;
+    spin_unlock(&filp->f_lock);
+}
+
+/**
+ * Function: osfs_cursor_store
+ * Description: Saves a private copy back as the extent cursor of a file.
+ */
+static void osfs_cursor_store(struct file *filp, const struct osfs_extent_cursor *cursor)
+{
+    spin_lock(&filp->f_lock);
+    *(struct osfs_extent_cursor *)filp->private_data = *cursor;
+    spin_unlock(&filp->f_lock);
+}
+
+/**
+ * Function: osfs_do_read
+ * Description: Reads data from a file into an iov_iter. The caller holds
+ *              i_rwsem, at least shared.
+ * Inputs:
+ *   - iocb: The I/O control block carrying the file and position.
+ *   - to: The destination iterator.
+ *   - cursor: The caller's extent cursor.
  * Returns:
  *   - The number of bytes read on success.
  *   - 0 if the end of the file is reached.
- *   - -EFAULT if copying data to user space fails.
+ *   - -EFAULT if copying data to the destination fails.
+ *   - -ENOMEM if a compressed cluster cannot be decompressed for lack of memory.
+ *   - -EIO if the file's extents or compressed clusters are corrupted.
  */
-static ssize_t osfs_read(struct file *filp, char __user *buf, size_t len, loff_t *ppos)
+static ssize_t osfs_do_read(struct kiocb *iocb, struct iov_iter *to,
+                            struct osfs_extent_cursor *cursor)
 {
-    struct inode *inode = file_inode(filp);
+    struct inode *inode = file_inode(iocb->ki_filp);
     struct osfs_inode *osfs_inode = inode->i_private;
-    struct osfs_sb_info *sb_info = inode->i_sb->s_fs_info;
-    void *data_block;
     ssize_t bytes_read = 0;
-    uint32_t current_pos = *ppos;
-
-    // If the file has not been allocated a data block, it indicates the file is empty
-    if (osfs_inode->i_blocks == 0 || osfs_inode->i_extent_count == 0) {
-        pr_debug("osfs_read: File has no data blocks\n");
-        return 0;
-    }
+    loff_t current_pos = iocb->ki_pos;
+    size_t len;
 
     if (current_pos >= osfs_inode->i_size)
         return 0;
 
-    if (current_pos + len > osfs_inode->i_size)
-        len = osfs_inode->i_size - current_pos;
+    len = min_t(size_t, iov_iter_count(to), osfs_inode->i_size - current_pos);
 
-    while (len > 0) {
-        uint32_t accumulated_size = 0;
-        struct osfs_extent *current_extent = NULL;
-        uint32_t offset_in_extent = 0;
-        uint32_t bytes_to_read;
-        int i;
-
-        // 在多個 extent 中讀取數據
-        for (i = 0; i < osfs_inode->i_extent_count; i++) {
-            uint32_t extent_size = osfs_inode->i_extents[i].block_count * BLOCK_SIZE;//第i個extent
-            // currentpos在這個 extent 內
-            if (current_pos < accumulated_size + extent_size) {
-                current_extent = &osfs_inode->i_extents[i];
-                offset_in_extent = current_pos - accumulated_size;
-                break;
-            }
-            accumulated_size += extent_size;
-        }
+    if (osfs_has_inline_data(osfs_inode)) {
+        char data[OSFS_INLINE_MAX];
+        ssize_t ret;
 
-        if (!current_extent) {
-            pr_err("osfs_read: Could not find extent for position %u\n", current_pos);
-            break;
+        ret = osfs_inline_get(inode, current_pos, data, len);
+        if (ret != -ENODATA) {
+            bytes_read = copy_to_iter(data, ret, to);
+            if (ret > 0 && bytes_read == 0)
+                return -EFAULT;
+            len = 0;
+            current_pos += bytes_read;
         }
+    }
 
-        // 確保數據區塊位置合法
-        if (current_extent->start_block >= sb_info->block_count) {
-            pr_err("osfs_read: Invalid block number: %u\n", current_extent->start_block);
-            return -EIO;
-        }
+    while (len > 0) {
+        struct osfs_cluster *cluster = NULL;
+        void *data_block = ERR_PTR(-ENODATA);
+        size_t bytes_to_read, copied;
+
+        // Compressed data is copied out of a decompressed cluster
+        if (osfs_is_compressed(osfs_inode))
+            data_block = osfs_compress_map(inode, current_pos, &cluster, &bytes_to_read);
+        if (data_block == ERR_PTR(-ENODATA))
+            data_block = osfs_map_pos(inode, current_pos, cursor, &bytes_to_read);
+        if (IS_ERR(data_block))
+            return bytes_read > 0 ? bytes_read : PTR_ERR(data_block);
 
         // 計算這次要讀取的大小
-        bytes_to_read = min_t(uint32_t, len,
-                            (current_extent->block_count * BLOCK_SIZE) - offset_in_extent);//extent中剩下的空間 or 剩下要讀取的量
+        bytes_to_read = min(bytes_to_read, len);
 
-        // 計算實際的數據位置
-        data_block = (char *)sb_info->data_blocks + 
-                    (current_extent->start_block * BLOCK_SIZE) + 
-                    offset_in_extent;
+        pr_debug("osfs_read_iter: Reading %zu bytes at position %lld\n",
+                bytes_to_read, current_pos);
 
-        // 驗證記憶體範圍
-        if ((void *)data_block + bytes_to_read > 
-            (void *)sb_info->data_blocks + (sb_info->block_count * BLOCK_SIZE)) {
-            pr_err("osfs_read: Memory access out of bounds\n");
-            return -EIO;
+        // Holes read back as zeros
+        if (data_block)
+            copied = copy_to_iter(data_block, bytes_to_read, to);
+        else
+            copied = iov_iter_zero(bytes_to_read, to);
+        osfs_cluster_put(cluster);
+        bytes_read += copied;
+        len -= copied;
+        current_pos += copied;
+
+        if (copied < bytes_to_read) {
+            pr_err("osfs_read_iter: copy_to_iter failed\n");
+            if (bytes_read == 0)
+                return -EFAULT;
+            break;
         }
+    }
 
-        pr_debug("osfs_read: Reading %u bytes from block %u at offset %u\n",
-                bytes_to_read, current_extent->start_block, offset_in_extent);
+    iocb->ki_pos = current_pos;
+    file_accessed(iocb->ki_filp);
+    pr_debug("osfs_read_iter: Read complete. Total bytes read: %zd\n", bytes_read);
+    return bytes_read;
+}
 
-        if (copy_to_user(buf + bytes_read, data_block, bytes_to_read)) {
-            pr_err("osfs_read: copy_to_user failed\n");
-            return bytes_read > 0 ? bytes_read : -EFAULT;
-        }
+/**
+ * Function: osfs_read_iter
+ * Description: Reads data from a file into an iov_iter. Readers share
+ *              i_rwsem, so they only ever wait for writers.
+ * Inputs:
+ *   - iocb: The I/O control block carrying the file, position and flags.
+ *   - to: The destination iterator.
+ * Returns:
+ *   - The number of bytes read on success.
+ *   - -EAGAIN if IOCB_NOWAIT is set and a writer holds the file.
+ *   - A negative error code from osfs_do_read on failure.
+ */
+static ssize_t osfs_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct inode *inode = file_inode(iocb->ki_filp);
+    struct osfs_extent_cursor cursor;
+    ssize_t ret;
 
-        bytes_read += bytes_to_read;
-        len -= bytes_to_read;
-        current_pos += bytes_to_read;
+    if (iocb->ki_flags & IOCB_NOWAIT) {
+        if (!inode_trylock_shared(inode))
+            return -EAGAIN;
+    } else {
+        inode_lock_shared(inode);
     }
 
-    *ppos = current_pos;
-    pr_debug("osfs_read: Read complete. Total bytes read: %zd\n", bytes_read);
-    return bytes_read;
+    osfs_cursor_load(iocb->ki_filp, &cursor);
+    ret = osfs_do_read(iocb, to, &cursor);
+    osfs_cursor_store(iocb->ki_filp, &cursor);
+
+    inode_unlock_shared(inode);
+    return ret;
 }
 
 /**
- * Function: osfs_write
- * Description: Writes data to a file.
+ * Function: osfs_do_write
+ * Description: Writes data from an iov_iter to a file. The caller holds
+ *              i_rwsem exclusively.
  * Inputs:
- *   - filp: The file pointer representing the file to write to.
- *   - buf: The user-space buffer containing the data to write.
- *   - len: The number of bytes to write.
- *   - ppos: The file position pointer.
+ *   - iocb: The I/O control block carrying the file, position and flags.
+ *   - from: The source iterator.
+ *   - cursor: The caller's extent cursor.
  * Returns:
  *   - The number of bytes written on success.
- *   - -EFAULT if copying data from user space fails.
- *   - Adjusted length if the write exceeds the block size.
+ *   - -EAGAIN if IOCB_NOWAIT is set and memory would have to be allocated.
+ *   - -EFAULT if copying data from the source fails.
+ *   - -ENOSPC if no block can be reserved for the data, or a compressed
+ *     file cannot be expanded.
+ *   - -EIO if the file's extents are corrupted.
+ *   - A negative error code from osfs_delalloc_flush if the pending
+ *     blocks of the file cannot be placed.
  */
-static ssize_t osfs_write(struct file *filp, const char __user *buf, size_t len, loff_t *ppos)
+static ssize_t osfs_do_write(struct kiocb *iocb, struct iov_iter *from,
+                             struct osfs_extent_cursor *cursor)
 {   
     //Step1: Retrieve the inode and filesystem information
-    struct inode *inode = file_inode(filp);
+    struct inode *inode = file_inode(iocb->ki_filp);
     struct osfs_inode *osfs_inode = inode->i_private;
     struct osfs_sb_info *sb_info = inode->i_sb->s_fs_info;
     void *data_block;
     ssize_t bytes_written = 0;
-    int ret;
-    uint32_t current_pos = *ppos; 
-
-    // Step2: Check if a data block has been allocated; if not, allocate one
-    if (osfs_inode->i_extent_count == 0) { //如果還沒有extent則分配
-        struct osfs_extent *new_extent = &osfs_inode->i_extents[0];
-        uint32_t blocks_needed = (len + BLOCK_SIZE - 1) / BLOCK_SIZE; //向上取整數
-        
-        ret = osfs_alloc_extent(sb_info, blocks_needed, new_extent);
-        if (ret) {
-            pr_err("osfs_write: Failed to allocate extent\n");
-            return ret;
+    ssize_t ret;
+    loff_t current_pos;
+    size_t len;
+
+    // Handles O_APPEND and the file size limits
+    ret = generic_write_checks(iocb, from);
+    if (ret <= 0)
+        return ret;
+    len = ret;
+    current_pos = iocb->ki_pos;
+
+    // Small files stay inside the inode until a write reaches past it
+    if (osfs_has_inline_data(osfs_inode)) {
+        if (current_pos + len <= OSFS_INLINE_MAX) {
+            char data[OSFS_INLINE_MAX];
+
+            bytes_written = copy_from_iter(data, len, from);
+            if (bytes_written == 0)
+                return -EFAULT;
+            ret = osfs_inline_put(inode, current_pos, data, bytes_written);
+            if (ret != -ENODATA) {
+                current_pos += bytes_written;
+                len = 0;
+            } else {
+                // Converted by a concurrent mmap; write through the extents
+                iov_iter_revert(from, bytes_written);
+                bytes_written = 0;
+            }
+        } else {
+            // Conversion allocates a block
+            if (iocb->ki_flags & IOCB_NOWAIT)
+                return -EAGAIN;
+            ret = osfs_inline_convert(inode);
+            if (ret)
+                return ret;
         }
-        osfs_inode->i_extent_count = 1;
-        osfs_inode->i_blocks += blocks_needed;
     }
 
-    // Step3: Limit the write length to fit within one data block
+    // Writes go to plain blocks, so a compressed file is expanded first
+    if (osfs_is_compressed(osfs_inode)) {
+        if (iocb->ki_flags & IOCB_NOWAIT)
+            return -EAGAIN;
+        ret = osfs_compress_expand(inode);
+        if (ret)
+            return ret;
+    }
+
+    // A long streaming write places what it has so far, bounding the
+    // pages it pins. This is done before copying, so a failure can be
+    // returned with nothing written and the pending blocks stay as they are
+    if (OSFS_I(inode)->i_delalloc_count >= OSFS_DELALLOC_MAX_BLOCKS &&
+        !(iocb->ki_flags & IOCB_NOWAIT)) {
+        ret = osfs_delalloc_flush(inode, true);
+        if (ret)
+            return ret;
+    }
+
+    // Step2: Copy as much as is contiguous in memory on each pass, up to
+    // the end of the extent or of its chunk
     // 寫入循環
     while (len > 0) {
-        struct osfs_extent *current_extent = NULL;
-        uint32_t i;
-        uint32_t block_offset;
-        uint32_t bytes_to_write;
+        const struct osfs_extent *current_extent;
+        uint32_t lblk = current_pos >> sb_info->block_bits;
+        uint32_t block = U32_MAX;
+        size_t bytes_to_write, copied;
 
         // 看現在的寫入位置是否在某一個extent內
-        for (i = 0; i < osfs_inode->i_extent_count; i++) {
-            struct osfs_extent *extent = &osfs_inode->i_extents[i];
-            uint32_t extent_start = extent->start_block * BLOCK_SIZE;
-            uint32_t extent_size = extent->block_count * BLOCK_SIZE;
-            
-            if (current_pos >= extent_start && 
-                current_pos < extent_start + extent_size) {
-                current_extent = extent;
+        current_extent = osfs_lookup_extent(inode, lblk, cursor, NULL);
+        if (IS_ERR(current_extent)) {
+            if (bytes_written > 0)
                 break;
-            }
+            return PTR_ERR(current_extent);
         }
-// loop device
-        // 如果需要分配新的 extent
-        if (!current_extent && osfs_inode->i_extent_count < MAX_EXTENT_COUNT) {
-            struct osfs_extent *new_extent = &osfs_inode->i_extents[osfs_inode->i_extent_count];
-            uint32_t blocks_needed = (len + BLOCK_SIZE - 1) / BLOCK_SIZE;
-            
-            ret = osfs_alloc_extent(sb_info, blocks_needed, new_extent);
+
+        // Step3: 計算寫入位置和大小
+        if (current_extent) {
+            data_block = osfs_extent_addr(sb_info, current_extent, current_pos, &bytes_to_write);
+            block = current_extent->start_block + (lblk - current_extent->file_block);
+        } else if (IS_DAX(inode)) {
+            // DAX writes land on the device, so the blocks are placed now
+            struct osfs_extent extent;
+
+            ret = iocb->ki_flags & IOCB_NOWAIT ? -EAGAIN :
+                  osfs_dax_alloc(inode, current_pos, len, &extent);
             if (ret) {
-                if (bytes_written > 0)
-                    break;
-                return ret;
+                data_block = ERR_PTR(ret);
+            } else {
+                data_block = osfs_extent_addr(sb_info, &extent, current_pos, &bytes_to_write);
+                block = extent.start_block + (lblk - extent.file_block);
             }
-            current_extent = new_extent;
-            osfs_inode->i_extent_count++;
-            osfs_inode->i_blocks += blocks_needed;
+        } else {
+            // No block yet: buffer the data and leave placement to the flush
+            uint32_t offset = current_pos & (sb_info->block_size - 1);
+
+            data_block = osfs_delalloc_block(inode, lblk, iocb->ki_flags & IOCB_NOWAIT);
+            if (!IS_ERR(data_block))
+                data_block += offset;
+            bytes_to_write = sb_info->block_size - offset;
         }
-        //超過最大連續數
-        if (!current_extent) { 
+        if (IS_ERR(data_block)) {
             if (bytes_written > 0)
                 break;
-            return -ENOSPC;
+            return PTR_ERR(data_block);
         }
+        bytes_to_write = min(bytes_to_write, len);
 
-        // 計算寫入位置和大小
-        block_offset = current_pos % BLOCK_SIZE;
-        bytes_to_write = min(len, BLOCK_SIZE - block_offset);
-
-        data_block = sb_info->data_blocks + 
-                    current_extent->start_block * BLOCK_SIZE + 
-                    block_offset;
-
-        // Step4: Write data from user space to the data block
-        if (copy_from_user(data_block, buf + bytes_written, bytes_to_write))
-            return bytes_written > 0 ? bytes_written : -EFAULT;
+        // Step4: Write data from the source iterator to the data block;
+        // on DAX, past the CPU cache so it reaches the device
+        if (IS_DAX(inode))
+            copied = copy_from_iter_flushcache(data_block, bytes_to_write, from);
+        else
+            copied = copy_from_iter(data_block, bytes_to_write, from);
+        // Placed blocks reach the image with the next save; pending pages when placed
+        if (block != U32_MAX && copied)
+            osfs_mark_dirty(sb_info, block,
+                            DIV_ROUND_UP((current_pos & (sb_info->block_size - 1)) + copied,
+                                         sb_info->block_size));
+        bytes_written += copied;
+        len -= copied;
+        current_pos += copied;
 
-        bytes_written += bytes_to_write;
-        len -= bytes_to_write;
-        current_pos += bytes_to_write;
+        if (copied < bytes_to_write) {
+            if (bytes_written == 0)
+                return -EFAULT;
+            break;
+        }
     }
     
 
     // Step5: Update inode & osfs_inode attribute
-    *ppos = current_pos;
+    iocb->ki_pos = current_pos;
     
     //寫入位置超過file大小則更新file system 和 VFS的inode大小
     if (current_pos > osfs_inode->i_size) {
@@ -215,14 +405,560 @@ static ssize_t osfs_write(struct file *filp, const char __user *buf, size_t len,
     return bytes_written;
 }
 
+/**
+ * Function: osfs_write_iter
+ * Description: Writes data from an iov_iter to a file under an exclusive
+ *              i_rwsem.
+ * Inputs:
+ *   - iocb: The I/O control block carrying the file, position and flags.
+ *   - from: The source iterator.
+ * Returns:
+ *   - The number of bytes written on success.
+ *   - -EAGAIN if IOCB_NOWAIT is set and the file is busy.
+ *   - A negative error code from osfs_do_write on failure.
+ */
+static ssize_t osfs_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    struct inode *inode = file_inode(iocb->ki_filp);
+    struct osfs_extent_cursor cursor;
+    ssize_t ret;
+
+    if (iocb->ki_flags & IOCB_NOWAIT) {
+        if (!inode_trylock(inode))
+            return -EAGAIN;
+    } else {
+        inode_lock(inode);
+    }
+
+    osfs_cursor_load(iocb->ki_filp, &cursor);
+    ret = osfs_do_write(iocb, from, &cursor);
+    osfs_cursor_store(iocb->ki_filp, &cursor);
+
+    inode_unlock(inode);
+    return ret;
+}
+
+/**
+ * Function: osfs_data_page
+ * Description: Returns the page backing an address from osfs_map_pos: part
+ *              of a vmalloc'ed chunk, or a pending page of delayed data.
+ */
+static struct page *osfs_data_page(void *addr)
+{
+    return is_vmalloc_addr(addr) ? vmalloc_to_page(addr) : virt_to_page(addr);
+}
+
+/**
+ * Function: osfs_vm_fault
+ * Description: Maps a file page straight onto the data block that backs it.
+ *              The block is part of a vmalloc'ed chunk, or the pending
+ *              page of a delayed block, so the page is shared with
+ *              read_iter/write_iter and no copy is made. Placing a delayed
+ *              block unmaps its page first. With DAX the device page is
+ *              mapped by pfn instead.
+ * Inputs:
+ *   - vmf: The fault being handled.
+ * Returns:
+ *   - 0 with vmf->page referenced on success.
+ *   - VM_FAULT_NOPAGE once a DAX pfn is mapped.
+ *   - VM_FAULT_SIGBUS if the page is beyond EOF or not backed by an
+ *     extent, or a compressed file cannot be expanded.
+ */
+static vm_fault_t osfs_vm_fault(struct vm_fault *vmf)
+{
+    struct inode *inode = file_inode(vmf->vma->vm_file);
+    loff_t pos = (loff_t)vmf->pgoff << PAGE_SHIFT;
+    vm_fault_t ret = VM_FAULT_SIGBUS;
+    void *data_block;
+    size_t contig;
+
+    // A file compressed between mmap and the mapping going live is
+    // expanded here; once mapped it is never compressed again
+    if (osfs_is_compressed(inode->i_private) && osfs_compress_expand(inode))
+        return VM_FAULT_SIGBUS;
+
+    // i_rwsem may already be held by a write faulting on its own buffer
+    filemap_invalidate_lock_shared(inode->i_mapping);
+    if (pos >= i_size_read(inode))
+        goto out;
+
+    data_block = osfs_map_pos(inode, pos, NULL, &contig);
+    if (IS_ERR_OR_NULL(data_block))
+        goto out;
+
+    if (IS_DAX(inode)) {
+        ret = osfs_dax_fault(vmf, data_block);
+        goto out;
+    }
+    vmf->page = osfs_data_page(data_block);
+    get_page(vmf->page);
+    ret = 0;
+out:
+    filemap_invalidate_unlock_shared(inode->i_mapping);
+    return ret;
+}
+
+static const struct vm_operations_struct osfs_vm_ops = {
+    .fault = osfs_vm_fault,
+};
+
+/**
+ * Function: osfs_file_mmap
+ * Description: Sets up a zero-copy mapping of a file. Shared writable
+ *              mappings modify the data blocks in place; private ones are
+ *              copied on write by the MM as usual.
+ * Inputs:
+ *   - filp: The file being mapped.
+ *   - vma: The new mapping.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENODEV if blocks are smaller than a page, since a page would then
+ *     span blocks that need not be adjacent.
+ */
+static int osfs_file_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    struct inode *inode = file_inode(filp);
+    struct osfs_sb_info *sb_info = inode->i_sb->s_fs_info;
+    int ret;
+
+    if (sb_info->block_size != PAGE_SIZE)
+        return -ENODEV;
+
+    // Pages can only map plain data blocks, so inline data moves to one
+    // first and a compressed file is expanded
+    ret = osfs_inline_convert(inode);
+    if (!ret)
+        ret = osfs_compress_expand(inode);
+    if (ret)
+        return ret;
+
+    // Stores through the mapping reach the blocks unseen, so saves write
+    // the whole file until the mapping is gone
+    if ((vma->vm_flags & VM_SHARED) && (vma->vm_flags & VM_MAYWRITE))
+        set_bit(OSFS_I_MMAP_WRITE, &OSFS_I(inode)->i_state);
+
+    file_accessed(filp);
+    vma->vm_ops = &osfs_vm_ops;
+    // DAX faults insert device pfns rather than pages
+    if (IS_DAX(inode))
+        vm_flags_set(vma, VM_MIXEDMAP);
+    return 0;
+}
+
+/**
+ * Function: osfs_mmap_mark_dirty
+ * Description: Marks every placed block of a file dirty if it has had a
+ *              shared writable mapping since the last call. Stores through
+ *              such a mapping reach the blocks without the filesystem
+ *              seeing them, so while it lasts each save writes the whole
+ *              file. Called with the inode locked, or at evict.
+ * Inputs:
+ *   - inode: The file.
+ * Returns:
+ *   - None.
+ */
+void osfs_mmap_mark_dirty(struct inode *inode)
+{
+    struct osfs_sb_info *sb_info = inode->i_sb->s_fs_info;
+    const struct osfs_extent *extent;
+    uint32_t lblk = 0, next;
+    uint64_t end;
+
+    if (!test_and_clear_bit(OSFS_I_MMAP_WRITE, &OSFS_I(inode)->i_state))
+        return;
+    // Cleared first, so a mapping set up meanwhile sets it again in ->mmap
+    if (mapping_writably_mapped(inode->i_mapping))
+        set_bit(OSFS_I_MMAP_WRITE, &OSFS_I(inode)->i_state);
+
+    for (;;) {
+        extent = osfs_lookup_extent(inode, lblk, NULL, &next);
+        if (IS_ERR(extent))
+            break;
+        if (!extent) {
+            if (next == U32_MAX)
+                break;
+            lblk = next;
+            continue;
+        }
+        osfs_mark_dirty(sb_info, extent->start_block, extent->block_count);
+        end = (uint64_t)extent->file_block + extent->block_count;
+        if (end >= U32_MAX)
+            break;
+        lblk = end;
+    }
+}
+
+/**
+ * Function: osfs_copy_file_range
+ * Description: Copies a range between two osfs files. The source extents
+ *              are fed to osfs_do_write as a kernel iterator, so the data
+ *              moves with one memcpy per contiguous source segment and
+ *              never passes through user space.
+ * Inputs:
+ *   - file_in: The source file.
+ *   - pos_in: Position in the source file.
+ *   - file_out: The destination file.
+ *   - pos_out: Position in the destination file.
+ *   - len: Number of bytes to copy.
+ *   - flags: Unused, must be zero.
+ * Returns:
+ *   - The number of bytes copied on success.
+ *   - -EXDEV if the files are on different osfs mounts.
+ *   - A negative error code from osfs_delalloc_flush or osfs_do_write on
+ *     failure.
+ */
+static ssize_t osfs_copy_file_range(struct file *file_in, loff_t pos_in,
+                                    struct file *file_out, loff_t pos_out,
+                                    size_t len, unsigned int flags)
+{
+    struct inode *inode_in = file_inode(file_in);
+    struct inode *inode_out = file_inode(file_out);
+    struct osfs_extent_cursor cursor_in, cursor_out;
+    char inline_data[OSFS_INLINE_MAX];
+    ssize_t copied = 0;
+    loff_t isize;
+
+    if (inode_in->i_sb != inode_out->i_sb)
+        return -EXDEV;
+
+    // Both files stay locked while the kvecs point into the source blocks
+    if (inode_in == inode_out)
+        inode_lock(inode_out);
+    else
+        lock_two_nondirectories(inode_in, inode_out);
+    // Within one file, a write that places the pending blocks would free
+    // the pages the kvecs point into; place them first, and the blocks
+    // stay put while the file is locked
+    if (inode_in == inode_out) {
+        copied = osfs_delalloc_flush(inode_in, false);
+        if (copied) {
+            inode_unlock(inode_out);
+            return copied;
+        }
+    }
+    osfs_cursor_load(file_in, &cursor_in);
+    osfs_cursor_load(file_out, &cursor_out);
+
+    isize = i_size_read(inode_in);
+    len = pos_in < isize ? min_t(loff_t, len, isize - pos_in) : 0;
+
+    while (len > 0) {
+        struct osfs_cluster *cluster = NULL;
+        struct kiocb kiocb;
+        struct iov_iter iter;
+        struct kvec kvec;
+        ssize_t ret;
+
+        ret = -ENODATA;
+        if (osfs_has_inline_data(inode_in->i_private))
+            ret = osfs_inline_get(inode_in, pos_in, inline_data, len);
+        if (ret == 0)
+            break;
+        if (ret > 0) {
+            kvec.iov_base = inline_data;
+            kvec.iov_len = ret;
+        } else {
+            // A compressed source is copied from its decompressed clusters
+            kvec.iov_base = ERR_PTR(-ENODATA);
+            if (osfs_is_compressed(inode_in->i_private))
+                kvec.iov_base = osfs_compress_map(inode_in, pos_in, &cluster, &kvec.iov_len);
+            if (kvec.iov_base == ERR_PTR(-ENODATA))
+                kvec.iov_base = osfs_map_pos(inode_in, pos_in, &cursor_in, &kvec.iov_len);
+        }
+        if (IS_ERR(kvec.iov_base)) {
+            if (!copied)
+                copied = PTR_ERR(kvec.iov_base);
+            break;
+        }
+        if (!kvec.iov_base) {
+            // Holes are copied from the shared zero page
+            kvec.iov_base = page_address(ZERO_PAGE(0));
+            kvec.iov_len = min_t(size_t, kvec.iov_len, PAGE_SIZE);
+        }
+        kvec.iov_len = min(kvec.iov_len, len);
+
+        init_sync_kiocb(&kiocb, file_out);
+        kiocb.ki_pos = pos_out;
+        iov_iter_kvec(&iter, ITER_SOURCE, &kvec, 1, kvec.iov_len);
+
+        ret = osfs_do_write(&kiocb, &iter, &cursor_out);
+        osfs_cluster_put(cluster);
+        if (ret <= 0) {
+            if (!copied)
+                copied = ret;
+            break;
+        }
+
+        copied += ret;
+        pos_in += ret;
+        pos_out += ret;
+        len -= ret;
+        if ((size_t)ret < kvec.iov_len)
+            break;
+    }
+
+    osfs_cursor_store(file_out, &cursor_out);
+    osfs_cursor_store(file_in, &cursor_in);
+    if (inode_in == inode_out)
+        inode_unlock(inode_out);
+    else
+        unlock_two_nondirectories(inode_in, inode_out);
+    return copied;
+}
+
+/**
+ * Function: osfs_file_open
+ * Description: Opens a regular file and gives it an extent cursor. The I/O
+ *              paths never sleep waiting on other I/O and honour
+ *              IOCB_NOWAIT by trylocking i_rwsem and refusing writes that
+ *              need allocation, so RWF_NOWAIT and io_uring callers are
+ *              accepted.
+ * Inputs:
+ *   - inode: The inode of the file.
+ *   - filp: The file being opened.
+ * Returns:
+ *   - 0 on success, or the error from generic_file_open.
+ */
+static int osfs_file_open(struct inode *inode, struct file *filp)
+{
+    int ret;
+
+    ret = generic_file_open(inode, filp);
+    if (ret)
+        return ret;
+
+    // Each open file keeps its own extent lookup cursor
+    filp->private_data = kzalloc(sizeof(struct osfs_extent_cursor), GFP_KERNEL);
+    if (!filp->private_data)
+        return -ENOMEM;
+
+    filp->f_mode |= FMODE_NOWAIT;
+    return 0;
+}
+
+/**
+ * Function: osfs_file_release
+ * Description: Places the delayed blocks of a file, trims the unwritten
+ *              part of the append window and frees the extent cursor on
+ *              the last close of a file. The last writer to close a file
+ *              marked with chattr +c, or any file on a compress mount,
+ *              queues it for compression. If the delayed blocks cannot be
+ *              placed they stay pending, and the error is logged and
+ *              recorded on the mapping for the next fsync to report.
+ * Inputs:
+ *   - inode: The inode of the file.
+ *   - filp: The file being released.
+ * Returns:
+ *   - 0.
+ */
+static int osfs_file_release(struct inode *inode, struct file *filp)
+{
+    struct osfs_inode *osfs_inode = inode->i_private;
+    struct osfs_sb_info *sb_info = inode->i_sb->s_fs_info;
+    bool compress;
+    int ret;
+
+    inode_lock(inode);
+    // Place the delayed blocks now that the file size is known
+    if (filp->f_mode & FMODE_WRITE) {
+        ret = osfs_delalloc_flush(inode, false);
+        if (ret) {
+            pr_err("osfs: Could not place delayed blocks of inode %lu: %d\n",
+                   inode->i_ino, ret);
+            mapping_set_error(inode->i_mapping, ret);
+        }
+    }
+    if ((filp->f_mode & FMODE_WRITE) && osfs_inode->i_prealloc_start) {
+        uint32_t end = ((uint64_t)osfs_inode->i_size + sb_info->block_size - 1) >>
+                       sb_info->block_bits;
+
+        filemap_invalidate_lock(inode->i_mapping);
+        osfs_truncate_extents(inode, max(osfs_inode->i_prealloc_start, end));
+        filemap_invalidate_unlock(inode->i_mapping);
+        osfs_inode->i_prealloc_start = 0;
+    }
+    // A file nobody writes any more is cold; compress it if asked to
+    compress = (filp->f_mode & FMODE_WRITE) && atomic_read(&inode->i_writecount) == 1 &&
+               (sb_info->compress || (osfs_inode->i_flags & OSFS_COMPR_FL));
+    inode_unlock(inode);
+    if (compress)
+        osfs_compress_schedule(inode);
+
+    kfree(filp->private_data);
+    return 0;
+}
+
+/**
+ * Function: osfs_fallocate
+ * Description: Maps blocks for every hole in a range of a file. Free blocks
+ *              are kept zeroed, so the new blocks read back as zeros
+ *              without tracking them as unwritten.
+ * Inputs:
+ *   - file: The file to allocate space for.
+ *   - mode: 0, or FALLOC_FL_KEEP_SIZE to leave the file size unchanged.
+ *   - offset: The start of the range.
+ *   - len: The length of the range.
+ * Returns:
+ *   - 0 on success.
+ *   - -EOPNOTSUPP for any other mode.
+ *   - -EFBIG if the range ends beyond the largest file size.
+ *   - -ENOSPC if the filesystem runs out of blocks; the blocks mapped so
+ *     far are kept.
+ *   - -EIO if the file's extents are corrupted.
+ */
+static long osfs_fallocate(struct file *file, int mode, loff_t offset, loff_t len)
+{
+    struct inode *inode = file_inode(file);
+    struct osfs_inode *osfs_inode = inode->i_private;
+    struct osfs_sb_info *sb_info = inode->i_sb->s_fs_info;
+    loff_t end = offset + len;
+    uint32_t lblk, last_lblk;
+    int ret = 0;
+
+    if (mode & ~FALLOC_FL_KEEP_SIZE)
+        return -EOPNOTSUPP;
+
+    // osfs_inode 的 i_size 只有 32 位元
+    if (end > U32_MAX)
+        return -EFBIG;
+    if (!(mode & FALLOC_FL_KEEP_SIZE)) {
+        ret = inode_newsize_ok(inode, end);
+        if (ret)
+            return ret;
+    }
+
+    lblk = offset >> sb_info->block_bits;
+    last_lblk = (end - 1) >> sb_info->block_bits;
+
+    inode_lock(inode);
+
+    // Reserving space means real blocks, so inline data moves out first,
+    // a compressed file is expanded and delayed blocks are placed before
+    // the holes are filled
+    ret = osfs_inline_convert(inode);
+    if (!ret)
+        ret = osfs_compress_expand(inode);
+    if (!ret)
+        ret = osfs_delalloc_flush(inode, false);
+    if (ret) {
+        inode_unlock(inode);
+        return ret;
+    }
+    filemap_invalidate_lock(inode->i_mapping);
+
+    // Reserved blocks are kept on close; only what lies past them is still speculative
+    if (osfs_inode->i_prealloc_start && osfs_inode->i_prealloc_start <= last_lblk)
+        osfs_inode->i_prealloc_start = last_lblk + 1;
+
+    while (lblk <= last_lblk) {
+        const struct osfs_extent *current_extent;
+        struct osfs_extent new_extent;
+        uint32_t next_lblk;
+
+        current_extent = osfs_lookup_extent(inode, lblk, NULL, &next_lblk);
+        if (IS_ERR(current_extent)) {
+            ret = PTR_ERR(current_extent);
+            break;
+        }
+        if (current_extent) {
+            lblk = current_extent->file_block + current_extent->block_count;
+            continue;
+        }
+
+        ret = osfs_alloc_file_blocks(inode, lblk, min(last_lblk - lblk + 1, next_lblk - lblk),
+                                     &new_extent);
+        if (ret)
+            break;
+        lblk += new_extent.block_count;
+    }
+
+    if (!ret && !(mode & FALLOC_FL_KEEP_SIZE) && end > osfs_inode->i_size) {
+        osfs_inode->i_size = end;
+        inode->i_size = end;
+    }
+    filemap_invalidate_unlock(inode->i_mapping);
+    inode_set_ctime_current(inode);
+    mark_inode_dirty(inode);
+    inode_unlock(inode);
+    return ret;
+}
+
+/**
+ * Function: osfs_fsync
+ * Description: Places the delayed blocks of a file and flushes the CPU
+ *              cache over its blocks if it is a DAX file. Then, on a mount
+ *              with a backing image, saves the image, which commits one
+ *              journal transaction covering this file along with every
+ *              other change since the last save. Also reports an error an
+ *              earlier close recorded on the mapping.
+ * Inputs:
+ *   - file: The file to sync.
+ *   - start, end: The range to sync; the whole file is placed.
+ *   - datasync: Unused; the inode and its data are saved together.
+ * Returns:
+ *   - 0 on success.
+ *   - A negative error code from osfs_delalloc_flush,
+ *     osfs_dax_flush_file or osfs_image_save on failure, or the error
+ *     recorded on the mapping since this file last checked.
+ */
+static int osfs_fsync(struct file *file, loff_t start, loff_t end, int datasync)
+{
+    struct inode *inode = file_inode(file);
+    int ret, err;
+
+    inode_lock(inode);
+    ret = osfs_delalloc_flush(inode, false);
+    if (!ret && IS_DAX(inode))
+        ret = osfs_dax_flush_file(inode, start, end);
+    inode_unlock(inode);
+
+    // The save locks every cached inode in turn, this one included
+    if (!ret)
+        ret = osfs_image_save(inode->i_sb);
+
+    err = file_check_and_advance_wb_err(file);
+    return ret ? ret : err;
+}
+
+/**
+ * Function: osfs_file_ioctl
+ * Description: Dispatches the osfs-specific ioctls of a regular file.
+ * Inputs:
+ *   - filp: The file the ioctl is issued on.
+ *   - cmd: The ioctl number.
+ *   - arg: The ioctl argument.
+ * Returns:
+ *   - The result of the ioctl, or -ENOTTY for an unknown one.
+ */
+static long osfs_file_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    switch (cmd) {
+    case OSFS_IOC_DEFRAG:
+        return osfs_ioc_defrag(filp, (struct osfs_defrag_report __user *)arg);
+    default:
+        return -ENOTTY;
+    }
+}
+
 /**
  * Struct: osfs_file_operations
  * Description: Defines the file operations for regular files in osfs.
  */
 const struct file_operations osfs_file_operations = {
-    .open = generic_file_open, // Use generic open or implement osfs_open if needed
-    .read = osfs_read,
-    .write = osfs_write,
+    .open = osfs_file_open,
+    .release = osfs_file_release,
+    .read_iter = osfs_read_iter,
+    .write_iter = osfs_write_iter,
+    .mmap = osfs_file_mmap,
+    // Data pages in a pipe would outlive a free or reuse of their blocks, so
+    // splice copies through read_iter
+    .splice_read = copy_splice_read,
+    .splice_write = iter_file_splice_write,
+    .copy_file_range = osfs_copy_file_range,
+    .fallocate = osfs_fallocate,
+    .fsync = osfs_fsync,
+    .unlocked_ioctl = osfs_file_ioctl,
+    .compat_ioctl = compat_ptr_ioctl,
     .llseek = default_llseek,
     // Add other operations as needed
 };
@@ -234,4 +970,6 @@ const struct file_operations osfs_file_operations = {
  */
 const struct inode_operations osfs_file_inode_operations = {
     // Add inode operations here, e.g., .getattr = osfs_getattr,
+    .fileattr_get = osfs_fileattr_get,
+    .fileattr_set = osfs_fileattr_set,
 };
\ No newline at end of file
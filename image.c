@@ -0,0 +1,905 @@
+#include <linux/fs.h>
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/buffer_head.h>
+#include <linux/dax.h>
+#include <linux/highmem.h>
+#include <linux/vmalloc.h>
+#include "osfs.h"
+
+/*
+ * Backing image.
+ *
+ * The filesystem can be kept in an image as well as in memory: with
+ * image=PATH in a regular file or a block device opened as a file, or,
+ * when mounted from a block device, on that device itself. The image is a
+ * header followed by the journal, the inode bitmap, the inode table, the
+ * block bitmap and the data area, each at an OSFS_IMAGE_ALIGN-aligned
+ * offset. Data
+ * block N lives at data_off + N * block_size, so each extent is
+ * contiguous in the image and is moved as one transfer; only allocated
+ * blocks are written or read.
+ *
+ * An image file is read and written through kernel_read/kernel_write.
+ * On a mounted device the header and metadata go through buffer heads
+ * and the data through bios built straight from the chunk pages, one
+ * chain of bios per run of allocated blocks.
+ *
+ * The image is saved by sync(2), syncfs(2), fsfreeze and unmount, all of
+ * which reach ->sync_fs. A save first copies the attributes of cached
+ * inodes into the table and places delayed blocks, then drains the CPU
+ * pools so the bitmaps are exact. It copies the regions and whatever
+ * metadata it will write under block_lock and then writes without the
+ * lock, so allocation goes on meanwhile; blocks freed until it is done
+ * stay allocated, so the data it writes from the chunks cannot be zeroed
+ * or handed to another file under it. Once the image matches memory, after a
+ * load or a full save, saves go through the metadata journal in journal.c
+ * and a crash at any point leaves a mountable image. A full save writes
+ * the header with state 0 before the regions and with OSFS_IMAGE_CLEAN
+ * after them, so an image whose full save was cut short is refused at
+ * mount instead of being loaded half old and half new. A DAX mount keeps
+ * its header at state 0 until unmount, see dax.c. Files being written
+ * while a sync runs may be caught mid-write; unmount and fsfreeze save a
+ * quiescent filesystem.
+ *
+ * At mount the geometry comes from the header. mkfs.osfs writes a header
+ * in state OSFS_IMAGE_NEW, which only carries the geometry; the
+ * filesystem then starts empty. A clean image has its journal replayed
+ * and is read back before the root is looked up. The summaries, chunk usage and free counts are
+ * derived from the bitmaps rather than saved.
+ */
+
+/**
+ * Function: osfs_image_rw
+ * Description: Reads or writes a byte range of the image. Written blocks
+ *              of a device are only dirtied; osfs_image_flush writes them.
+ * Inputs:
+ *   - sb: The superblock, whose device holds the image if image is NULL.
+ *   - image: The image file, or NULL on a mounted device.
+ *   - buf: The buffer, which may be vmalloc memory.
+ *   - len: The number of bytes to transfer.
+ *   - pos: The position in the image.
+ *   - write: Write the buffer instead of reading into it.
+ * Returns:
+ *   - 0 on success.
+ *   - -EIO if the image ends early or a block cannot be read.
+ *   - A negative error code from the read or write.
+ */
+int osfs_image_rw(struct super_block *sb, struct file *image,
+                  void *buf, size_t len, loff_t pos, bool write)
+{
+    while (len) {
+        ssize_t n;
+
+        if (image) {
+            if (write)
+                n = kernel_write(image, buf, len, &pos);
+            else
+                n = kernel_read(image, buf, len, &pos);
+            if (n < 0)
+                return n;
+            if (n == 0)
+                return -EIO;
+        } else {
+            sector_t blk = pos >> sb->s_blocksize_bits;
+            size_t off = pos & (sb->s_blocksize - 1);
+            struct buffer_head *bh;
+
+            n = min_t(size_t, len, sb->s_blocksize - off);
+            // A block that is overwritten whole need not be read first
+            if (write && n == sb->s_blocksize)
+                bh = sb_getblk(sb, blk);
+            else
+                bh = sb_bread(sb, blk);
+            if (!bh)
+                return -EIO;
+
+            if (write) {
+                lock_buffer(bh);
+                memcpy(bh->b_data + off, buf, n);
+                set_buffer_uptodate(bh);
+                unlock_buffer(bh);
+                mark_buffer_dirty(bh);
+            } else {
+                memcpy(buf, bh->b_data + off, n);
+            }
+            brelse(bh);
+            pos += n;
+        }
+        buf = (char *)buf + n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * Function: osfs_image_flush
+ * Description: Makes everything written to the image so far stable.
+ * Inputs:
+ *   - sb: The superblock, whose device holds the image if image is NULL.
+ *   - image: The image file, or NULL on a mounted device.
+ * Returns:
+ *   - 0 on success.
+ *   - A negative error code from writeback or the cache flush.
+ */
+int osfs_image_flush(struct super_block *sb, struct file *image)
+{
+    int ret;
+
+    if (image)
+        return vfs_fsync(image, 0);
+
+    ret = sync_blockdev(sb->s_bdev);
+    if (!ret)
+        ret = blkdev_issue_flush(sb->s_bdev);
+    return ret;
+}
+
+/**
+ * Function: osfs_image_bio_add
+ * Description: Queues a transfer between vmalloc memory and the mounted
+ *              device, extending the last bio of a chain while the range
+ *              continues it and chaining a new one otherwise.
+ * Inputs:
+ *   - sb: The superblock of the mounted device.
+ *   - bio: The last bio of the chain, or NULL to start one.
+ *   - buf: The vmalloc buffer, aligned to the block size.
+ *   - len: The number of bytes, a multiple of the block size.
+ *   - pos: The position on the device.
+ *   - write: Write the buffer instead of reading into it.
+ * Returns:
+ *   - The last bio of the chain, not yet submitted.
+ */
+struct bio *osfs_image_bio_add(struct super_block *sb, struct bio *bio,
+                               void *buf, size_t len, loff_t pos, bool write)
+{
+    blk_opf_t opf = write ? REQ_OP_WRITE : REQ_OP_READ;
+
+    if (write)
+        flush_kernel_vmap_range(buf, len);
+    while (len) {
+        struct page *page = vmalloc_to_page(buf);
+        unsigned int off = offset_in_page(buf);
+        unsigned int n = min_t(size_t, len, PAGE_SIZE - off);
+
+        if (!bio || bio_end_sector(bio) != pos >> SECTOR_SHIFT ||
+            bio_add_page(bio, page, n, off) != n) {
+            // The previous bio is submitted and completes into the new one
+            bio = blk_next_bio(bio, sb->s_bdev, BIO_MAX_VECS, opf, GFP_KERNEL);
+            bio->bi_iter.bi_sector = pos >> SECTOR_SHIFT;
+            __bio_add_page(bio, page, n, off);
+        }
+        buf = (char *)buf + n;
+        len -= n;
+        pos += n;
+    }
+    return bio;
+}
+
+/**
+ * Function: osfs_image_data
+ * Description: Transfers data blocks between the chunks and the image,
+ *              one run of blocks at a time. The chunks holding them must
+ *              exist.
+ * Inputs:
+ *   - sb: The superblock of the filesystem.
+ *   - image: The image file, or NULL on a mounted device.
+ *   - hdr: The layout of the image.
+ *   - map: The blocks to transfer, a subset of the allocated ones.
+ *   - write: Save the blocks instead of loading them.
+ * Returns:
+ *   - 0 on success.
+ *   - A negative error code from the transfers.
+ */
+int osfs_image_data(struct super_block *sb, struct file *image,
+                    const struct osfs_image_header *hdr, const unsigned long *map, bool write)
+{
+    struct osfs_sb_info *sb_info = sb->s_fs_info;
+    uint32_t start = 0, end, chunk;
+    struct bio *bio = NULL;
+    int ret = 0;
+
+    while (!ret) {
+        start = find_next_bit(map, sb_info->block_count, start);
+        if (start >= sb_info->block_count)
+            break;
+        end = find_next_zero_bit(map, sb_info->block_count, start);
+
+        // The run is contiguous in the image but may span chunks in memory
+        while (start < end) {
+            uint32_t n = min(end - start, osfs_chunk_blocks_left(sb_info, start));
+            void *addr = osfs_block_addr(sb_info, start);
+            size_t bytes = (size_t)n << sb_info->block_bits;
+            loff_t pos = hdr->data_off + ((loff_t)start << sb_info->block_bits);
+
+            if (sb_info->dax_dev) {
+                // The blocks are on the device already; only the CPU cache may hold them
+                if (write)
+                    dax_flush(sb_info->dax_dev, addr, bytes);
+            } else if (image) {
+                ret = osfs_image_rw(sb, image, addr, bytes, pos, write);
+            } else {
+                bio = osfs_image_bio_add(sb, bio, addr, bytes, pos, write);
+            }
+            if (ret)
+                break;
+            start += n;
+        }
+    }
+
+    if (bio) {
+        int err = submit_bio_wait(bio);
+
+        bio_put(bio);
+        if (!ret)
+            ret = err;
+        if (!write)
+            for (chunk = 0; chunk < sb_info->chunk_count; chunk++)
+                if (sb_info->chunks[chunk])
+                    invalidate_kernel_vmap_range(sb_info->chunks[chunk],
+                                                 osfs_chunk_bytes(sb_info, chunk));
+    }
+    return ret;
+}
+
+/**
+ * Function: osfs_image_regions
+ * Description: Copies the inode bitmap, inode table and block bitmap into
+ *              a buffer laid out as the image is from inode_bitmap_off.
+ *              The padding between them is left as it is.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - hdr: The layout of the image.
+ *   - buf: The buffer, hdr->data_off - hdr->inode_bitmap_off bytes long.
+ * Returns:
+ *   - None.
+ */
+void osfs_image_regions(struct osfs_sb_info *sb_info, const struct osfs_image_header *hdr,
+                        void *buf)
+{
+    char *regions = buf;
+
+    memcpy(regions, sb_info->inode_bitmap,
+           BITMAP_SIZE(sb_info->inode_count) * sizeof(unsigned long));
+    memcpy(regions + (hdr->inode_table_off - hdr->inode_bitmap_off), sb_info->inode_table,
+           (size_t)sb_info->inode_count * sizeof(struct osfs_inode));
+    memcpy(regions + (hdr->block_bitmap_off - hdr->inode_bitmap_off), sb_info->block_bitmap,
+           BITMAP_SIZE(sb_info->block_count) * sizeof(unsigned long));
+}
+
+/**
+ * Function: osfs_image_layout
+ * Description: Fills in the region offsets of an image header from the
+ *              geometry already in it. The journal comes first and holds a
+ *              rewrite of every region plus room for directory and tree
+ *              blocks in proportion to the data area.
+ * Inputs:
+ *   - hdr: The header; block_size, inode_count and block_count are set.
+ * Returns:
+ *   - None.
+ */
+static void osfs_image_layout(struct osfs_image_header *hdr)
+{
+    uint64_t inode_bitmap_len = ALIGN((uint64_t)BITMAP_SIZE(hdr->inode_count) *
+                                      sizeof(unsigned long), OSFS_IMAGE_ALIGN);
+    uint64_t inode_table_len = ALIGN((uint64_t)hdr->inode_count * sizeof(struct osfs_inode),
+                                     OSFS_IMAGE_ALIGN);
+    uint64_t block_bitmap_len = ALIGN((uint64_t)BITMAP_SIZE(hdr->block_count) *
+                                      sizeof(unsigned long), OSFS_IMAGE_ALIGN);
+    uint64_t extra = clamp_t(uint64_t, ((uint64_t)hdr->block_count * hdr->block_size) >> 6,
+                             OSFS_JOURNAL_MIN_EXTRA, OSFS_JOURNAL_MAX_EXTRA);
+    uint64_t pieces = (inode_bitmap_len + inode_table_len + block_bitmap_len + extra) /
+                      OSFS_IMAGE_ALIGN;
+
+    hdr->inode_size = sizeof(struct osfs_inode);
+    hdr->long_size = sizeof(unsigned long);
+    hdr->journal_off = OSFS_IMAGE_ALIGN;
+    // One descriptor per OSFS_JOURNAL_TAGS blocks, and the commit block
+    hdr->journal_len = (pieces + DIV_ROUND_UP(pieces, OSFS_JOURNAL_TAGS) + 1) * OSFS_IMAGE_ALIGN;
+    hdr->inode_bitmap_off = hdr->journal_off + hdr->journal_len;
+    hdr->inode_table_off = hdr->inode_bitmap_off + inode_bitmap_len;
+    hdr->block_bitmap_off = hdr->inode_table_off + inode_table_len;
+    hdr->data_off = hdr->block_bitmap_off + block_bitmap_len;
+}
+
+/**
+ * Function: osfs_image_header_init
+ * Description: Fills in the header describing the image of a filesystem.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - hdr: The header to fill in; state is left 0 and journal_seq is the
+ *          last transaction.
+ * Returns:
+ *   - None.
+ */
+static void osfs_image_header_init(struct osfs_sb_info *sb_info, struct osfs_image_header *hdr)
+{
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->magic = OSFS_IMAGE_MAGIC;
+    hdr->version = OSFS_IMAGE_VERSION;
+    hdr->block_size = sb_info->block_size;
+    hdr->inode_count = sb_info->inode_count;
+    hdr->block_count = sb_info->block_count;
+    hdr->journal_seq = sb_info->journal_seq;
+    osfs_image_layout(hdr);
+}
+
+/**
+ * Function: osfs_image_fit
+ * Description: Sets block_count in a header to the most blocks whose
+ *              image fits in a given size.
+ * Inputs:
+ *   - hdr: The header; block_size and inode_count are set.
+ *   - size: The size of the device or file in bytes.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOSPC if not even one block fits.
+ */
+static int osfs_image_fit(struct osfs_image_header *hdr, uint64_t size)
+{
+    uint32_t block_bits = ilog2(hdr->block_size);
+    uint64_t end;
+
+    hdr->block_count = 0;
+    osfs_image_layout(hdr);
+    if (size <= hdr->data_off)
+        return -ENOSPC;
+    hdr->block_count = min_t(uint64_t, (size - hdr->data_off) >> block_bits, U32_MAX);
+
+    // The block bitmap grows with the count; give back what it takes
+    for (;;) {
+        osfs_image_layout(hdr);
+        end = hdr->data_off + ((uint64_t)hdr->block_count << block_bits);
+        if (end <= size)
+            break;
+        hdr->block_count -= min_t(uint64_t, hdr->block_count,
+                                  DIV_ROUND_UP(end - size, hdr->block_size));
+    }
+    return hdr->block_count ? 0 : -ENOSPC;
+}
+
+/**
+ * Function: osfs_image_probe
+ * Description: Reads the header of an image and takes the geometry of the
+ *              mount from it.
+ * Inputs:
+ *   - sb: The superblock, whose device holds the image if image is NULL.
+ *   - image: The image file, or NULL on a mounted device.
+ *   - name: The name of the image for messages.
+ *   - size: The size of the image file or device in bytes.
+ *   - opts: The mount options, whose geometry is replaced.
+ *   - loaded: Set to true if the image holds a saved filesystem.
+ * Returns:
+ *   - 1 if the image is blank, so the mount options stand.
+ *   - 0 if the geometry was taken from the image.
+ *   - -EINVAL if it is not a compatible image.
+ *   - -EUCLEAN if its last save did not complete.
+ *   - -ENOSPC if a new image leaves no room for data blocks.
+ *   - A negative error code from reading the header.
+ */
+static int osfs_image_probe(struct super_block *sb, struct file *image, const char *name,
+                            uint64_t size, struct osfs_mount_opts *opts, bool *loaded)
+{
+    struct osfs_image_header hdr;
+    int ret;
+
+    *loaded = false;
+    if (!size)
+        return 1;
+    ret = osfs_image_rw(sb, image, &hdr, sizeof(hdr), 0, false);
+    if (ret)
+        return ret;
+
+    if (hdr.magic != OSFS_IMAGE_MAGIC) {
+        // A zeroed file has not been saved to yet
+        if (!memchr_inv(&hdr, 0, sizeof(hdr)))
+            return 1;
+        pr_err("osfs: %s is not an osfs image\n", name);
+        return -EINVAL;
+    }
+    if (hdr.version != OSFS_IMAGE_VERSION ||
+        (hdr.state != OSFS_IMAGE_NEW && (hdr.inode_size != sizeof(struct osfs_inode) ||
+                                         hdr.long_size != sizeof(unsigned long)))) {
+        pr_err("osfs: %s was saved in an incompatible format\n", name);
+        return -EINVAL;
+    }
+
+    switch (hdr.state) {
+    case OSFS_IMAGE_NEW:
+        // mkfs.osfs leaves block_count 0 to fill the device
+        if (!is_power_of_2(hdr.block_size) || hdr.block_size < OSFS_MIN_BLOCK_SIZE) {
+            pr_err("osfs: %s has a bad block size %u\n", name, hdr.block_size);
+            return -EINVAL;
+        }
+        if (!hdr.block_count) {
+            ret = osfs_image_fit(&hdr, size);
+            if (ret) {
+                pr_err("osfs: %s is too small\n", name);
+                return ret;
+            }
+        }
+        break;
+    case OSFS_IMAGE_CLEAN:
+        *loaded = true;
+        break;
+    default:
+        pr_err("osfs: %s was not completely saved\n", name);
+        return -EUCLEAN;
+    }
+
+    opts->block_size = hdr.block_size;
+    opts->size = (uint64_t)hdr.block_count * hdr.block_size;
+    opts->inode_count = hdr.inode_count;
+    return 0;
+}
+
+/**
+ * Function: osfs_image_open
+ * Description: Opens the image file named by the image= option, creating
+ *              it if needed, and takes the geometry from its header unless
+ *              it is blank.
+ * Inputs:
+ *   - opts: The mount options; opts->image names the image.
+ *   - loaded: Set to true if the image holds a saved filesystem.
+ * Returns:
+ *   - The open image on success.
+ *   - ERR_PTR(-EINVAL) if it is neither a file nor a block device.
+ *   - An ERR_PTR from opening the file or from osfs_image_probe.
+ */
+struct file *osfs_image_open(struct osfs_mount_opts *opts, bool *loaded)
+{
+    struct file *image;
+    umode_t mode;
+    int ret;
+
+    image = filp_open(opts->image, O_RDWR | O_CREAT | O_LARGEFILE, 0600);
+    if (IS_ERR(image))
+        return image;
+
+    mode = file_inode(image)->i_mode;
+    if (!S_ISREG(mode) && !S_ISBLK(mode)) {
+        ret = -EINVAL;
+        goto out_close;
+    }
+    ret = osfs_image_probe(NULL, image, opts->image, i_size_read(image->f_mapping->host),
+                           opts, loaded);
+    if (ret < 0)
+        goto out_close;
+    return image;
+
+out_close:
+    filp_close(image, NULL);
+    return ERR_PTR(ret);
+}
+
+/**
+ * Function: osfs_image_probe_bdev
+ * Description: Takes the geometry of a mount from the device it is
+ *              mounted from, which mkfs.osfs must have formatted.
+ * Inputs:
+ *   - sb: The superblock of the mounted device.
+ *   - opts: The mount options, whose geometry is replaced.
+ *   - loaded: Set to true if the device holds a saved filesystem.
+ * Returns:
+ *   - 0 on success.
+ *   - -EINVAL if the device is not formatted or its block size is
+ *     smaller than the device's.
+ *   - A negative error code from osfs_image_probe.
+ */
+int osfs_image_probe_bdev(struct super_block *sb, struct osfs_mount_opts *opts, bool *loaded)
+{
+    int ret;
+
+    if (!sb_min_blocksize(sb, OSFS_MIN_BLOCK_SIZE))
+        return -EINVAL;
+    ret = osfs_image_probe(sb, NULL, sb->s_id, bdev_nr_bytes(sb->s_bdev), opts, loaded);
+    if (ret > 0) {
+        pr_err("osfs: %s is not formatted, run mkfs.osfs on it\n", sb->s_id);
+        return -EINVAL;
+    }
+    if (ret)
+        return ret;
+    if (!sb_set_blocksize(sb, opts->block_size)) {
+        pr_err("osfs: Block size %u does not suit %s\n", opts->block_size, sb->s_id);
+        return -EINVAL;
+    }
+    return 0;
+}
+
+/**
+ * Function: osfs_image_check_inode
+ * Description: Checks the fields of an in-use inode loaded from an image
+ *              and, unless its data is inline, its extent tree.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - ino: The inode number.
+ *   - seen: Bitmap over the data blocks of the inodes checked so far.
+ * Returns:
+ *   - true if the inode can be trusted.
+ */
+static bool osfs_image_check_inode(struct osfs_sb_info *sb_info, uint32_t ino,
+                                   unsigned long *seen)
+{
+    struct osfs_inode *osfs_inode = &((struct osfs_inode *)sb_info->inode_table)[ino];
+    uint32_t flags = osfs_inode->i_flags;
+
+    if (osfs_inode->i_ino != ino ||
+        (!S_ISREG(osfs_inode->i_mode) && !S_ISDIR(osfs_inode->i_mode)) ||
+        (ino == ROOT_INODE && !S_ISDIR(osfs_inode->i_mode)) ||
+        (flags & ~(OSFS_INLINE_DATA_FL | OSFS_COMPR_FL | OSFS_COMPRESSED_FL)))
+        return false;
+
+    // Only regular files are inline or compressed, and never both
+    if (flags & (OSFS_INLINE_DATA_FL | OSFS_COMPRESSED_FL)) {
+        if (!S_ISREG(osfs_inode->i_mode) ||
+            (flags & OSFS_INLINE_DATA_FL && flags & OSFS_COMPRESSED_FL))
+            return false;
+    }
+    if (flags & OSFS_INLINE_DATA_FL)
+        return osfs_inode->i_size <= OSFS_INLINE_MAX;
+    return !osfs_ext_check(sb_info, osfs_inode, seen);
+}
+
+/**
+ * Function: osfs_image_check
+ * Description: Checks what was loaded from an image before anything
+ *              trusts it. The reserved inode numbers and the padding past
+ *              the last inode and block are forced in use, as at a fresh
+ *              mount, so the allocators never hand them out. Every in-use
+ *              inode is then checked, which also catches two files sharing
+ *              a block and files using blocks the bitmap calls free.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ * Returns:
+ *   - 0 on success.
+ *   - -EUCLEAN if an inode or extent tree is corrupted.
+ *   - -ENOMEM if memory allocation fails.
+ */
+static int osfs_image_check(struct osfs_sb_info *sb_info)
+{
+    size_t inode_bits = BITMAP_SIZE(sb_info->inode_count) * BITS_PER_LONG;
+    size_t block_bits = BITMAP_SIZE(sb_info->block_count) * BITS_PER_LONG;
+    unsigned long *seen;
+    uint32_t ino;
+    int ret = 0;
+
+    set_bit(0, sb_info->inode_bitmap);
+    set_bit(ROOT_INODE, sb_info->inode_bitmap);
+    bitmap_set(sb_info->inode_bitmap, sb_info->inode_count, inode_bits - sb_info->inode_count);
+    bitmap_set(sb_info->block_bitmap, sb_info->block_count, block_bits - sb_info->block_count);
+
+    seen = kvcalloc(BITMAP_SIZE(sb_info->block_count), sizeof(unsigned long), GFP_KERNEL);
+    if (!seen)
+        return -ENOMEM;
+
+    for (ino = ROOT_INODE; ino < sb_info->inode_count; ino++) {
+        ino = find_next_bit(sb_info->inode_bitmap, sb_info->inode_count, ino);
+        if (ino >= sb_info->inode_count)
+            break;
+        if (!osfs_image_check_inode(sb_info, ino, seen)) {
+            pr_err("osfs: Inode %u in the image is corrupted\n", ino);
+            ret = -EUCLEAN;
+            break;
+        }
+        cond_resched();
+    }
+
+    kvfree(seen);
+    return ret;
+}
+
+/**
+ * Function: osfs_image_attach
+ * Description: Checks that the image can hold the filesystem and, if it
+ *              holds a saved one, replays its journal and loads the
+ *              bitmaps, inode table and data blocks from it. Called at
+ *              mount once the metadata region is set up and sb->s_fs_info
+ *              points at it.
+ * Inputs:
+ *   - sb: The superblock of the filesystem.
+ *   - loaded: The image holds a saved filesystem.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOSPC if a block device is too small for the filesystem.
+ *   - -EINVAL if the saved layout does not match the geometry or the
+ *     journal is corrupted.
+ *   - -EUCLEAN if the loaded inodes or extent trees are corrupted.
+ *   - -ENOMEM if memory allocation fails.
+ *   - A negative error code from reading the image or replaying it.
+ */
+int osfs_image_attach(struct super_block *sb, bool loaded)
+{
+    struct osfs_sb_info *sb_info = sb->s_fs_info;
+    struct file *image = sb_info->image;
+    struct osfs_image_header hdr, saved;
+    uint32_t start, end, block, word;
+    uint64_t size = 0;
+    int ret;
+
+    osfs_image_header_init(sb_info, &hdr);
+
+    // An image file grows as it is written; a device does not
+    if (!image)
+        size = bdev_nr_bytes(sb->s_bdev);
+    else if (S_ISBLK(file_inode(image)->i_mode))
+        size = i_size_read(image->f_mapping->host);
+    if (size && size < hdr.data_off + ((uint64_t)sb_info->block_count << sb_info->block_bits)) {
+        pr_err("osfs: Block device is too small for the image\n");
+        return -ENOSPC;
+    }
+    if (sb_info->dax_dev) {
+        ret = osfs_dax_map(sb, hdr.data_off);
+        if (ret)
+            return ret;
+    }
+    if (!loaded)
+        return 0;
+
+    ret = osfs_image_rw(sb, image, &saved, sizeof(saved), 0, false);
+    if (ret)
+        return ret;
+    hdr.journal_seq = saved.journal_seq;
+    saved.state = 0;
+    if (memcmp(&saved, &hdr, sizeof(hdr))) {
+        pr_err("osfs: Image layout does not match its geometry\n");
+        return -EINVAL;
+    }
+
+    ret = osfs_journal_replay(sb, image, &hdr);
+    if (ret)
+        return ret;
+    sb_info->journal_seq = hdr.journal_seq;
+
+    ret = osfs_image_rw(sb, image, sb_info->inode_bitmap,
+                        BITMAP_SIZE(sb_info->inode_count) * sizeof(unsigned long),
+                        hdr.inode_bitmap_off, false);
+    if (!ret)
+        ret = osfs_image_rw(sb, image, sb_info->inode_table,
+                            (size_t)sb_info->inode_count * sizeof(struct osfs_inode),
+                            hdr.inode_table_off, false);
+    if (!ret)
+        ret = osfs_image_rw(sb, image, sb_info->block_bitmap,
+                            BITMAP_SIZE(sb_info->block_count) * sizeof(unsigned long),
+                            hdr.block_bitmap_off, false);
+    if (ret)
+        return ret;
+
+    // Populate the chunks holding allocated blocks, then fill them
+    for (start = 0; ; start = end) {
+        start = find_next_bit(sb_info->block_bitmap, sb_info->block_count, start);
+        if (start >= sb_info->block_count)
+            break;
+        end = find_next_zero_bit(sb_info->block_bitmap, sb_info->block_count, start);
+
+        for (block = start; block < end; ) {
+            uint32_t chunk = block >> sb_info->chunk_bits;
+            uint32_t n = min(end - block, osfs_chunk_blocks_left(sb_info, block));
+
+            if (!sb_info->chunks[chunk]) {
+                sb_info->chunks[chunk] = vzalloc(osfs_chunk_bytes(sb_info, chunk));
+                if (!sb_info->chunks[chunk])
+                    return -ENOMEM;
+            }
+            sb_info->chunk_used[chunk] += n;
+            block += n;
+        }
+    }
+    ret = osfs_image_data(sb, image, &hdr, sb_info->block_bitmap, false);
+    if (ret)
+        return ret;
+
+    // Tree nodes are data blocks, so this waits for the data
+    ret = osfs_image_check(sb_info);
+    if (ret)
+        return ret;
+
+    // Rebuild what is derived from the bitmaps
+    bitmap_zero(sb_info->inode_full_map, BITMAP_SIZE(sb_info->inode_count));
+    for (word = 0; word < BITMAP_SIZE(sb_info->inode_count); word++)
+        if (sb_info->inode_bitmap[word] == ~0UL)
+            set_bit(word, sb_info->inode_full_map);
+    for (word = 0; word < BITMAP_SIZE(sb_info->block_count); word++)
+        if (sb_info->block_bitmap[word] == ~0UL)
+            set_bit(word, sb_info->block_full_map);
+
+    sb_info->nr_free_blocks = sb_info->block_count -
+                              bitmap_weight(sb_info->block_bitmap, sb_info->block_count);
+    percpu_counter_set(&sb_info->free_blocks, sb_info->nr_free_blocks);
+    percpu_counter_set(&sb_info->free_inodes, sb_info->inode_count -
+                       bitmap_weight(sb_info->inode_bitmap, sb_info->inode_count));
+
+    // Memory matches the image, so the next save can be journaled; never on DAX
+    if (!sb_info->dax_dev)
+        osfs_journal_snapshot(sb_info, &hdr);
+
+    pr_info("osfs: Loaded image with %u inodes and %u of %u blocks in use\n",
+            sb_info->inode_count - (uint32_t)percpu_counter_sum(&sb_info->free_inodes),
+            sb_info->block_count - sb_info->nr_free_blocks, sb_info->block_count);
+    return 0;
+}
+
+/**
+ * Function: osfs_image_sync_inodes
+ * Description: Places the delayed blocks of every cached inode, copies
+ *              its attributes into the inode table and, if it has been
+ *              mapped shared and writable, marks its blocks dirty.
+ * Inputs:
+ *   - sb: The superblock of the filesystem.
+ * Returns:
+ *   - None.
+ */
+static void osfs_image_sync_inodes(struct super_block *sb)
+{
+    struct inode *inode, *toput = NULL;
+
+    spin_lock(&sb->s_inode_list_lock);
+    list_for_each_entry(inode, &sb->s_inodes, i_sb_list) {
+        spin_lock(&inode->i_lock);
+        if ((inode->i_state & I_NEW) || !inode->i_private) {
+            spin_unlock(&inode->i_lock);
+            continue;
+        }
+        spin_unlock(&inode->i_lock);
+        // Inodes already on their way out were synced by evict
+        if (!igrab(inode))
+            continue;
+        spin_unlock(&sb->s_inode_list_lock);
+
+        // The reference keeps the inode on the list while the lock is dropped
+        iput(toput);
+        toput = inode;
+
+        inode_lock(inode);
+        if (osfs_delalloc_flush(inode, false))
+            pr_err("osfs: Image misses unplaced data of inode %lu\n", inode->i_ino);
+        osfs_mmap_mark_dirty(inode);
+        osfs_sync_inode(inode);
+        inode_unlock(inode);
+
+        cond_resched();
+        spin_lock(&sb->s_inode_list_lock);
+    }
+    spin_unlock(&sb->s_inode_list_lock);
+    iput(toput);
+}
+
+/**
+ * Function: osfs_image_save_full
+ * Description: Writes a save prepared in full: the header marked
+ *              incomplete, every region, the structure blocks and the file
+ *              data, then the header marked clean. Runs without block_lock.
+ *              A mounted DAX image keeps changing under the header, so it is
+ *              marked clean only by the save at unmount.
+ * Inputs:
+ *   - sb: The superblock of the filesystem.
+ *   - image: The image file, or NULL on a mounted device.
+ *   - save: The save from osfs_journal_prepare.
+ * Returns:
+ *   - 0 on success.
+ *   - A negative error code from writing or flushing the image; the image
+ *     is then left marked incomplete.
+ */
+static int osfs_image_save_full(struct super_block *sb, struct file *image,
+                                struct osfs_save *save)
+{
+    struct osfs_sb_info *sb_info = sb->s_fs_info;
+    struct osfs_image_header *hdr = &save->hdr;
+    int ret;
+
+    // A transaction left in the journal by a failed save must not replay
+    hdr->journal_seq = ++sb_info->journal_seq;
+    ret = osfs_image_rw(sb, image, hdr, sizeof(*hdr), 0, true);
+    if (!ret)
+        ret = osfs_image_rw(sb, image, save->regions, hdr->data_off - hdr->inode_bitmap_off,
+                            hdr->inode_bitmap_off, true);
+    if (!ret && save->tx)
+        ret = osfs_journal_checkpoint(sb, image, hdr, save->tx, save->nblocks - 1);
+    if (!ret)
+        ret = osfs_image_data(sb, image, hdr, save->data, true);
+    if (ret)
+        goto out;
+
+    // The regions must be stable before the header vouches for them
+    ret = osfs_image_flush(sb, image);
+    if (ret || (sb_info->dax_dev && !sb_info->unmounting))
+        goto out;
+    hdr->state = OSFS_IMAGE_CLEAN;
+    ret = osfs_image_rw(sb, image, hdr, sizeof(*hdr), 0, true);
+    if (!ret)
+        ret = osfs_image_flush(sb, image);
+out:
+    // What was written is the new shadow, so the next save can be journaled
+    if (ret || sb_info->dax_dev)
+        osfs_journal_destroy(sb_info);
+    else
+        osfs_journal_adopt(sb_info, save);
+    return ret;
+}
+
+/**
+ * Function: osfs_image_save
+ * Description: Saves the filesystem to its image, through the journal when
+ *              the image matches the shadow and in full otherwise. What to
+ *              write is copied under block_lock and written without it;
+ *              blocks freed meanwhile stay allocated until the save ends.
+ * Inputs:
+ *   - sb: The superblock of the filesystem.
+ * Returns:
+ *   - 0 on success, or if there is no image.
+ *   - -ENOMEM if the copies cannot be allocated.
+ *   - A negative error code from writing or flushing the image.
+ */
+int osfs_image_save(struct super_block *sb)
+{
+    struct osfs_sb_info *sb_info = sb->s_fs_info;
+    struct file *image = sb_info->image;
+    struct osfs_save save = {};
+    int ret = -E2BIG;
+
+    if (!image && !sb->s_bdev)
+        return 0;
+
+    mutex_lock(&sb_info->image_lock);
+    osfs_image_sync_inodes(sb);
+    osfs_drain_inode_pools(sb_info);
+    osfs_drain_block_pools(sb_info);
+
+    osfs_image_header_init(sb_info, &save.hdr);
+    save.regions = vzalloc(save.hdr.data_off - save.hdr.inode_bitmap_off);
+    if (!save.regions) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    mutex_lock(&sb_info->block_lock);
+    osfs_image_regions(sb_info, &save.hdr, save.regions);
+    if (sb_info->journal_shadow)
+        ret = osfs_journal_prepare(sb_info, &save);
+    if (ret == -E2BIG || ret == -ENOMEM) {
+        save.full = true;
+        ret = osfs_journal_prepare(sb_info, &save);
+    }
+    sb_info->image_saving = !ret;
+    mutex_unlock(&sb_info->block_lock);
+    // The blocks written since the last save may be lost; write them all next time
+    if (ret)
+        osfs_journal_destroy(sb_info);
+
+    if (!ret && save.full)
+        ret = osfs_image_save_full(sb, image, &save);
+    else if (!ret)
+        ret = osfs_journal_commit(sb, image, &save);
+    osfs_release_deferred_blocks(sb_info);
+out:
+    osfs_journal_free_save(&save);
+    mutex_unlock(&sb_info->image_lock);
+
+    if (ret)
+        pr_err("osfs: Failed to save image: %d\n", ret);
+    return ret;
+}
+
+/**
+ * Function: osfs_image_mark_unclean
+ * Description: Marks the image incomplete for as long as it is mounted. A
+ *              DAX mount updates its blocks on the device between saves, so
+ *              after a crash the image must not be loaded as if it were
+ *              clean; the save at unmount marks it clean again.
+ * Inputs:
+ *   - sb: The superblock of the filesystem.
+ * Returns:
+ *   - 0 on success.
+ *   - A negative error code from writing or flushing the header.
+ */
+int osfs_image_mark_unclean(struct super_block *sb)
+{
+    struct osfs_sb_info *sb_info = sb->s_fs_info;
+    struct osfs_image_header hdr;
+    int ret;
+
+    osfs_image_header_init(sb_info, &hdr);
+    ret = osfs_image_rw(sb, sb_info->image, &hdr, sizeof(hdr), 0, true);
+    if (!ret)
+        ret = osfs_image_flush(sb, sb_info->image);
+    return ret;
+}
@@ -0,0 +1,151 @@
+#include <linux/fs.h>
+#include <linux/pagemap.h>
+#include "osfs.h"
+
+/*
+ * Inline data.
+ *
+ * A new regular file has no blocks. Its data lives in i_inline_data, the
+ * bytes of the inode that would otherwise hold the root of its extent
+ * tree, and OSFS_INLINE_DATA_FL is set. Past i_size the buffer is kept
+ * zeroed. The first write that reaches past OSFS_INLINE_MAX, and any
+ * fallocate or mmap, converts the file: the data moves to a real block
+ * and the root becomes an empty extent tree. A file never goes back to
+ * inline.
+ *
+ * Conversion may run from mmap, where i_rwsem cannot be taken, so the
+ * flag and the buffer are read and written under the mapping's
+ * invalidate_lock: shared to copy bytes in or out, exclusive to convert.
+ * Data is bounced through a small buffer on the stack, so no user copy
+ * or fault happens while the lock is held.
+ */
+
+/**
+ * Function: osfs_init_inline_data
+ * Description: Makes the root area of a new inode an empty inline buffer.
+ */
+void osfs_init_inline_data(struct osfs_inode *osfs_inode)
+{
+    memset(osfs_inode->i_inline_data, 0, OSFS_INLINE_MAX);
+    osfs_inode->i_flags |= OSFS_INLINE_DATA_FL;
+}
+
+/**
+ * Function: osfs_inline_get
+ * Description: Copies bytes out of the inline data of a file.
+ * Inputs:
+ *   - inode: The inode of the file.
+ *   - pos: The file position to copy from.
+ *   - buf: The destination, at least OSFS_INLINE_MAX bytes.
+ *   - len: The largest number of bytes to copy.
+ * Returns:
+ *   - The number of bytes copied, 0 at or past the end of the file.
+ *   - -ENODATA if the file does not keep its data inline.
+ */
+ssize_t osfs_inline_get(struct inode *inode, loff_t pos, void *buf, size_t len)
+{
+    struct osfs_inode *osfs_inode = inode->i_private;
+    ssize_t ret = -ENODATA;
+
+    filemap_invalidate_lock_shared(inode->i_mapping);
+    if (osfs_has_inline_data(osfs_inode)) {
+        ret = 0;
+        if (pos < osfs_inode->i_size) {
+            ret = min_t(size_t, len, osfs_inode->i_size - pos);
+            memcpy(buf, osfs_inode->i_inline_data + pos, ret);
+        }
+    }
+    filemap_invalidate_unlock_shared(inode->i_mapping);
+    return ret;
+}
+
+/**
+ * Function: osfs_inline_put
+ * Description: Copies bytes into the inline data of a file, growing it if
+ *              they end past its size. The caller holds i_rwsem
+ *              exclusively and has checked that pos + len fits in
+ *              OSFS_INLINE_MAX.
+ * Inputs:
+ *   - inode: The inode of the file.
+ *   - pos: The file position to copy to.
+ *   - buf: The bytes to copy.
+ *   - len: The number of bytes to copy.
+ * Returns:
+ *   - len on success.
+ *   - -ENODATA if the file does not keep its data inline.
+ */
+ssize_t osfs_inline_put(struct inode *inode, loff_t pos, const void *buf, size_t len)
+{
+    struct osfs_inode *osfs_inode = inode->i_private;
+    ssize_t ret = -ENODATA;
+
+    filemap_invalidate_lock_shared(inode->i_mapping);
+    if (osfs_has_inline_data(osfs_inode)) {
+        memcpy(osfs_inode->i_inline_data + pos, buf, len);
+        if (pos + len > osfs_inode->i_size) {
+            osfs_inode->i_size = pos + len;
+            i_size_write(inode, osfs_inode->i_size);
+        }
+        ret = len;
+    }
+    filemap_invalidate_unlock_shared(inode->i_mapping);
+    return ret;
+}
+
+/**
+ * Function: osfs_inline_convert
+ * Description: Moves the inline data of a file into a data block and gives
+ *              it an extent tree mapping that block. Does nothing for a file
+ *              that is not inline. Readers check the flag without the lock,
+ *              so the block is filled before the root is built over the
+ *              inline bytes, and the flag is cleared last.
+ * Inputs:
+ *   - inode: The inode of the file.
+ * Returns:
+ *   - 0 on success.
+ *   - A negative error code from the allocator or the tree; the file stays
+ *     inline.
+ */
+int osfs_inline_convert(struct inode *inode)
+{
+    struct osfs_inode *osfs_inode = inode->i_private;
+    struct osfs_sb_info *sb_info = inode->i_sb->s_fs_info;
+    struct osfs_extent extent;
+    uint32_t size;
+    int ret = 0;
+
+    filemap_invalidate_lock(inode->i_mapping);
+    if (!osfs_has_inline_data(osfs_inode))
+        goto out;
+
+    // An empty file needs no block; a block is never smaller than the buffer
+    size = osfs_inode->i_size;
+    if (size) {
+        ret = osfs_alloc_blocks(sb_info, U32_MAX, 1, &extent);
+        if (ret)
+            goto out;
+        memcpy(osfs_block_addr(sb_info, extent.start_block), osfs_inode->i_inline_data, size);
+        osfs_mark_dirty(sb_info, extent.start_block, 1);
+    }
+
+    // While the flag is set, lockless readers see a hole and never look at
+    // the root, and inline readers are shut out by the lock
+    osfs_init_extent_root(osfs_inode);
+    if (size) {
+        extent.file_block = 0;
+        // A single extent always fits in an empty root leaf
+        ret = osfs_insert_extent(inode, &extent);
+        if (WARN_ON_ONCE(ret)) {
+            memcpy(osfs_inode->i_inline_data, osfs_block_addr(sb_info, extent.start_block),
+                   OSFS_INLINE_MAX);
+            osfs_free_extent(sb_info, &extent);
+            goto out;
+        }
+    }
+    osfs_inode->i_ext_generation++;
+    // Pairs with the acquire in osfs_has_inline_data
+    smp_store_release(&osfs_inode->i_flags, osfs_inode->i_flags & ~OSFS_INLINE_DATA_FL);
+out:
+    filemap_invalidate_unlock(inode->i_mapping);
+    return ret;
+}
@@ -1,5 +1,7 @@
 #include <linux/fs.h>
 #include <linux/uaccess.h>
+#include <linux/percpu.h>
+#include <linux/bitmap.h>
 #include "osfs.h"
 
 /**
@@ -21,141 +23,276 @@ struct osfs_inode *osfs_get_osfs_inode(struct super_block *sb, uint32_t ino)
     return &((struct osfs_inode *)(sb_info->inode_table))[ino];
 }
 
+/*
+ * Inode number allocation.
+ *
+ * Each CPU keeps a pool of up to OSFS_POOL_INODES inode numbers it has
+ * already marked in inode_bitmap, so creates on different CPUs take only
+ * their own pool's lock and inode_lock is hit once per batch. Freed
+ * numbers go back to the local pool while it has room. The free_inodes
+ * percpu_counter counts every number not in use, pooled ones included.
+ *
+ * Refills search inode_bitmap a word at a time. inode_full_map has one
+ * bit per bitmap word, set while every inode in the word is in use, so
+ * the search skips BITS_PER_LONG full words per summary word. The search
+ * is next-fit: it resumes at inode_rotor, where the previous one stopped,
+ * and wraps to the start only when it reaches the end, so the cost of a
+ * refill does not grow with the number of live inodes below the rotor
+ * and freed low numbers are not reused ahead of the rest.
+ */
+
 /**
- * Function: osfs_get_free_inode
- * Description: Allocates a free inode number from the inode bitmap.
+ * Function: osfs_inode_bitmap_clear
+ * Description: Marks an inode number free in the inode bitmap. The caller
+ *              holds inode_lock.
  * Inputs:
  *   - sb_info: The superblock information of the filesystem.
+ *   - ino: The inode number to clear.
  * Returns:
- *   - The allocated inode number on success.
- *   - -ENOSPC if no free inode is available.
+ *   - None.
  */
-int osfs_get_free_inode(struct osfs_sb_info *sb_info)
+static void osfs_inode_bitmap_clear(struct osfs_sb_info *sb_info, uint32_t ino)
 {
-    uint32_t ino;
+    clear_bit(ino, sb_info->inode_bitmap);
+    clear_bit(ino / BITS_PER_LONG, sb_info->inode_full_map);
+}
+
+/**
+ * Function: osfs_refill_inode_pool
+ * Description: Moves a batch of free inode numbers from the inode bitmap
+ *              into an empty pool. The caller holds the pool's lock.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - pool: The pool to refill.
+ * Returns:
+ *   - None; the pool stays empty if the bitmap is full.
+ */
+static void osfs_refill_inode_pool(struct osfs_sb_info *sb_info,
+                                   struct osfs_inode_pool *pool)
+{
+    unsigned long nr_words = BITS_TO_LONGS(sb_info->inode_count);
+    uint32_t found[OSFS_POOL_INODES];
+    unsigned long ino, word;
+    bool wrapped = false;
+    uint32_t n = 0;
 
-    for (ino = 1; ino < sb_info->inode_count; ino++) {
-        if (!test_bit(ino, sb_info->inode_bitmap)) {
-            set_bit(ino, sb_info->inode_bitmap);
-            sb_info->nr_free_inodes--;
-            return ino;
+    spin_lock(&sb_info->inode_lock);
+    ino = sb_info->inode_rotor;
+    while (n < OSFS_POOL_INODES) {
+        // Skip words with no free inode using the summary level
+        word = find_next_zero_bit(sb_info->inode_full_map, nr_words, ino / BITS_PER_LONG);
+        if (word < nr_words)
+            ino = find_next_zero_bit(sb_info->inode_bitmap, sb_info->inode_count,
+                                     max(ino, word * BITS_PER_LONG));
+        if (word >= nr_words || ino >= sb_info->inode_count) {
+            if (wrapped)
+                break;
+            wrapped = true;
+            ino = 0;
+            continue;
         }
+
+        set_bit(ino, sb_info->inode_bitmap);
+        if (sb_info->inode_bitmap[ino / BITS_PER_LONG] == ~0UL)
+            set_bit(ino / BITS_PER_LONG, sb_info->inode_full_map);
+        found[n++] = ino++;
     }
-    pr_err("osfs_get_free_inode: No free inode available\n");
-    return -ENOSPC;
+    sb_info->inode_rotor = ino < sb_info->inode_count ? ino : 0;
+    spin_unlock(&sb_info->inode_lock);
+
+    // The pool pops from its end; store in reverse so low numbers go first
+    for (pool->nr = 0; pool->nr < n; pool->nr++)
+        pool->ino[pool->nr] = found[n - 1 - pool->nr];
 }
 
 /**
- * Function: osfs_iget
- * Description: Creates or retrieves a VFS inode from a given inode number.
+ * Function: osfs_pool_get_inode
+ * Description: Takes an inode number from the calling CPU's pool,
+ *              refilling it from the bitmap when it is empty.
  * Inputs:
- *   - sb: The superblock of the filesystem.
- *   - ino: The inode number to load.
+ *   - sb_info: The superblock information of the filesystem.
  * Returns:
- *   - A pointer to the VFS inode on success.
- *   - ERR_PTR(-EFAULT) if the osfs_inode cannot be retrieved.
- *   - ERR_PTR(-ENOMEM) if memory allocation for the inode fails.
+ *   - The inode number, or 0 if the pool and the bitmap are both empty.
  */
+static uint32_t osfs_pool_get_inode(struct osfs_sb_info *sb_info)
+{
+    struct osfs_inode_pool *pool = raw_cpu_ptr(sb_info->inode_pools);
+    uint32_t ino = 0;
+
+    spin_lock(&pool->lock);
+    if (!pool->nr)
+        osfs_refill_inode_pool(sb_info, pool);
+    if (pool->nr)
+        ino = pool->ino[--pool->nr];
+    spin_unlock(&pool->lock);
+    return ino;
+}
 
 /**
- * 新增：分配連續區塊的函數
+ * Function: osfs_drain_inode_pools
+ * Description: Returns the inode numbers held in every CPU's pool to the
+ *              bitmap, so a CPU that found the bitmap full can use them,
+ *              or so the bitmap is exact for a saved image.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ * Returns:
+ *   - true if any inode number was returned.
  */
-int osfs_alloc_extent(struct osfs_sb_info *sb_info, uint32_t needed_blocks, 
-                      struct osfs_extent *extent) 
+bool osfs_drain_inode_pools(struct osfs_sb_info *sb_info)
 {
-    uint32_t start = 0;
-    uint32_t count = 0;
-    uint32_t i;
-
-    // 先檢查是否有足夠的可用空間
-    if (needed_blocks > sb_info->nr_free_blocks) {
-        pr_err("osfs: Not enough free blocks. Needed: %u, Available: %u\n",
-               needed_blocks, sb_info->nr_free_blocks);
-        return -ENOSPC;
-    }
+    bool drained = false;
+    int cpu;
 
-    // 檢查請求的區塊數是否合理
-    if (needed_blocks == 0 || needed_blocks > sb_info->block_count) {
-        pr_err("osfs: Invalid number of blocks requested: %u\n", needed_blocks);
-        return -EINVAL;
-    }
+    for_each_possible_cpu(cpu) {
+        struct osfs_inode_pool *pool = per_cpu_ptr(sb_info->inode_pools, cpu);
 
-    // 尋找連續的空閒塊
-    for (i = 0; i < sb_info->block_count; i++) {
-        if (!test_bit(i, sb_info->block_bitmap)) {
-            if (count == 0) {
-                start = i;
-            }
-            count++;
-
-            // 找到足夠的連續塊
-            if (count == needed_blocks) {
-                // 再次確認這些區塊還是可用的
-                for (uint32_t j = start; j < start + count; j++) {
-                    if (test_bit(j, sb_info->block_bitmap)) {
-                        pr_err("osfs: Block %u became allocated during search\n", j);
-                        return -ENOSPC;
-                    }
-                }
-
-                // 設置 extent 資訊
-                extent->start_block = start;
-                extent->block_count = count;
-
-                // 標記為已使用
-                for (uint32_t j = start; j < start + count; j++) {
-                    set_bit(j, sb_info->block_bitmap);
-                }
-
-                // 更新可用區塊數
-                sb_info->nr_free_blocks -= count;
-
-                pr_debug("osfs: Allocated extent: start=%u, count=%u\n", 
-                        start, count);
-                return 0;
-            }
-        } else {
-            count = 0;  
+        spin_lock(&pool->lock);
+        if (pool->nr) {
+            spin_lock(&sb_info->inode_lock);
+            while (pool->nr)
+                osfs_inode_bitmap_clear(sb_info, pool->ino[--pool->nr]);
+            spin_unlock(&sb_info->inode_lock);
+            drained = true;
         }
+        spin_unlock(&pool->lock);
     }
+    return drained;
+}
+
+/**
+ * Function: osfs_get_free_inode
+ * Description: Allocates a free inode number.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ * Returns:
+ *   - The allocated inode number on success.
+ *   - -ENOSPC if no free inode is available.
+ */
+int osfs_get_free_inode(struct osfs_sb_info *sb_info)
+{
+    uint32_t ino;
 
-    pr_err("osfs: Could not find %u contiguous free blocks\n", needed_blocks);
-    return -ENOSPC;
+    ino = osfs_pool_get_inode(sb_info);
+    if (!ino && osfs_drain_inode_pools(sb_info))
+        ino = osfs_pool_get_inode(sb_info);
+    if (!ino) {
+        pr_err("osfs_get_free_inode: No free inode available\n");
+        return -ENOSPC;
+    }
+
+    percpu_counter_dec(&sb_info->free_inodes);
+    return ino;
 }
+
 /**
- * 新增：釋放連續數據塊的函數
+ * Function: osfs_put_free_inode
+ * Description: Releases an inode number, into the calling CPU's pool if
+ *              it has room and to the inode bitmap otherwise.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - ino: The inode number to release.
+ * Returns:
+ *   - None.
  */
-void osfs_free_extent(struct osfs_sb_info *sb_info, struct osfs_extent *extent)
+void osfs_put_free_inode(struct osfs_sb_info *sb_info, uint32_t ino)
 {
-    uint32_t i;
-    
-    for (i = extent->start_block; i < extent->start_block + extent->block_count; i++) {
-        clear_bit(i, sb_info->block_bitmap);
+    struct osfs_inode_pool *pool = raw_cpu_ptr(sb_info->inode_pools);
+
+    spin_lock(&pool->lock);
+    if (pool->nr < OSFS_POOL_INODES) {
+        pool->ino[pool->nr++] = ino;
+    } else {
+        spin_lock(&sb_info->inode_lock);
+        osfs_inode_bitmap_clear(sb_info, ino);
+        spin_unlock(&sb_info->inode_lock);
     }
-    sb_info->nr_free_blocks += extent->block_count;
+    spin_unlock(&pool->lock);
+
+    percpu_counter_inc(&sb_info->free_inodes);
+}
+
+/**
+ * Function: osfs_init_inode_pools
+ * Description: Allocates the empty per-CPU inode pools at mount.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOMEM if the per-CPU allocation fails.
+ */
+int osfs_init_inode_pools(struct osfs_sb_info *sb_info)
+{
+    int cpu;
+
+    sb_info->inode_pools = alloc_percpu(struct osfs_inode_pool);
+    if (!sb_info->inode_pools)
+        return -ENOMEM;
+
+    for_each_possible_cpu(cpu)
+        spin_lock_init(&per_cpu_ptr(sb_info->inode_pools, cpu)->lock);
+    return 0;
 }
 
+/**
+ * Function: osfs_destroy_inode_pools
+ * Description: Frees the per-CPU inode pools at unmount.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ * Returns:
+ *   - None.
+ */
+void osfs_destroy_inode_pools(struct osfs_sb_info *sb_info)
+{
+    free_percpu(sb_info->inode_pools);
+    sb_info->inode_pools = NULL;
+}
+
+/**
+ * Function: osfs_iget
+ * Description: Returns the VFS inode for an inode number, reading it from
+ *              the inode table only when it is not in the inode cache, so
+ *              there is never more than one VFS inode per osfs_inode.
+ * Inputs:
+ *   - sb: The superblock of the filesystem.
+ *   - ino: The inode number to load.
+ * Returns:
+ *   - A pointer to the VFS inode on success.
+ *   - ERR_PTR(-EFAULT) if the osfs_inode cannot be retrieved.
+ *   - ERR_PTR(-EUCLEAN) if the inode number is not in use, which only a
+ *     corrupted directory entry can ask for.
+ *   - ERR_PTR(-ENOMEM) if memory allocation for the inode fails.
+ */
 struct inode *osfs_iget(struct super_block *sb, unsigned long ino)
 {
+    struct osfs_sb_info *sb_info = sb->s_fs_info;
     struct osfs_inode *osfs_inode;
     struct inode *inode;
 
     osfs_inode = osfs_get_osfs_inode(sb, ino);
     if (!osfs_inode)
         return ERR_PTR(-EFAULT);
+    // A free slot of the table holds whatever its last file left there
+    if (!test_bit(ino, sb_info->inode_bitmap)) {
+        pr_err("osfs: Directory entry points to free inode %lu\n", ino);
+        return ERR_PTR(-EUCLEAN);
+    }
 
-    inode = new_inode(sb);
+    inode = iget_locked(sb, ino);
     if (!inode)
         return ERR_PTR(-ENOMEM);
+    if (!(inode->i_state & I_NEW))
+        return inode;
 
-    inode->i_ino = ino;
-    inode->i_sb = sb;
     inode->i_mode = osfs_inode->i_mode;
     i_uid_write(inode, osfs_inode->i_uid);
     i_gid_write(inode, osfs_inode->i_gid);
-    simple_inode_init_ts(inode);
+    set_nlink(inode, osfs_inode->i_links_count);
+    inode_set_atime_to_ts(inode, osfs_inode->__i_atime);
+    inode_set_mtime_to_ts(inode, osfs_inode->__i_mtime);
+    inode_set_ctime_to_ts(inode, osfs_inode->__i_ctime);
     inode->i_size = osfs_inode->i_size;
-    inode->i_blocks = osfs_inode->i_blocks;
+    // i_blocks counts 512-byte sectors
+    inode->i_blocks = (blkcnt_t)osfs_inode->i_blocks << (sb_info->block_bits - 9);
     inode->i_private = osfs_inode;
 
     if (S_ISDIR(inode->i_mode)) {
@@ -164,9 +301,32 @@ struct inode *osfs_iget(struct super_block *sb, unsigned long ino)
     } else if (S_ISREG(inode->i_mode)) {
         inode->i_op = &osfs_file_inode_operations;
         inode->i_fop = &osfs_file_operations;
+        if (sb_info->dax_dev)
+            inode->i_flags |= S_DAX;
     }
 
-    insert_inode_hash(inode);
-
+    unlock_new_inode(inode);
     return inode;
-}
\ No newline at end of file
+}
+
+/**
+ * Function: osfs_sync_inode
+ * Description: Copies the attributes of a VFS inode back to its osfs_inode,
+ *              so they survive the VFS inode being evicted.
+ * Inputs:
+ *   - inode: The VFS inode.
+ * Returns:
+ *   - None.
+ */
+void osfs_sync_inode(struct inode *inode)
+{
+    struct osfs_inode *osfs_inode = inode->i_private;
+
+    osfs_inode->i_mode = inode->i_mode;
+    osfs_inode->i_uid = i_uid_read(inode);
+    osfs_inode->i_gid = i_gid_read(inode);
+    osfs_inode->i_links_count = inode->i_nlink;
+    osfs_inode->__i_atime = inode_get_atime(inode);
+    osfs_inode->__i_mtime = inode_get_mtime(inode);
+    osfs_inode->__i_ctime = inode_get_ctime(inode);
+}
@@ -0,0 +1,698 @@
+#include <linux/fs.h>
+#include <linux/bio.h>
+#include <linux/crc32c.h>
+#include <linux/vmalloc.h>
+#include <linux/xarray.h>
+#include "osfs.h"
+
+/*
+ * Metadata journal.
+ *
+ * A full save rewrites every region of the image and is only safe because
+ * the header is marked incomplete while it runs; a crash in the middle
+ * leaves an image that cannot be mounted. Once an image has been saved or
+ * loaded, later saves go through the journal instead and leave the image
+ * mountable at every point.
+ *
+ * Metadata is the inode bitmap, the inode table, the block bitmap and the
+ * data blocks that hold structure: the nodes of extent trees and the
+ * blocks of directories. The save after a sync is one transaction, so
+ * every create, append and unlink since the previous sync is committed
+ * together. The pieces of metadata that changed since the last commit are
+ * found by comparing against a shadow copy of it: journal_shadow mirrors
+ * the regions and journal_meta holds a copy of each structure block.
+ *
+ * A transaction is written to the journal region as descriptor blocks,
+ * each listing where the OSFS_JOURNAL_TAGS blocks after it belong, then a
+ * commit block with a crc32c over all of them. Each journal block carries
+ * at most OSFS_IMAGE_ALIGN bytes of one region or data block. Once the
+ * commit block is stable the pieces are written to their homes, and then
+ * the header records the transaction as done. Mounting an image whose
+ * journal holds a complete transaction after the one in the header writes
+ * it home again before anything is read.
+ *
+ * File data is written in place before the transaction, so a committed
+ * extent never points at data older than it, and only the blocks written
+ * since the last save (block_dirty) are written. The exception is a block
+ * freed since the last commit and handed out again. Until the commit the
+ * image still gives it to its old owner, a file or a structure block, and
+ * writing the new data in place would show that owner the new data after
+ * a crash. jbd2 avoids this by not reusing such blocks until the commit;
+ * here the allocator cannot wait for one, since it runs under i_rwsem and
+ * a commit locks every inode. So the save journals the new contents of
+ * these blocks instead, and they reach their home only after the commit.
+ * A transaction that does not fit in the journal falls back to a full
+ * save.
+ *
+ * A DAX mount is never journaled: its directory and tree blocks change on
+ * the device itself between saves, ahead of any commit. Every save there
+ * is a full one, see dax.c.
+ */
+
+/**
+ * Struct: osfs_journal_piece
+ * Description: One changed piece of metadata to be journaled.
+ */
+struct osfs_journal_piece {
+    uint64_t offset;             // Home of the piece in the image
+    uint32_t len;                // At most OSFS_IMAGE_ALIGN bytes
+    const void *src;             // The current contents
+};
+
+/**
+ * Function: osfs_journal_blocks
+ * Description: Returns how many journal blocks a transaction of a given
+ *              number of pieces takes, descriptors and commit included.
+ */
+static inline uint64_t osfs_journal_blocks(uint64_t pieces)
+{
+    return pieces + DIV_ROUND_UP(pieces, OSFS_JOURNAL_TAGS) + 1;
+}
+
+/**
+ * Function: osfs_journal_block
+ * Description: Returns a block of a transaction buffer.
+ */
+static inline void *osfs_journal_block(void *tx, uint64_t index)
+{
+    return (char *)tx + index * OSFS_IMAGE_ALIGN;
+}
+
+/**
+ * Function: osfs_journal_checksum
+ * Description: Computes the checksum a commit block holds over the blocks
+ *              of the transaction before it.
+ */
+static uint32_t osfs_journal_checksum(void *tx, uint64_t nblocks, uint64_t seq)
+{
+    uint32_t crc = crc32c(~0U, &seq, sizeof(seq));
+    uint64_t i;
+
+    for (i = 0; i < nblocks; i++)
+        crc = crc32c(crc, osfs_journal_block(tx, i), OSFS_IMAGE_ALIGN);
+    return crc;
+}
+
+/**
+ * Function: osfs_journal_checkpoint
+ * Description: Writes every block of a transaction to its home in the
+ *              image. Pieces of data blocks on a mounted device go the way
+ *              osfs_image_data writes them, so no buffer head of the data
+ *              area goes stale.
+ * Inputs:
+ *   - sb: The superblock, whose device holds the image if image is NULL.
+ *   - image: The image file, or NULL on a mounted device.
+ *   - hdr: The layout of the image.
+ *   - tx: The transaction, a vmalloc buffer whose descriptors were checked.
+ *   - nblocks: The number of blocks before the commit block.
+ * Returns:
+ *   - 0 on success.
+ *   - A negative error code from the writes.
+ */
+int osfs_journal_checkpoint(struct super_block *sb, struct file *image,
+                            const struct osfs_image_header *hdr, void *tx, uint64_t nblocks)
+{
+    struct bio *bio = NULL;
+    uint64_t index = 0;
+    uint32_t i;
+    int ret = 0;
+
+    while (!ret && index < nblocks) {
+        struct osfs_journal_header *jh = osfs_journal_block(tx, index++);
+        struct osfs_journal_tag *tags = (struct osfs_journal_tag *)(jh + 1);
+
+        for (i = 0; i < jh->count && !ret; i++, index++) {
+            void *buf = osfs_journal_block(tx, index);
+
+            if (!image && tags[i].offset >= hdr->data_off)
+                bio = osfs_image_bio_add(sb, bio, buf, tags[i].len, tags[i].offset, true);
+            else
+                ret = osfs_image_rw(sb, image, buf, tags[i].len, tags[i].offset, true);
+        }
+    }
+
+    if (bio) {
+        int err = submit_bio_wait(bio);
+
+        bio_put(bio);
+        if (!ret)
+            ret = err;
+    }
+    return ret;
+}
+
+/**
+ * Function: osfs_journal_done
+ * Description: Records in the header that a transaction is home, so it is
+ *              never replayed, and makes that stable.
+ * Inputs:
+ *   - sb: The superblock, whose device holds the image if image is NULL.
+ *   - image: The image file, or NULL on a mounted device.
+ *   - hdr: The header to write; journal_seq and state are set here.
+ *   - seq: The transaction.
+ * Returns:
+ *   - 0 on success.
+ *   - A negative error code from the write or the flush.
+ */
+static int osfs_journal_done(struct super_block *sb, struct file *image,
+                             struct osfs_image_header *hdr, uint64_t seq)
+{
+    int ret;
+
+    hdr->journal_seq = seq;
+    hdr->state = OSFS_IMAGE_CLEAN;
+    ret = osfs_image_rw(sb, image, hdr, sizeof(*hdr), 0, true);
+    if (!ret)
+        ret = osfs_image_flush(sb, image);
+    return ret;
+}
+
+/**
+ * Function: osfs_journal_replay
+ * Description: Looks for a complete transaction after the one the header
+ *              records and, if there is one, writes it home. Called at
+ *              mount before the regions of a saved image are read.
+ * Inputs:
+ *   - sb: The superblock, whose device holds the image if image is NULL.
+ *   - image: The image file, or NULL on a mounted device.
+ *   - hdr: The header as saved; journal_seq is advanced if a transaction
+ *          is replayed.
+ * Returns:
+ *   - 0 on success, including when there is nothing to replay.
+ *   - -EINVAL if a complete transaction points outside the image.
+ *   - -ENOMEM if memory allocation fails.
+ *   - A negative error code from reading or writing the image.
+ */
+int osfs_journal_replay(struct super_block *sb, struct file *image,
+                        struct osfs_image_header *hdr)
+{
+    uint64_t seq = hdr->journal_seq + 1;
+    uint64_t end = hdr->data_off + ((uint64_t)hdr->block_count * hdr->block_size);
+    uint64_t nblocks = 0, index, max_blocks = hdr->journal_len / OSFS_IMAGE_ALIGN;
+    struct osfs_journal_header jh;
+    void *tx = NULL;
+    uint32_t i;
+    int ret;
+
+    // Follow the descriptors to the commit block
+    for (;;) {
+        if (nblocks >= max_blocks)
+            return 0;
+        ret = osfs_image_rw(sb, image, &jh, sizeof(jh),
+                            hdr->journal_off + nblocks * OSFS_IMAGE_ALIGN, false);
+        if (ret)
+            return ret;
+        if (jh.magic != OSFS_JOURNAL_MAGIC || jh.seq != seq)
+            return 0;
+        if (jh.type == OSFS_JOURNAL_COMMIT)
+            break;
+        if (jh.type != OSFS_JOURNAL_DESC || !jh.count || jh.count > OSFS_JOURNAL_TAGS)
+            return 0;
+        nblocks += 1 + jh.count;
+    }
+    // A commit block left from an older transaction does not count
+    if (jh.count != nblocks || !nblocks)
+        return 0;
+
+    tx = vmalloc(nblocks * OSFS_IMAGE_ALIGN);
+    if (!tx)
+        return -ENOMEM;
+    ret = osfs_image_rw(sb, image, tx, nblocks * OSFS_IMAGE_ALIGN, hdr->journal_off, false);
+    if (ret)
+        goto out;
+    // A torn transaction was never acknowledged; the image is as before it
+    if (osfs_journal_checksum(tx, nblocks, seq) != jh.checksum)
+        goto out;
+
+    for (index = 0; index < nblocks; ) {
+        struct osfs_journal_header *desc = osfs_journal_block(tx, index);
+        struct osfs_journal_tag *tags = (struct osfs_journal_tag *)(desc + 1);
+
+        index += 1 + desc->count;
+        for (i = 0; i < desc->count; i++) {
+            if (tags[i].offset < hdr->inode_bitmap_off || tags[i].len > OSFS_IMAGE_ALIGN ||
+                tags[i].offset + tags[i].len > end) {
+                pr_err("osfs: Journal transaction %llu is corrupted\n", seq);
+                ret = -EINVAL;
+                goto out;
+            }
+        }
+    }
+
+    ret = osfs_journal_checkpoint(sb, image, hdr, tx, nblocks);
+    if (!ret)
+        ret = osfs_image_flush(sb, image);
+    if (!ret)
+        ret = osfs_journal_done(sb, image, hdr, seq);
+    if (!ret)
+        pr_info("osfs: Replayed journal transaction %llu of %llu blocks\n", seq, nblocks);
+out:
+    vfree(tx);
+    return ret;
+}
+
+/**
+ * Function: osfs_journal_meta_map
+ * Description: Builds the bitmap of the data blocks that hold structure:
+ *              extent-tree nodes and directory blocks of every used inode.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ * Returns:
+ *   - The bitmap, to be freed with bitmap_free, or NULL if out of memory.
+ */
+static unsigned long *osfs_journal_meta_map(struct osfs_sb_info *sb_info)
+{
+    unsigned long *meta = bitmap_zalloc(sb_info->block_count, GFP_KERNEL);
+    uint32_t ino;
+
+    if (!meta)
+        return NULL;
+    for_each_set_bit(ino, sb_info->inode_bitmap, sb_info->inode_count)
+        osfs_ext_mark_meta(sb_info, &((struct osfs_inode *)sb_info->inode_table)[ino], meta);
+    // A corrupted tree could name blocks that are not allocated
+    bitmap_and(meta, meta, sb_info->block_bitmap, sb_info->block_count);
+    return meta;
+}
+
+/**
+ * Function: osfs_journal_destroy
+ * Description: Drops the shadow copy of the metadata, so the next save is
+ *              a full one.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ * Returns:
+ *   - None.
+ */
+void osfs_journal_destroy(struct osfs_sb_info *sb_info)
+{
+    unsigned long index;
+    void *copy;
+
+    xa_for_each(&sb_info->journal_meta, index, copy)
+        kfree(copy);
+    xa_destroy(&sb_info->journal_meta);
+    vfree(sb_info->journal_shadow);
+    sb_info->journal_shadow = NULL;
+}
+
+/**
+ * Function: osfs_journal_snapshot
+ * Description: Takes the shadow copy of the metadata as it is now, for an
+ *              image just loaded, which matches memory.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - hdr: The layout of the image.
+ * Returns:
+ *   - None. If memory runs out there is no shadow and saves stay full.
+ */
+void osfs_journal_snapshot(struct osfs_sb_info *sb_info, const struct osfs_image_header *hdr)
+{
+    unsigned long *meta;
+    char *shadow;
+    uint32_t block;
+
+    osfs_journal_destroy(sb_info);
+
+    shadow = vzalloc(hdr->data_off - hdr->inode_bitmap_off);
+    meta = osfs_journal_meta_map(sb_info);
+    if (!shadow || !meta)
+        goto out_free;
+
+    osfs_image_regions(sb_info, hdr, shadow);
+    for_each_set_bit(block, meta, sb_info->block_count) {
+        void *copy = kmemdup(osfs_block_addr(sb_info, block), sb_info->block_size, GFP_KERNEL);
+
+        if (!copy || xa_err(xa_store(&sb_info->journal_meta, block, copy, GFP_KERNEL))) {
+            kfree(copy);
+            goto out_destroy;
+        }
+    }
+    sb_info->journal_shadow = shadow;
+    bitmap_free(meta);
+    return;
+
+out_destroy:
+    osfs_journal_destroy(sb_info);
+out_free:
+    vfree(shadow);
+    bitmap_free(meta);
+}
+
+/**
+ * Function: osfs_journal_add
+ * Description: Adds a piece to a transaction being collected.
+ * Returns:
+ *   - 0 on success.
+ *   - -E2BIG if the transaction would not fit in the journal.
+ */
+static int osfs_journal_add(struct osfs_journal_piece *pieces, uint64_t *nr_pieces,
+                            uint64_t max_blocks, uint64_t offset, uint32_t len,
+                            const void *src)
+{
+    if (osfs_journal_blocks(*nr_pieces + 1) > max_blocks)
+        return -E2BIG;
+    pieces[*nr_pieces].offset = offset;
+    pieces[*nr_pieces].len = len;
+    pieces[*nr_pieces].src = src;
+    (*nr_pieces)++;
+    return 0;
+}
+
+/**
+ * Function: osfs_journal_collect
+ * Description: Collects the pieces of the regions and of the logged blocks
+ *              that differ from the shadow or, for a full save, every piece
+ *              of the logged blocks; a full save writes the regions whole.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - save: The save; regions is set.
+ *   - logged: The data blocks to journal.
+ *   - pieces: Array of pieces to fill.
+ *   - nr_pieces: Set to the number of pieces.
+ *   - max_blocks: The most journal blocks the transaction may take.
+ * Returns:
+ *   - 0 on success.
+ *   - -E2BIG if the changes do not fit in max_blocks.
+ */
+static int osfs_journal_collect(struct osfs_sb_info *sb_info, const struct osfs_save *save,
+                                const unsigned long *logged,
+                                struct osfs_journal_piece *pieces, uint64_t *nr_pieces,
+                                uint64_t max_blocks)
+{
+    const struct osfs_image_header *hdr = &save->hdr;
+    size_t size = hdr->data_off - hdr->inode_bitmap_off;
+    const char *shadow = sb_info->journal_shadow;
+    const char *regions = save->regions;
+    uint32_t block;
+    size_t off, len;
+    int ret;
+
+    *nr_pieces = 0;
+    for (off = 0; !save->full && off < size; off += len) {
+        len = min_t(size_t, size - off, OSFS_IMAGE_ALIGN);
+        if (!memcmp(regions + off, shadow + off, len))
+            continue;
+        ret = osfs_journal_add(pieces, nr_pieces, max_blocks, hdr->inode_bitmap_off + off,
+                               len, regions + off);
+        if (ret)
+            return ret;
+    }
+
+    for_each_set_bit(block, logged, sb_info->block_count) {
+        const char *copy = save->full ? NULL : xa_load(&sb_info->journal_meta, block);
+        const char *addr = osfs_block_addr(sb_info, block);
+
+        for (off = 0; off < sb_info->block_size; off += len) {
+            len = min_t(size_t, sb_info->block_size, OSFS_IMAGE_ALIGN);
+            if (copy && !memcmp(addr + off, copy + off, len))
+                continue;
+            ret = osfs_journal_add(pieces, nr_pieces, max_blocks,
+                                   hdr->data_off + ((uint64_t)block << sb_info->block_bits) + off,
+                                   len, addr + off);
+            if (ret)
+                return ret;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Function: osfs_journal_build
+ * Description: Lays out a transaction: descriptors, the pieces and the
+ *              commit block.
+ * Inputs:
+ *   - pieces: The pieces of the transaction.
+ *   - nr_pieces: The number of pieces.
+ *   - seq: The number of the transaction.
+ *   - nblocks: The number of blocks, commit block included.
+ * Returns:
+ *   - The transaction in a vmalloc buffer, or NULL if out of memory.
+ */
+static void *osfs_journal_build(const struct osfs_journal_piece *pieces, uint64_t nr_pieces,
+                                uint64_t seq, uint64_t nblocks)
+{
+    struct osfs_journal_header *jh = NULL;
+    struct osfs_journal_tag *tags = NULL;
+    uint64_t i, index = 0;
+    void *tx;
+
+    tx = vzalloc(nblocks * OSFS_IMAGE_ALIGN);
+    if (!tx)
+        return NULL;
+
+    for (i = 0; i < nr_pieces; i++) {
+        if (i % OSFS_JOURNAL_TAGS == 0) {
+            jh = osfs_journal_block(tx, index++);
+            jh->magic = OSFS_JOURNAL_MAGIC;
+            jh->type = OSFS_JOURNAL_DESC;
+            jh->seq = seq;
+            jh->count = min_t(uint64_t, nr_pieces - i, OSFS_JOURNAL_TAGS);
+            tags = (struct osfs_journal_tag *)(jh + 1);
+        }
+        tags[i % OSFS_JOURNAL_TAGS].offset = pieces[i].offset;
+        tags[i % OSFS_JOURNAL_TAGS].len = pieces[i].len;
+        memcpy(osfs_journal_block(tx, index++), pieces[i].src, pieces[i].len);
+    }
+
+    jh = osfs_journal_block(tx, index);
+    jh->magic = OSFS_JOURNAL_MAGIC;
+    jh->type = OSFS_JOURNAL_COMMIT;
+    jh->seq = seq;
+    jh->count = index;
+    jh->checksum = osfs_journal_checksum(tx, index, seq);
+    return tx;
+}
+
+/**
+ * Function: osfs_journal_update
+ * Description: Brings the copies of structure blocks up to a transaction
+ *              once it is home.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - hdr: The layout of the image.
+ *   - meta: The data blocks that hold structure now.
+ *   - tx: The transaction, or NULL if there is none.
+ *   - nblocks: The number of blocks before the commit block.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOMEM if a copy of a block cannot be allocated.
+ */
+static int osfs_journal_update(struct osfs_sb_info *sb_info, const struct osfs_image_header *hdr,
+                               const unsigned long *meta, void *tx, uint64_t nblocks)
+{
+    uint64_t index = 0;
+    unsigned long block;
+    char *copy;
+    uint32_t i;
+
+    while (tx && index < nblocks) {
+        struct osfs_journal_header *jh = osfs_journal_block(tx, index++);
+        struct osfs_journal_tag *tags = (struct osfs_journal_tag *)(jh + 1);
+
+        for (i = 0; i < jh->count; i++, index++) {
+            const void *buf = osfs_journal_block(tx, index);
+            uint64_t pos = tags[i].offset;
+
+            // The regions are taken whole by osfs_journal_adopt
+            if (pos < hdr->data_off)
+                continue;
+            pos -= hdr->data_off;
+            block = pos >> sb_info->block_bits;
+            // Reused file data blocks are journaled but need no copy
+            if (!test_bit(block, meta))
+                continue;
+            copy = xa_load(&sb_info->journal_meta, block);
+            if (!copy) {
+                copy = kzalloc(sb_info->block_size, GFP_KERNEL);
+                if (!copy || xa_err(xa_store(&sb_info->journal_meta, block, copy, GFP_KERNEL))) {
+                    kfree(copy);
+                    return -ENOMEM;
+                }
+            }
+            memcpy(copy + (pos & (sb_info->block_size - 1)), buf, tags[i].len);
+        }
+    }
+
+    // Blocks that no longer hold structure need no copy
+    xa_for_each(&sb_info->journal_meta, block, copy) {
+        if (block >= sb_info->block_count || !test_bit(block, meta))
+            kfree(xa_erase(&sb_info->journal_meta, block));
+    }
+    return 0;
+}
+
+/**
+ * Function: osfs_journal_prepare
+ * Description: Prepares a save from the regions copied into it: finds the
+ *              blocks that hold structure, takes the blocks written and
+ *              freed since the last save, copies the changed metadata and
+ *              the reused blocks into a transaction, or every structure
+ *              block for a full save, and picks the file data to write in
+ *              place. The caller holds block_lock, so the copies agree
+ *              with the regions.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - save: The save; hdr, full and regions are set.
+ * Returns:
+ *   - 0 on success.
+ *   - -E2BIG if the changes do not fit in the journal.
+ *   - -ENOMEM if memory allocation fails.
+ *   On failure save is left as it was passed in, but the blocks written
+ *   and freed may have been taken; only a full save may follow.
+ */
+int osfs_journal_prepare(struct osfs_sb_info *sb_info, struct osfs_save *save)
+{
+    uint32_t words = BITMAP_SIZE(sb_info->block_count), w;
+    uint64_t max_blocks = save->hdr.journal_len / OSFS_IMAGE_ALIGN;
+    uint64_t max_pieces = max_blocks, nr_pieces;
+    struct osfs_journal_piece *pieces = NULL;
+    unsigned long *freed, *logged;
+    int ret = -ENOMEM;
+
+    save->meta = osfs_journal_meta_map(sb_info);
+    save->data = bitmap_zalloc(sb_info->block_count, GFP_KERNEL);
+    freed = bitmap_zalloc(sb_info->block_count, GFP_KERNEL);
+    logged = bitmap_zalloc(sb_info->block_count, GFP_KERNEL);
+    if (!save->meta || !save->data || !freed || !logged)
+        goto out;
+
+    // Writers set dirty bits without block_lock, so each word is taken whole
+    for (w = 0; w < words; w++)
+        save->data[w] = xchg(&sb_info->block_dirty[w], 0);
+    bitmap_copy(freed, sb_info->block_freed, sb_info->block_count);
+    bitmap_zero(sb_info->block_freed, sb_info->block_count);
+
+    if (sb_info->dax_dev) {
+        // Every block is home already, structure included; flush them all
+        bitmap_copy(save->data, sb_info->block_bitmap, sb_info->block_count);
+        max_pieces = 0;
+    } else if (save->full) {
+        bitmap_andnot(save->data, sb_info->block_bitmap, save->meta, sb_info->block_count);
+        bitmap_copy(logged, save->meta, sb_info->block_count);
+        // A full save does not go through the journal, so its size is no limit
+        max_pieces = bitmap_weight(save->meta, sb_info->block_count) *
+                     DIV_ROUND_UP(sb_info->block_size, OSFS_IMAGE_ALIGN);
+        max_blocks = osfs_journal_blocks(max_pieces);
+    } else {
+        bitmap_and(save->data, save->data, sb_info->block_bitmap, sb_info->block_count);
+        bitmap_andnot(save->data, save->data, save->meta, sb_info->block_count);
+        // Data reusing blocks freed since the last commit waits for it in the journal
+        bitmap_and(freed, freed, save->data, sb_info->block_count);
+        bitmap_andnot(save->data, save->data, freed, sb_info->block_count);
+        bitmap_or(logged, save->meta, freed, sb_info->block_count);
+    }
+
+    pieces = kvmalloc_array(max_t(uint64_t, max_pieces, 1), sizeof(*pieces), GFP_KERNEL);
+    if (!pieces)
+        goto out;
+    ret = osfs_journal_collect(sb_info, save, logged, pieces, &nr_pieces, max_blocks);
+    if (ret)
+        goto out;
+    save->nblocks = osfs_journal_blocks(nr_pieces);
+    if (nr_pieces) {
+        save->tx = osfs_journal_build(pieces, nr_pieces, sb_info->journal_seq + 1,
+                                      save->nblocks);
+        if (!save->tx)
+            ret = -ENOMEM;
+    }
+
+out:
+    kvfree(pieces);
+    bitmap_free(logged);
+    bitmap_free(freed);
+    if (ret) {
+        bitmap_free(save->data);
+        bitmap_free(save->meta);
+        save->data = save->meta = NULL;
+    }
+    return ret;
+}
+
+/**
+ * Function: osfs_journal_adopt
+ * Description: Makes a save that is home the new shadow: its regions
+ *              replace the shadow and its structure blocks the copies.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - save: The save, which gives up its regions.
+ * Returns:
+ *   - None. If memory runs out there is no shadow and the next save is full.
+ */
+void osfs_journal_adopt(struct osfs_sb_info *sb_info, struct osfs_save *save)
+{
+    vfree(sb_info->journal_shadow);
+    sb_info->journal_shadow = save->regions;
+    save->regions = NULL;
+    if (osfs_journal_update(sb_info, &save->hdr, save->meta, save->tx, save->nblocks - 1))
+        osfs_journal_destroy(sb_info);
+}
+
+/**
+ * Function: osfs_journal_commit
+ * Description: Writes a prepared save through the journal: the file data
+ *              in place, the transaction and its commit block, then the
+ *              transaction home. Runs without block_lock; the caller keeps
+ *              the blocks of the save allocated until it returns.
+ * Inputs:
+ *   - sb: The superblock of the filesystem.
+ *   - image: The image file, or NULL on a mounted device.
+ *   - save: The save from osfs_journal_prepare.
+ * Returns:
+ *   - 0 on success.
+ *   - A negative error code from writing or flushing the image. The image
+ *     can still be mounted, but the shadow is dropped.
+ */
+int osfs_journal_commit(struct super_block *sb, struct file *image, struct osfs_save *save)
+{
+    struct osfs_sb_info *sb_info = sb->s_fs_info;
+    struct osfs_image_header *hdr = &save->hdr;
+    uint64_t seq = sb_info->journal_seq + 1;
+    uint64_t nblocks = save->nblocks;
+    void *tx = save->tx;
+    int ret;
+
+    ret = osfs_image_data(sb, image, hdr, save->data, true);
+    if (!ret && !tx)
+        ret = osfs_image_flush(sb, image);
+    if (ret || !tx)
+        goto out;
+
+    // From here on a transaction with this number may be on disk
+    sb_info->journal_seq = seq;
+    ret = osfs_image_rw(sb, image, tx, (nblocks - 1) * OSFS_IMAGE_ALIGN, hdr->journal_off, true);
+    if (!ret)
+        ret = osfs_image_flush(sb, image);
+    if (!ret)
+        ret = osfs_image_rw(sb, image, osfs_journal_block(tx, nblocks - 1), OSFS_IMAGE_ALIGN,
+                            hdr->journal_off + (nblocks - 1) * OSFS_IMAGE_ALIGN, true);
+    if (!ret)
+        ret = osfs_image_flush(sb, image);
+    if (ret)
+        goto out;
+
+    // Committed; a crash from here on is repaired by replay
+    ret = osfs_journal_checkpoint(sb, image, hdr, tx, nblocks - 1);
+    if (!ret)
+        ret = osfs_image_flush(sb, image);
+    if (!ret)
+        ret = osfs_journal_done(sb, image, hdr, seq);
+out:
+    // The image is complete either way; without a shadow the next save is full
+    if (ret)
+        osfs_journal_destroy(sb_info);
+    else
+        osfs_journal_adopt(sb_info, save);
+    return ret;
+}
+
+/**
+ * Function: osfs_journal_free_save
+ * Description: Frees what a save holds.
+ */
+void osfs_journal_free_save(struct osfs_save *save)
+{
+    vfree(save->tx);
+    vfree(save->regions);
+    bitmap_free(save->data);
+    bitmap_free(save->meta);
+}
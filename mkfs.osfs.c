@@ -0,0 +1,190 @@
+// mkfs.osfs: formats a block device or file for osfs.
+//
+// Usage: mkfs.osfs [-b block_size] [-i inodes] [-s size] device
+//
+// Only a header in state OSFS_IMAGE_NEW is written; the kernel lays out
+// the bitmaps and inode table and creates the root directory at the first
+// mount, and saves them on sync and unmount. Without -s the data area
+// fills the device. A loop device over a file can be used for testing:
+//
+//   truncate -s 64M osfs.img && sudo losetup /dev/loop0 osfs.img
+//   sudo ./mkfs.osfs /dev/loop0 && sudo mount -t osfs /dev/loop0 mnt/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+
+// Must match osfs.h
+#define OSFS_IMAGE_MAGIC 0x051A1A6E
+#define OSFS_IMAGE_VERSION 3
+#define OSFS_IMAGE_NEW 2
+#define OSFS_IMAGE_ALIGN 4096
+#define OSFS_MIN_BLOCK_SIZE 512
+#define OSFS_DEFAULT_BLOCK_SIZE 4096
+#define OSFS_BYTES_PER_INODE 16384     // Inode density when no -i is given
+#define OSFS_MIN_INODES 64
+
+/**
+ * Struct: osfs_image_header
+ * Description: Copy of the header in osfs.h. Only the fields up to
+ *              block_count are filled in for a new image.
+ */
+struct osfs_image_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t state;
+    uint32_t block_size;
+    uint32_t inode_count;
+    uint32_t block_count;
+    uint32_t inode_size;
+    uint32_t long_size;
+    uint64_t inode_bitmap_off;
+    uint64_t inode_table_off;
+    uint64_t block_bitmap_off;
+    uint64_t data_off;
+    uint64_t journal_off;
+    uint64_t journal_len;
+    uint64_t journal_seq;
+};
+
+/**
+ * Function: usage
+ * Description: Prints how to run the tool and exits with failure.
+ */
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-b block_size] [-i inodes] [-s size[K|M|G]] device\n", prog);
+    exit(1);
+}
+
+/**
+ * Function: parse_size
+ * Description: Parses a byte count with an optional K/M/G suffix.
+ * Returns:
+ *   - The number of bytes, or 0 if the text is not a size.
+ */
+static uint64_t parse_size(const char *text)
+{
+    char *rest;
+    uint64_t size = strtoull(text, &rest, 0);
+
+    switch (*rest) {
+    case 'G': case 'g':
+        size <<= 10;
+        /* fall through */
+    case 'M': case 'm':
+        size <<= 10;
+        /* fall through */
+    case 'K': case 'k':
+        size <<= 10;
+        rest++;
+        break;
+    }
+    return *rest ? 0 : size;
+}
+
+/**
+ * Function: device_size
+ * Description: Returns the size of a block device or regular file.
+ * Returns:
+ *   - The size in bytes, or 0 on error with errno set.
+ */
+static uint64_t device_size(int fd)
+{
+    struct stat st;
+    uint64_t size;
+
+    if (fstat(fd, &st) < 0)
+        return 0;
+    if (S_ISREG(st.st_mode))
+        return st.st_size;
+    if (S_ISBLK(st.st_mode) && ioctl(fd, BLKGETSIZE64, &size) == 0)
+        return size;
+    errno = EINVAL;
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    static char block[OSFS_IMAGE_ALIGN];
+    struct osfs_image_header *hdr = (void *)block;
+    uint32_t block_size = OSFS_DEFAULT_BLOCK_SIZE;
+    uint64_t inodes = 0, size = 0, dev_size;
+    int opt, fd;
+
+    while ((opt = getopt(argc, argv, "b:i:s:")) != -1) {
+        switch (opt) {
+        case 'b':
+            block_size = strtoul(optarg, NULL, 0);
+            break;
+        case 'i':
+            inodes = strtoull(optarg, NULL, 0);
+            break;
+        case 's':
+            size = parse_size(optarg);
+            if (!size)
+                usage(argv[0]);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1)
+        usage(argv[0]);
+
+    if (block_size < OSFS_MIN_BLOCK_SIZE || (block_size & (block_size - 1))) {
+        fprintf(stderr, "%s: block size must be a power of two of at least %d\n",
+                argv[0], OSFS_MIN_BLOCK_SIZE);
+        return 1;
+    }
+
+    fd = open(argv[optind], O_WRONLY);
+    if (fd < 0) {
+        perror(argv[optind]);
+        return 1;
+    }
+    dev_size = device_size(fd);
+    if (!dev_size) {
+        fprintf(stderr, "%s: cannot size %s: %s\n", argv[0], argv[optind], strerror(errno));
+        return 1;
+    }
+    if (size > dev_size) {
+        fprintf(stderr, "%s: %s holds only %llu bytes\n", argv[0], argv[optind],
+                (unsigned long long)dev_size);
+        return 1;
+    }
+
+    // Inode 0 is never used and inode 1 is the root directory
+    if (!inodes)
+        inodes = (size ? size : dev_size) / OSFS_BYTES_PER_INODE;
+    if (inodes < OSFS_MIN_INODES)
+        inodes = OSFS_MIN_INODES;
+    if (inodes > UINT32_MAX || size / block_size > UINT32_MAX) {
+        fprintf(stderr, "%s: too many inodes or blocks\n", argv[0]);
+        return 1;
+    }
+
+    hdr->magic = OSFS_IMAGE_MAGIC;
+    hdr->version = OSFS_IMAGE_VERSION;
+    hdr->state = OSFS_IMAGE_NEW;
+    hdr->block_size = block_size;
+    hdr->inode_count = inodes;
+    hdr->block_count = size / block_size;   // 0 lets the kernel fill the device
+
+    if (pwrite(fd, block, sizeof(block), 0) != sizeof(block) || fsync(fd) < 0) {
+        perror(argv[optind]);
+        return 1;
+    }
+    close(fd);
+
+    printf("%s: block size %u, %u inodes, %s\n", argv[optind], block_size,
+           hdr->inode_count, size ? "data area as given" : "data area fills the device");
+    return 0;
+}
@@ -9,20 +9,127 @@
 #include <linux/vmalloc.h>
 #include <linux/string.h>
 #include <linux/module.h>
+#include <linux/fs_context.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/percpu_counter.h>
+#include <linux/xarray.h>
+#include <linux/ioctl.h>
+#include <linux/pfn_t.h>
+#include <linux/fileattr.h>
+#include <linux/refcount.h>
 
 #define OSFS_MAGIC 0x051AB520
 //#define BLOCK_SIZE 4096       // Each data block size is 4KB
-#define INODE_COUNT 64         // Maximum of 20 inodes in the filesystem
-#define DATA_BLOCK_COUNT 256    // Assume there are 20 data blocks
+#define OSFS_DEFAULT_INODE_COUNT 64     // Inode count when no inodes= option is given
+#define OSFS_DEFAULT_BLOCK_COUNT 256    // Data block count when no size= option is given
+#define OSFS_DEFAULT_BLOCK_SIZE 4096    // Block size when no block_size= option is given
+#define OSFS_MIN_BLOCK_SIZE 512
+#define OSFS_CHUNK_SHIFT 21             // Data area is populated in 2 MiB chunks
 #define MAX_FILENAME_LEN 255
-#define MAX_DIR_ENTRIES (BLOCK_SIZE / sizeof(struct osfs_dir_entry))
-#define MAX_EXTENT_COUNT 4  // 每個文件最多可以有4個extent
+#define OSFS_ROOT_EXTENT_COUNT 4  // Extents held directly in the inode before the tree grows
+#define OSFS_EXT_MAGIC 0x05E7
+#define OSFS_EXT_MAX_DEPTH 5
+#define OSFS_PREALLOC_MAX_BYTES (1 << 20)  // Largest speculative preallocation window for appends
+#define OSFS_DELALLOC_MAX_BLOCKS 1024      // Pending blocks a file may hold before its writer places them
+#define OSFS_POOL_BLOCKS 64     // Blocks a CPU reserves from the block bitmap at a time
+#define OSFS_POOL_INODES 32     // Inode numbers a CPU reserves from the inode bitmap at a time
+#define OSFS_CLUSTER_SHIFT 16   // Compressed files are packed in 64 KiB clusters
+#define OSFS_CLUSTER_CACHE_SIZE 16  // Decompressed clusters kept per mount
 
-#define BITMAP_SIZE(bits) (((bits) + BITS_PER_LONG - 1) / BITS_PER_LONG)
+/**
+ * Struct: osfs_defrag_report
+ * Description: Filled in by OSFS_IOC_DEFRAG; free space is in blocks.
+ */
+struct osfs_defrag_report {
+    __u32 extents_before;        // Extents of the file before the move
+    __u32 extents_after;         // Extents of the file after it
+    __u32 moved_blocks;          // Blocks copied to a new place
+    __u32 free_runs_before;      // Runs of free blocks in the filesystem
+    __u32 free_runs_after;
+    __u32 largest_free_before;   // Longest run of free blocks
+    __u32 largest_free_after;
+};
+
+#define OSFS_IOC_DEFRAG _IOR('o', 1, struct osfs_defrag_report)
+
+#define OSFS_IMAGE_MAGIC 0x051A1A6E
+#define OSFS_IMAGE_VERSION 3
+#define OSFS_IMAGE_CLEAN 1      // Header state once every region of a save is written
+#define OSFS_IMAGE_NEW 2        // Header state written by mkfs.osfs: geometry only, nothing saved
+#define OSFS_IMAGE_ALIGN 4096   // Alignment of each region in an image, and size of a journal block
+#define OSFS_JOURNAL_MAGIC 0x051A10A1
+#define OSFS_JOURNAL_DESC 1     // Journal block listing where the blocks after it go
+#define OSFS_JOURNAL_COMMIT 2   // Journal block closing a transaction
+#define OSFS_JOURNAL_MIN_EXTRA (1 << 20)   // Journal room for directory and tree blocks, at least
+#define OSFS_JOURNAL_MAX_EXTRA (64 << 20)  // and at most
+
+/**
+ * Struct: osfs_image_header
+ * Description: First bytes of a backing image or osfs block device. The
+ *              journal, inode bitmap, inode table, block bitmap and data
+ *              area follow at OSFS_IMAGE_ALIGN-aligned offsets. mkfs.osfs
+ *              relies on this layout up to block_count; keep them in step.
+ */
+struct osfs_image_header {
+    uint32_t magic;              // OSFS_IMAGE_MAGIC
+    uint32_t version;            // OSFS_IMAGE_VERSION
+    uint32_t state;              // OSFS_IMAGE_CLEAN or _NEW, or 0 while a save is under way
+    uint32_t block_size;
+    uint32_t inode_count;
+    uint32_t block_count;        // 0 in a new image to fill the device
+    uint32_t inode_size;         // sizeof(struct osfs_inode) the table was saved with
+    uint32_t long_size;          // sizeof(unsigned long) the bitmaps were saved with
+    uint64_t inode_bitmap_off;   // Byte offsets of the regions in the image
+    uint64_t inode_table_off;
+    uint64_t block_bitmap_off;
+    uint64_t data_off;
+    uint64_t journal_off;
+    uint64_t journal_len;        // Bytes of the journal region
+    uint64_t journal_seq;        // Last transaction written back in place
+};
+
+/**
+ * Struct: osfs_journal_header
+ * Description: Start of a descriptor or commit block in the journal.
+ */
+struct osfs_journal_header {
+    uint32_t magic;              // OSFS_JOURNAL_MAGIC
+    uint32_t type;               // OSFS_JOURNAL_DESC or OSFS_JOURNAL_COMMIT
+    uint64_t seq;                // Transaction the block belongs to
+    uint32_t count;              // Tags after a descriptor; blocks in the transaction for a commit
+    uint32_t checksum;           // Commit only: crc32c of every block before it
+};
 
-// Calculate the size of the bitmap (in units of unsigned long)
-#define INODE_BITMAP_SIZE BITMAP_SIZE(INODE_COUNT)
-#define BLOCK_BITMAP_SIZE BITMAP_SIZE(DATA_BLOCK_COUNT)
+/**
+ * Struct: osfs_journal_tag
+ * Description: Home of one journaled block, listed in a descriptor block.
+ */
+struct osfs_journal_tag {
+    uint64_t offset;             // Byte offset in the image
+    uint32_t len;                // Bytes used of the journal block
+    uint32_t reserved;
+};
+
+#define OSFS_JOURNAL_TAGS \
+    ((OSFS_IMAGE_ALIGN - sizeof(struct osfs_journal_header)) / sizeof(struct osfs_journal_tag))
+
+/**
+ * Struct: osfs_save
+ * Description: A save of the image, prepared under block_lock so that its
+ *              writes can run without it.
+ */
+struct osfs_save {
+    struct osfs_image_header hdr; // Layout of the image
+    bool full;                   // Rewrite every region instead of journaling the changes
+    void *regions;               // Inode bitmap, inode table and block bitmap as in the image
+    unsigned long *meta;         // Data blocks that hold structure
+    unsigned long *data;         // File data blocks written in place before the commit
+    void *tx;                    // The transaction; for a full save, the structure blocks
+    uint64_t nblocks;            // Blocks in tx, commit block included
+};
+
+#define BITMAP_SIZE(bits) (((bits) + BITS_PER_LONG - 1) / BITS_PER_LONG)
 
 #define ROOT_INODE 1            // Define the root inode as 1
 
@@ -31,10 +138,77 @@
  * Description: Represents a contiguous range of blocks
  */
 struct osfs_extent {
+    uint32_t file_block;     // First logical block of the file it maps
     uint32_t start_block;    
     uint32_t block_count;    
 };
 
+/**
+ * Struct: osfs_extent_header
+ * Description: Header of an extent tree node, in the inode or in a data block
+ */
+struct osfs_extent_header {
+    uint16_t eh_magic;       // OSFS_EXT_MAGIC
+    uint16_t eh_entries;     // Number of valid entries
+    uint16_t eh_max;         // Capacity of the node
+    uint16_t eh_depth;       // 0 for leaves (osfs_extent), else index nodes (osfs_extent_idx)
+};
+
+/**
+ * Struct: osfs_extent_idx
+ * Description: Index entry of an extent tree node
+ */
+struct osfs_extent_idx {
+    uint32_t ei_block;       // First logical block covered by the child
+    uint32_t ei_leaf;        // Data block holding the child node
+};
+
+/**
+ * Struct: osfs_extent_cursor
+ * Description: Per-open-file copy of the last extent a lookup hit
+ */
+struct osfs_extent_cursor {
+    uint32_t generation;         // i_ext_generation the copy was taken at
+    struct osfs_extent extent;   // Last extent hit, block_count 0 if none
+};
+
+/**
+ * Struct: osfs_mount_opts
+ * Description: Geometry requested through mount options, e.g.
+ *              mount -t osfs -o size=64M,inodes=4096,block_size=4096 none mnt/
+ *              An existing image= overrides the geometry with its own.
+ */
+struct osfs_mount_opts {
+    uint64_t size;               // Data area size in bytes, 0 for the default
+    uint32_t inode_count;        // Total number of inodes
+    uint32_t block_size;         // Size of each data block
+    char *image;                 // Backing image file or block device, NULL for none
+    bool dax;                    // Access the data area on the device directly
+    bool compress;               // Compress every file once it is cold
+};
+
+/**
+ * Struct: osfs_block_pool
+ * Description: Run of blocks a CPU has reserved from the block bitmap and
+ *              hands out without taking block_lock.
+ */
+struct osfs_block_pool {
+    spinlock_t lock;
+    uint32_t start;              // Next block to hand out
+    uint32_t count;              // Blocks left in the run
+};
+
+/**
+ * Struct: osfs_inode_pool
+ * Description: Inode numbers a CPU has reserved from the inode bitmap and
+ *              hands out without taking inode_lock.
+ */
+struct osfs_inode_pool {
+    spinlock_t lock;
+    uint32_t nr;                 // Number of valid entries in ino
+    uint32_t ino[OSFS_POOL_INODES];
+};
+
 /**
  * Struct: osfs_sb_info
  * Description: Superblock information for the osfs filesystem.
@@ -42,23 +216,129 @@ struct osfs_extent {
 struct osfs_sb_info {
     uint32_t magic;              // Magic number to identify the filesystem
     uint32_t block_size;         // Size of each data block
+    uint32_t block_bits;         // log2(block_size)
     uint32_t inode_count;        // Total number of inodes
     uint32_t block_count;        // Total number of data blocks
-    uint32_t nr_free_inodes;     // Number of free inodes
-    uint32_t nr_free_blocks;     // Number of free data blocks
+    uint32_t nr_free_blocks;     // Data blocks clear in block_bitmap
+    struct percpu_counter free_inodes; // Inodes not in use, including those in CPU pools
+    struct percpu_counter free_blocks; // Data blocks not in use, including those in CPU pools
     unsigned long *inode_bitmap; // Pointer to the inode bitmap
+    unsigned long *inode_full_map; // One bit per inode_bitmap word, set when the word is full
+    uint32_t inode_rotor;        // Inode number the next bitmap search starts from
     unsigned long *block_bitmap; // Pointer to the data block bitmap
+    unsigned long *block_full_map; // One bit per block_bitmap word, set when the word is full
+    uint32_t block_hint;         // No free data block below this index
     void *inode_table;           // Pointer to the inode table
-    void *data_blocks;           // Pointer to the data blocks area
+    uint32_t chunk_bits;         // log2(blocks per chunk)
+    uint32_t chunk_count;        // Number of chunks covering the data area
+    void **chunks;               // Data area chunks, NULL until a block in them is allocated;
+                                 // with DAX, always the device's own mapping
+    uint32_t *chunk_used;        // Allocated blocks per chunk
+    void *metadata;              // Single allocation backing the bitmaps, chunk map and inode table
+    struct mutex block_lock;     // Protects the block bitmaps, chunks and nr_free_blocks
+    spinlock_t inode_lock;       // Protects inode_bitmap, inode_full_map and inode_rotor
+    struct osfs_block_pool __percpu *block_pools; // Per-CPU runs of reserved blocks
+    struct osfs_inode_pool __percpu *inode_pools; // Per-CPU reserved inode numbers
+    struct file *image;          // Backing image saved on sync, NULL if volatile
+    struct mutex image_lock;     // Serializes saves of the image
+    bool image_saving;           // A save is writing; frees wait in block_deferred (block_lock)
+    unsigned long *block_deferred; // Blocks freed while a save was writing (block_lock)
+    uint32_t nr_deferred_pooled; // Blocks of block_deferred that were only pooled, still counted free
+    unsigned long *block_dirty;  // Data blocks written since the last save (atomic bitops)
+    unsigned long *block_freed;  // Blocks freed since the last save (block_lock)
+    void *journal_shadow;        // Metadata regions as last committed, NULL until a save or load
+    struct xarray journal_meta;  // Directory and extent-node blocks as last committed, by block
+    uint64_t journal_seq;        // Last transaction written back in place
+    struct dax_device *dax_dev;  // Device the data area is mapped from, NULL without DAX
+    bool unmounting;             // Set at unmount, so the last save of a DAX mount marks it clean
+    u64 dax_off;                 // Byte offset of the block device in the DAX device
+    pfn_t dax_pfn;               // pfn of data block 0 with DAX
+    bool compress;               // Compress every regular file on its last close after a write
+    spinlock_t cluster_lock;     // Protects cluster_lru and nr_cached_clusters
+    struct list_head cluster_lru; // Recently decompressed clusters, most recent first
+    uint32_t nr_cached_clusters;
+    struct workqueue_struct *compress_wq; // Compresses files after their last writer closed them
+};
+
+/**
+ * Struct: osfs_cluster_header
+ * Description: Start of the first block of a packed cluster; the LZ4 data
+ *              follows it.
+ */
+struct osfs_cluster_header {
+    uint32_t ch_len;             // Bytes of LZ4 data
+    uint32_t ch_reserved;
+};
+
+/**
+ * Struct: osfs_cluster
+ * Description: Decompressed cluster of a compressed file, cached per mount.
+ */
+struct osfs_cluster {
+    struct list_head lru;        // Entry in cluster_lru
+    refcount_t ref;              // One for the cache, one per reader copying out
+    unsigned long ino;           // Inode the cluster belongs to
+    uint32_t index;              // Cluster number in the file
+    uint32_t len;                // Bytes of file data in data
+    char data[];
 };
 
 /**
  * Struct: osfs_dir_entry
- * Description: Directory entry structure.
+ * Description: Variable-length directory record, laid out like ext2's.
+ *              Records tile each directory block: rec_len leads to the
+ *              next one, and the last record of a block runs to its end.
+ *              A record with inode_no 0 is free space.
  */
 struct osfs_dir_entry {
-    char filename[MAX_FILENAME_LEN]; // File name
-    uint32_t inode_no;               // Corresponding inode number
+    uint32_t inode_no;               // Corresponding inode number, 0 if unused
+    uint16_t rec_len;                // Bytes to the next record; see osfs_rec_len
+    uint8_t name_len;                // Length of the name
+    uint8_t file_type;               // FT_* type of the inode, for d_type
+    char name[];                     // File name, not NUL-terminated
+};
+
+// Bytes a record with a name of the given length needs, rounded to 4
+#define OSFS_DIR_REC_LEN(name_len) \
+    ALIGN(offsetof(struct osfs_dir_entry, name) + (name_len), 4)
+// rec_len of a record spanning a whole 64 KiB block, which 16 bits cannot hold
+#define OSFS_MAX_REC_LEN ((1 << 16) - 1)
+
+// Free space classes of directory blocks, 4 bytes apart; the last takes any record
+#define OSFS_DIR_SPACE_CLASSES (OSFS_DIR_REC_LEN(MAX_FILENAME_LEN) / 4 + 1)
+
+/**
+ * Struct: osfs_dir_space
+ * Description: Free space of one directory block, linked into the list
+ *              of its class.
+ */
+struct osfs_dir_space {
+    uint32_t free;                   // Largest record the block can still take
+    uint32_t prev;                   // Neighbours in the class list, U32_MAX at the ends
+    uint32_t next;
+};
+
+/**
+ * Struct: osfs_dir_index
+ * Description: In-memory hash index over the names of a directory.
+ */
+struct osfs_dir_index {
+    struct hlist_head *buckets;
+    unsigned int bits;               // log2 of the number of buckets
+    uint32_t count;                  // Number of indexed entries
+    struct osfs_dir_space *space;    // Free space of each block, by logical block
+    uint32_t nr_blocks;              // Length of space
+    uint32_t space_head[OSFS_DIR_SPACE_CLASSES]; // First block of each class, U32_MAX if none
+};
+
+/**
+ * Struct: osfs_dir_hnode
+ * Description: Index record pointing at one directory entry.
+ */
+struct osfs_dir_hnode {
+    struct hlist_node node;
+    uint32_t hash;                   // Hash of the entry's name
+    uint32_t pos;                    // Byte offset of the entry in the directory
 };
 
 /**
@@ -76,18 +356,241 @@ struct osfs_inode {
     struct timespec64 __i_atime;        // Last access time
     struct timespec64 __i_mtime;        // Last modification time
     struct timespec64 __i_ctime;        // Creation time
-    uint32_t i_extent_count;    // 當前使用的extent數量
-    struct osfs_extent i_extents[MAX_EXTENT_COUNT];  // 存多個extent
+    uint32_t i_extent_count;    // 當前使用的extent數量 (leaf extents in the whole tree)
+    uint32_t i_ext_generation;  // Bumped whenever the extent tree changes
+    uint32_t i_prealloc_start;  // First block of the speculative append window, 0 if none
+    uint32_t i_flags;           // OSFS_*_FL
+    union {
+        struct {
+            struct osfs_extent_header i_ext_header;  // Root node of the extent tree
+            struct osfs_extent i_extents[OSFS_ROOT_EXTENT_COUNT];  // Root entries, osfs_extent_idx when depth > 0
+        };
+        // Contents of a file small enough to need no block, with OSFS_INLINE_DATA_FL
+        char i_inline_data[sizeof(struct osfs_extent_header) +
+                           OSFS_ROOT_EXTENT_COUNT * sizeof(struct osfs_extent)];
+    };
 };
+
+#define OSFS_INLINE_DATA_FL 0x1     // Data is in i_inline_data, the file has no extent tree
+#define OSFS_COMPR_FL 0x2           // chattr +c: compress the file once it is cold
+#define OSFS_COMPRESSED_FL 0x4      // Each extent holds one cluster, packed unless it maps all its blocks
+#define OSFS_INLINE_MAX sizeof_field(struct osfs_inode, i_inline_data)
+
+/**
+ * Function: osfs_has_inline_data
+ * Description: Tests whether a file keeps its data inside the inode. A file
+ *              only ever stops doing so, under invalidate_lock, and its
+ *              extent root is complete before the flag clears, so a false
+ *              answer read without the lock is stable and the tree behind
+ *              it can be walked.
+ */
+static inline bool osfs_has_inline_data(const struct osfs_inode *osfs_inode)
+{
+    // Pairs with the release in osfs_inline_convert
+    return smp_load_acquire(&osfs_inode->i_flags) & OSFS_INLINE_DATA_FL;
+}
+
+/**
+ * Function: osfs_is_compressed
+ * Description: Tests whether a file's extents hold compressed clusters. A
+ *              file only becomes compressed under an exclusive i_rwsem, so
+ *              a false answer read under i_rwsem is stable; a true one is
+ *              checked again under invalidate_lock. An expanded file's tree
+ *              is complete before the flag clears, so it can be walked
+ *              after a false answer.
+ */
+static inline bool osfs_is_compressed(const struct osfs_inode *osfs_inode)
+{
+    // Pairs with the release in osfs_compress_swap
+    return smp_load_acquire(&osfs_inode->i_flags) & OSFS_COMPRESSED_FL;
+}
+
+/**
+ * Struct: osfs_inode_info
+ * Description: In-memory state of a cached inode, wrapping the VFS inode.
+ *
+ * Locking: i_rwsem of the VFS inode guards a file's data, size and extent
+ * tree; readers take it shared and never wait on each other. Extent tree
+ * changes of a regular file additionally take the mapping's
+ * invalidate_lock, which page faults hold shared instead of i_rwsem.
+ * For a directory, i_rwsem held by the VFS guards its entries: lookup and
+ * readdir run shared, create runs exclusive.
+ */
+struct osfs_inode_info {
+    struct osfs_dir_index *i_dir_index;  // Name index of a directory, built on first search
+    struct mutex i_dir_index_lock;       // Serializes building the name index under a shared i_rwsem
+    struct xarray i_delalloc;            // Pages of written blocks not placed yet, by logical block
+    uint32_t i_delalloc_count;           // Number of pages in i_delalloc, each holding a reserved block
+    unsigned long i_state;               // OSFS_I_* bits
+    struct work_struct i_compress_work;  // Compresses the file once its last writer has closed it
+    struct inode vfs_inode;
+};
+
+#define OSFS_I_MMAP_WRITE 0      // A shared writable mapping may have stored to the blocks
+
+static inline struct osfs_inode_info *OSFS_I(struct inode *inode)
+{
+    return container_of(inode, struct osfs_inode_info, vfs_inode);
+}
+
+/**
+ * Function: osfs_rec_len
+ * Description: Returns the length of a directory record.
+ */
+static inline uint32_t osfs_rec_len(const struct osfs_dir_entry *de)
+{
+    return de->rec_len == OSFS_MAX_REC_LEN ? 1U << 16 : de->rec_len;
+}
+
+/**
+ * Function: osfs_set_rec_len
+ * Description: Sets the length of a directory record.
+ */
+static inline void osfs_set_rec_len(struct osfs_dir_entry *de, uint32_t len)
+{
+    de->rec_len = len >= (1U << 16) ? OSFS_MAX_REC_LEN : len;
+}
+
+/**
+ * Function: osfs_block_addr
+ * Description: Returns the kernel address of an allocated data block.
+ *              Only the blocks up to the end of the block's chunk are
+ *              guaranteed to follow it in memory; see osfs_chunk_blocks_left.
+ */
+static inline void *osfs_block_addr(struct osfs_sb_info *sb_info, uint32_t block)
+{
+    uint32_t chunk_mask = (1U << sb_info->chunk_bits) - 1;
+
+    return (char *)sb_info->chunks[block >> sb_info->chunk_bits] +
+           ((size_t)(block & chunk_mask) << sb_info->block_bits);
+}
+
+/**
+ * Function: osfs_chunk_bytes
+ * Description: Returns the size of a chunk; the last one may be partial.
+ */
+static inline size_t osfs_chunk_bytes(struct osfs_sb_info *sb_info, uint32_t chunk)
+{
+    uint32_t first = chunk << sb_info->chunk_bits;
+    uint32_t blocks = min(1U << sb_info->chunk_bits, sb_info->block_count - first);
+
+    return (size_t)blocks << sb_info->block_bits;
+}
+
+/**
+ * Function: osfs_chunk_blocks_left
+ * Description: Returns how many blocks, starting at block, are contiguous in memory.
+ */
+static inline uint32_t osfs_chunk_blocks_left(struct osfs_sb_info *sb_info, uint32_t block)
+{
+    return (1U << sb_info->chunk_bits) - (block & ((1U << sb_info->chunk_bits) - 1));
+}
+
 struct inode *osfs_iget(struct super_block *sb, unsigned long ino);
 struct osfs_inode *osfs_get_osfs_inode(struct super_block *sb, uint32_t ino);
 int osfs_get_free_inode(struct osfs_sb_info *sb_info);
+void osfs_put_free_inode(struct osfs_sb_info *sb_info, uint32_t ino);
+int osfs_init_inode_pools(struct osfs_sb_info *sb_info);
+bool osfs_drain_inode_pools(struct osfs_sb_info *sb_info);
+void osfs_destroy_inode_pools(struct osfs_sb_info *sb_info);
 int osfs_alloc_extent(struct osfs_sb_info *sb_info, uint32_t needed_blocks, 
                      struct osfs_extent *extent);//分配連續區塊
+int osfs_alloc_blocks(struct osfs_sb_info *sb_info, uint32_t goal,
+                      uint32_t needed_blocks, struct osfs_extent *extent);
 void osfs_free_extent(struct osfs_sb_info *sb_info, struct osfs_extent *extent);//釋放連續區塊
-int osfs_fill_super(struct super_block *sb, void *data, int silent);
+void osfs_release_deferred_blocks(struct osfs_sb_info *sb_info);
+void osfs_mark_dirty(struct osfs_sb_info *sb_info, uint32_t start, uint32_t count);
+void osfs_mmap_mark_dirty(struct inode *inode);
+int osfs_reserve_blocks(struct osfs_sb_info *sb_info, uint32_t count);
+void osfs_free_space_stats(struct osfs_sb_info *sb_info, uint32_t *runs, uint32_t *largest);
+long osfs_ioc_defrag(struct file *filp, struct osfs_defrag_report __user *arg);
+void osfs_reserve_blocks_nofail(struct osfs_sb_info *sb_info, uint32_t count);
+void osfs_unreserve_blocks(struct osfs_sb_info *sb_info, uint32_t count);
+void osfs_free_chunks(struct osfs_sb_info *sb_info);
+int osfs_init_block_pools(struct osfs_sb_info *sb_info);
+bool osfs_drain_block_pools(struct osfs_sb_info *sb_info);
+void osfs_destroy_block_pools(struct osfs_sb_info *sb_info);
+int osfs_fill_super(struct super_block *sb, struct fs_context *fc);
+int osfs_init_fs_context(struct fs_context *fc);
+void osfs_put_sb_info(struct osfs_sb_info *sb_info);
+struct file *osfs_image_open(struct osfs_mount_opts *opts, bool *loaded);
+int osfs_image_probe_bdev(struct super_block *sb, struct osfs_mount_opts *opts, bool *loaded);
+int osfs_image_attach(struct super_block *sb, bool loaded);
+int osfs_image_save(struct super_block *sb);
+int osfs_image_mark_unclean(struct super_block *sb);
+int osfs_image_rw(struct super_block *sb, struct file *image,
+                  void *buf, size_t len, loff_t pos, bool write);
+int osfs_image_flush(struct super_block *sb, struct file *image);
+struct bio *osfs_image_bio_add(struct super_block *sb, struct bio *bio,
+                               void *buf, size_t len, loff_t pos, bool write);
+int osfs_image_data(struct super_block *sb, struct file *image,
+                    const struct osfs_image_header *hdr, const unsigned long *map, bool write);
+void osfs_image_regions(struct osfs_sb_info *sb_info, const struct osfs_image_header *hdr,
+                        void *buf);
+int osfs_dax_open(struct super_block *sb);
+int osfs_dax_map(struct super_block *sb, uint64_t data_off);
+void osfs_dax_close(struct osfs_sb_info *sb_info);
+vm_fault_t osfs_dax_fault(struct vm_fault *vmf, void *addr);
+int osfs_dax_alloc(struct inode *inode, loff_t pos, size_t len, struct osfs_extent *extent);
+int osfs_dax_flush_file(struct inode *inode, loff_t start, loff_t end);
+int osfs_journal_replay(struct super_block *sb, struct file *image,
+                        struct osfs_image_header *hdr);
+int osfs_journal_prepare(struct osfs_sb_info *sb_info, struct osfs_save *save);
+int osfs_journal_commit(struct super_block *sb, struct file *image, struct osfs_save *save);
+int osfs_journal_checkpoint(struct super_block *sb, struct file *image,
+                            const struct osfs_image_header *hdr, void *tx, uint64_t nblocks);
+void osfs_journal_adopt(struct osfs_sb_info *sb_info, struct osfs_save *save);
+void osfs_journal_free_save(struct osfs_save *save);
+void osfs_journal_snapshot(struct osfs_sb_info *sb_info, const struct osfs_image_header *hdr);
+void osfs_journal_destroy(struct osfs_sb_info *sb_info);
 struct inode *osfs_new_inode(const struct inode *dir, umode_t mode);
-void osfs_destroy_inode(struct inode *inode);
+void *osfs_map_pos(struct inode *inode, loff_t pos,
+                   struct osfs_extent_cursor *cursor, size_t *contig);
+const struct osfs_extent *osfs_lookup_extent(struct inode *inode, uint32_t lblk,
+                                             struct osfs_extent_cursor *cursor,
+                                             uint32_t *next_lblk);
+int osfs_insert_extent(struct inode *inode, const struct osfs_extent *extent);
+int osfs_alloc_file_blocks(struct inode *inode, uint32_t lblk, uint32_t count,
+                           struct osfs_extent *extent);
+int osfs_truncate_extents(struct inode *inode, uint32_t lblk);
+void osfs_free_extents(struct inode *inode);
+void osfs_ext_mark_meta(struct osfs_sb_info *sb_info, struct osfs_inode *osfs_inode,
+                        unsigned long *map);
+int osfs_ext_check(struct osfs_sb_info *sb_info, struct osfs_inode *osfs_inode,
+                   unsigned long *seen);
+void osfs_init_extent_root(struct osfs_inode *osfs_inode);
+void osfs_init_inline_data(struct osfs_inode *osfs_inode);
+ssize_t osfs_inline_get(struct inode *inode, loff_t pos, void *buf, size_t len);
+ssize_t osfs_inline_put(struct inode *inode, loff_t pos, const void *buf, size_t len);
+int osfs_inline_convert(struct inode *inode);
+void *osfs_compress_map(struct inode *inode, loff_t pos, struct osfs_cluster **cluster,
+                        size_t *contig);
+void osfs_cluster_put(struct osfs_cluster *cluster);
+int osfs_compress_file(struct inode *inode);
+void osfs_compress_work(struct work_struct *work);
+void osfs_compress_schedule(struct inode *inode);
+int osfs_compress_expand(struct inode *inode);
+void osfs_compress_forget(struct inode *inode);
+int osfs_compress_init(struct osfs_sb_info *sb_info);
+void osfs_compress_destroy(struct osfs_sb_info *sb_info);
+int osfs_fileattr_get(struct dentry *dentry, struct fileattr *fa);
+int osfs_fileattr_set(struct mnt_idmap *idmap, struct dentry *dentry, struct fileattr *fa);
+void *osfs_delalloc_block(struct inode *inode, uint32_t lblk, bool nowait);
+void *osfs_delalloc_lookup(struct inode *inode, uint32_t lblk, uint32_t *next_lblk);
+int osfs_delalloc_flush(struct inode *inode, bool prealloc);
+void osfs_delalloc_drop(struct inode *inode);
+void osfs_evict_inode(struct inode *inode);
+int osfs_init_inodecache(void);
+void osfs_destroy_inodecache(void);
+void osfs_sync_inode(struct inode *inode);
+uint32_t osfs_dirhash_name(const char *name, size_t name_len);
+struct osfs_dir_index *osfs_dirhash_create(void);
+struct hlist_head *osfs_dirhash_bucket(struct osfs_dir_index *index, uint32_t hash);
+int osfs_dirhash_add(struct osfs_dir_index *index, uint32_t hash, uint32_t pos);
+void osfs_dirhash_del(struct osfs_dir_index *index, uint32_t hash, uint32_t pos);
+int osfs_dirhash_set_free(struct osfs_dir_index *index, uint32_t lblk, uint32_t free);
+uint32_t osfs_dirhash_find_space(struct osfs_dir_index *index, uint32_t needed);
+void osfs_dirhash_free(struct osfs_dir_index *index);
 // External Operations Structures
 
 extern const struct inode_operations osfs_file_inode_operations;
@@ -95,5 +598,6 @@ extern const struct file_operations osfs_file_operations;
 extern const struct inode_operations osfs_dir_inode_operations;
 extern const struct file_operations osfs_dir_operations;
 extern const struct super_operations osfs_super_ops;
+extern const struct fs_parameter_spec osfs_fs_parameters[];
 
 #endif /* _osfs_H */
@@ -2,22 +2,6 @@
 #include <linux/module.h>
 #include "osfs.h"
 
-/**
- * Function: osfs_mount
- * Description: Mounts the osfs filesystem.
- * Inputs:
- *   - fs_type: The file system type structure.
- *   - flags: Mount flags.
- *   - dev_name: Device name (not used in nodev filesystem).
- *   - data: Data passed during mount.
- * Returns:
- *   - A dentry pointer to the root of the mounted filesystem.
- */
-static struct dentry *osfs_mount(struct file_system_type *fs_type,
-                                 int flags,
-                                 const char *dev_name,
-                                 void *data);
-
 /**
  * Function: osfs_kill_superblock
  * Description: Cleans up and releases the superblock of the filesystem.
@@ -35,7 +19,8 @@ static void osfs_kill_superblock(struct super_block *sb);
 struct file_system_type osfs_type = {
     .owner = THIS_MODULE,
     .name = "osfs",
-    .mount = osfs_mount,
+    .init_fs_context = osfs_init_fs_context,
+    .parameters = osfs_fs_parameters,
     .kill_sb = osfs_kill_superblock,
     .fs_flags = FS_USERNS_MOUNT,
 };
@@ -53,9 +38,16 @@ static int __init osfs_init(void)
 {
     int ret;
 
+    ret = osfs_init_inodecache();
+    if (ret) {
+        pr_err("Failed to create inode cache\n");
+        return ret;
+    }
+
     ret = register_filesystem(&osfs_type);
     if (ret) {
         pr_err("Failed to register filesystem\n");
+        osfs_destroy_inodecache();
         return ret;
     }
 
@@ -80,25 +72,7 @@ static void __exit osfs_exit(void)
         pr_err("Failed to unregister filesystem\n");
     else
         pr_info("osfs: Successfully unregistered\n");
-}
-
-/**
- * Function: osfs_mount
- * Description: Handles the mounting of the osfs filesystem.
- * Inputs:
- *   - fs_type: The file system type structure.
- *   - flags: Mount flags.
- *   - dev_name: Device name (not used in nodev filesystem).
- *   - data: Data passed during mount.
- * Returns:
- *   - A dentry pointer to the root of the mounted filesystem.
- */
-static struct dentry *osfs_mount(struct file_system_type *fs_type,
-                                 int flags,
-                                 const char *dev_name,
-                                 void *data)
-{
-    return mount_nodev(fs_type, flags, data, osfs_fill_super);
+    osfs_destroy_inodecache();
 }
 
 /**
@@ -115,10 +89,22 @@ static void osfs_kill_superblock(struct super_block *sb)
 
     pr_info("osfs_kill_superblock: Unmounting file system\n");
 
+    // Evict the remaining inodes while their extents can still be released;
+    // a mounted device is saved to and released here too
+    if (sb_info) {
+        sb_info->unmounting = true;
+        // Queued compressions hold inode references; let them finish first
+        flush_workqueue(sb_info->compress_wq);
+    }
+    if (sb->s_bdev)
+        kill_block_super(sb);
+    else
+        kill_anon_super(sb);
+
     if (sb_info) {
         pr_info("osfs_kill_superblock: free blcok \n");
 
-        vfree(sb_info);
+        osfs_put_sb_info(sb_info);
         sb->s_fs_info = NULL;
     }
 
@@ -0,0 +1,435 @@
+// stress_mt: multi-threaded stress and scaling test.
+//
+// Usage: stress_mt [-t max_threads] [-s seconds] directory
+//
+// For 1, 2, 4 ... max_threads threads (the number of CPUs by default)
+// it runs two workloads for the given time (3 seconds) each:
+//
+//   - write: every thread creates files in one shared directory, writes
+//     and appends a pattern of its own, reads the file back to check it
+//     and unlinks its previous file, so creates, lookups, allocation and
+//     frees of all threads race on the same directory and allocator.
+//   - read: every thread preads random blocks of one shared file and
+//     checks them; parallel readers should never serialize.
+//   - copy: every thread writes a file of its own in one go, so that
+//     more blocks are pending than osfs lets a writer keep (1024), and
+//     copies it with copy_file_range to its own end before checking both
+//     halves. The copy has to place the pending blocks it reads from.
+//
+// Any mismatch or error stops the test with a failure exit. The ops per
+// second of each run and their speedup over one thread show how well the
+// locking scales:
+//
+//   sudo mount -t osfs -o size=1G none mnt/ && ./stress_mt mnt/s
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define STRESS_DEFAULT_SECONDS 3
+#define STRESS_MAX_WRITE (64 << 10)        // Largest first write of a file
+#define STRESS_BLOCK 4096                  // Read size of the read workload
+#define STRESS_SHARED_SIZE (16 << 20)      // Size of the file the readers share
+#define STRESS_COPY_SIZE (1040 * 4096)     // Size of a copied file, past OSFS_DELALLOC_MAX_BLOCKS
+
+/**
+ * Struct: stress_thread
+ * Description: State of one worker thread.
+ */
+struct stress_thread {
+    pthread_t thread;
+    unsigned int id;
+    uint64_t ops;
+    int fd;                        // Shared file of the read workload, -1 if not open
+    unsigned char *buf;            // File contents of the copy workload, NULL until needed
+    int failed;
+};
+
+static const char *stress_dir;
+static atomic_int stress_stop;
+static int (*stress_work)(struct stress_thread *t, uint64_t n, unsigned int *seed);
+
+/**
+ * Function: usage
+ * Description: Prints how to run the tool and exits with failure.
+ */
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-t max_threads] [-s seconds] directory\n", prog);
+    exit(1);
+}
+
+/**
+ * Function: pattern
+ * Description: Fills buf with the bytes a file of owner key holds at off.
+ */
+static void pattern(unsigned char *buf, size_t len, uint64_t key, uint64_t off)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++)
+        buf[i] = (unsigned char)((off + i) * 131 + key * 17 + ((off + i) >> 12));
+}
+
+/**
+ * Function: check
+ * Description: Reads len bytes at off and compares them with the pattern
+ *              a file of owner key holds at from.
+ * Returns:
+ *   - 0 if they match, -1 after printing what went wrong.
+ */
+static int check(int fd, const char *path, uint64_t key, uint64_t off, uint64_t from,
+                 size_t len)
+{
+    unsigned char want[STRESS_BLOCK], got[STRESS_BLOCK];
+    size_t done, n;
+
+    for (done = 0; done < len; done += n) {
+        n = len - done < STRESS_BLOCK ? len - done : STRESS_BLOCK;
+        if (pread(fd, got, n, off + done) != (ssize_t)n) {
+            fprintf(stderr, "%s: short read at %llu\n", path,
+                    (unsigned long long)(off + done));
+            return -1;
+        }
+        pattern(want, n, key, from + done);
+        if (memcmp(want, got, n)) {
+            fprintf(stderr, "%s: wrong data at %llu\n", path,
+                    (unsigned long long)(off + done));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Function: write_one
+ * Description: One step of the write workload: creates file n of the
+ *              thread, writes and appends to it, checks it and unlinks
+ *              the file of the previous step.
+ * Returns:
+ *   - 0 on success, -1 on any error or mismatch.
+ */
+static int write_one(struct stress_thread *t, uint64_t n, unsigned int *seed)
+{
+    static __thread unsigned char buf[STRESS_MAX_WRITE];
+    uint64_t key = (uint64_t)t->id << 32 | (uint32_t)n;
+    size_t first = rand_r(seed) % STRESS_MAX_WRITE + 1, second = rand_r(seed) % STRESS_BLOCK + 1;
+    char path[4096];
+    struct stat st;
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/t%u.%llu", stress_dir, t->id, (unsigned long long)n);
+    fd = open(path, O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd < 0)
+        goto fail;
+    pattern(buf, first, key, 0);
+    if (write(fd, buf, first) != (ssize_t)first)
+        goto fail_close;
+    pattern(buf, second, key, first);
+    if (pwrite(fd, buf, second, first) != (ssize_t)second)
+        goto fail_close;
+    if (fstat(fd, &st) < 0 || st.st_size != (off_t)(first + second)) {
+        fprintf(stderr, "%s: wrong size\n", path);
+        close(fd);
+        return -1;
+    }
+    if (check(fd, path, key, 0, 0, first + second)) {
+        close(fd);
+        return -1;
+    }
+    close(fd);
+
+    if (n) {
+        snprintf(path, sizeof(path), "%s/t%u.%llu", stress_dir, t->id,
+                 (unsigned long long)n - 1);
+        if (unlink(path) < 0)
+            goto fail;
+    }
+    return 0;
+
+fail_close:
+    close(fd);
+fail:
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    return -1;
+}
+
+/**
+ * Function: read_one
+ * Description: One step of the read workload: checks a random block of
+ *              the shared file.
+ * Returns:
+ *   - 0 on success, -1 on any error or mismatch.
+ */
+static int read_one(struct stress_thread *t, uint64_t n, unsigned int *seed)
+{
+    char path[4096];
+    uint64_t off;
+
+    (void)n;
+    snprintf(path, sizeof(path), "%s/shared", stress_dir);
+    if (t->fd < 0) {
+        t->fd = open(path, O_RDONLY);
+        if (t->fd < 0) {
+            perror(path);
+            return -1;
+        }
+    }
+    off = (uint64_t)(rand_r(seed) % (STRESS_SHARED_SIZE / STRESS_BLOCK)) * STRESS_BLOCK;
+    return check(t->fd, path, 0, off, off, STRESS_BLOCK);
+}
+
+/**
+ * Function: copy_one
+ * Description: One step of the copy workload: writes file n of the thread
+ *              with a single write, appends a copy of it to itself with
+ *              copy_file_range, checks both halves and unlinks the file.
+ * Returns:
+ *   - 0 on success, -1 on any error or mismatch.
+ */
+static int copy_one(struct stress_thread *t, uint64_t n, unsigned int *seed)
+{
+    uint64_t key = (uint64_t)t->id << 32 | (uint32_t)n;
+    loff_t in = 0, out = STRESS_COPY_SIZE;
+    char path[4096];
+    ssize_t ret;
+    int fd;
+
+    (void)seed;
+    if (!t->buf) {
+        t->buf = malloc(STRESS_COPY_SIZE);
+        if (!t->buf) {
+            perror("malloc");
+            return -1;
+        }
+    }
+    snprintf(path, sizeof(path), "%s/c%u.%llu", stress_dir, t->id, (unsigned long long)n);
+    fd = open(path, O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd < 0)
+        goto fail;
+    pattern(t->buf, STRESS_COPY_SIZE, key, 0);
+    if (write(fd, t->buf, STRESS_COPY_SIZE) != STRESS_COPY_SIZE)
+        goto fail_close;
+    while (in < STRESS_COPY_SIZE) {
+        ret = copy_file_range(fd, &in, fd, &out, STRESS_COPY_SIZE - in, 0);
+        if (ret <= 0) {
+            if (!ret)
+                errno = EIO;
+            goto fail_close;
+        }
+    }
+    if (check(fd, path, key, 0, 0, STRESS_COPY_SIZE) ||
+        check(fd, path, key, STRESS_COPY_SIZE, 0, STRESS_COPY_SIZE)) {
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    if (unlink(path) < 0)
+        goto fail;
+    return 0;
+
+fail_close:
+    close(fd);
+fail:
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    return -1;
+}
+
+/**
+ * Function: worker
+ * Description: Runs the current workload until told to stop.
+ */
+static void *worker(void *arg)
+{
+    struct stress_thread *t = arg;
+    unsigned int seed = t->id * 2654435761U + 1;
+
+    while (!atomic_load_explicit(&stress_stop, memory_order_relaxed)) {
+        if (stress_work(t, t->ops, &seed)) {
+            t->failed = 1;
+            atomic_store(&stress_stop, 1);
+            break;
+        }
+        t->ops++;
+    }
+    return NULL;
+}
+
+/**
+ * Function: cleanup
+ * Description: Closes and frees what a thread kept and removes the files
+ *              the write and copy workloads left: the last one written
+ *              and the one the thread failed on, if any.
+ */
+static void cleanup(struct stress_thread *t)
+{
+    char path[4096];
+
+    if (t->fd >= 0)
+        close(t->fd);
+    free(t->buf);
+    if (stress_work == copy_one) {
+        snprintf(path, sizeof(path), "%s/c%u.%llu", stress_dir, t->id,
+                 (unsigned long long)t->ops);
+        unlink(path);
+    }
+    if (stress_work != write_one)
+        return;
+    snprintf(path, sizeof(path), "%s/t%u.%llu", stress_dir, t->id, (unsigned long long)t->ops);
+    unlink(path);
+    if (t->ops) {
+        snprintf(path, sizeof(path), "%s/t%u.%llu", stress_dir, t->id,
+                 (unsigned long long)t->ops - 1);
+        unlink(path);
+    }
+}
+
+/**
+ * Function: run
+ * Description: Runs one workload on nr threads for the given time.
+ * Returns:
+ *   - Operations per second, or a negative value if any thread failed.
+ */
+static double run(int (*work)(struct stress_thread *, uint64_t, unsigned int *),
+                  unsigned int nr, unsigned int seconds)
+{
+    struct stress_thread *threads = calloc(nr, sizeof(*threads));
+    struct timespec start, end;
+    uint64_t ops = 0;
+    unsigned int i;
+    int failed = 0;
+    double elapsed;
+
+    if (!threads) {
+        perror("calloc");
+        return -1;
+    }
+    stress_work = work;
+    atomic_store(&stress_stop, 0);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < nr; i++) {
+        threads[i].id = i;
+        threads[i].fd = -1;
+        if (pthread_create(&threads[i].thread, NULL, worker, &threads[i])) {
+            fprintf(stderr, "pthread_create failed\n");
+            exit(1);
+        }
+    }
+    sleep(seconds);
+    atomic_store(&stress_stop, 1);
+    for (i = 0; i < nr; i++) {
+        pthread_join(threads[i].thread, NULL);
+        ops += threads[i].ops;
+        failed |= threads[i].failed;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    for (i = 0; i < nr; i++)
+        cleanup(&threads[i]);
+    free(threads);
+
+    elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    return failed ? -1 : ops / elapsed;
+}
+
+/**
+ * Function: make_shared
+ * Description: Writes the file the read workload checks.
+ * Returns:
+ *   - 0 on success, -1 on error.
+ */
+static int make_shared(void)
+{
+    static unsigned char buf[STRESS_BLOCK];
+    char path[4096];
+    uint64_t off;
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/shared", stress_dir);
+    fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+    for (off = 0; off < STRESS_SHARED_SIZE; off += STRESS_BLOCK) {
+        pattern(buf, STRESS_BLOCK, 0, off);
+        if (write(fd, buf, STRESS_BLOCK) != STRESS_BLOCK) {
+            perror(path);
+            close(fd);
+            return -1;
+        }
+    }
+    close(fd);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int max_threads = sysconf(_SC_NPROCESSORS_ONLN), seconds = STRESS_DEFAULT_SECONDS;
+    static const struct {
+        const char *name;
+        int (*work)(struct stress_thread *, uint64_t, unsigned int *);
+    } workloads[] = {
+        { "write", write_one },
+        { "read", read_one },
+        { "copy", copy_one },
+    };
+    char path[4096];
+    unsigned int w, nr;
+    double base, rate;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:s:")) != -1) {
+        switch (opt) {
+        case 't':
+            max_threads = strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            seconds = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1 || !max_threads || !seconds)
+        usage(argv[0]);
+    stress_dir = argv[optind];
+
+    if (mkdir(stress_dir, 0755) < 0 && errno != EEXIST) {
+        perror(stress_dir);
+        return 1;
+    }
+    if (make_shared())
+        return 1;
+
+    printf("%-6s %8s %12s %8s\n", "load", "threads", "ops/s", "speedup");
+    for (w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++) {
+        base = 0;
+        for (nr = 1;; nr = nr * 2 < max_threads ? nr * 2 : max_threads) {
+            rate = run(workloads[w].work, nr, seconds);
+            if (rate < 0) {
+                fprintf(stderr, "%s: %s workload failed with %u threads\n", stress_dir,
+                        workloads[w].name, nr);
+                return 1;
+            }
+            if (!base)
+                base = rate;
+            printf("%-6s %8u %12.0f %8.2f\n", workloads[w].name, nr, rate, rate / base);
+            if (nr == max_threads)
+                break;
+        }
+    }
+
+    snprintf(path, sizeof(path), "%s/shared", stress_dir);
+    unlink(path);
+    rmdir(stress_dir);
+    return 0;
+}
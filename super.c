@@ -1,99 +1,394 @@
 #include <linux/fs.h>
 #include <linux/pagemap.h>
 #include <linux/slab.h>
+#include <linux/seq_file.h>
+#include <linux/fs_parser.h>
+#include <linux/log2.h>
+#include <linux/blkdev.h>
+#include <linux/mm.h>
 #include "osfs.h"
 
+static int osfs_show_options(struct seq_file *m, struct dentry *root);
+static int osfs_statfs(struct dentry *dentry, struct kstatfs *buf);
+static int osfs_sync_fs(struct super_block *sb, int wait);
+static struct inode *osfs_alloc_inode(struct super_block *sb);
+static void osfs_free_inode(struct inode *inode);
+
+static struct kmem_cache *osfs_inode_cachep;
+
 /**
  * Struct: osfs_super_ops
  * Description: Defines the superblock operations for the osfs filesystem.
  */
 const struct super_operations osfs_super_ops = {
-    .statfs = simple_statfs,            // Provides filesystem statistics
-    .drop_inode = generic_delete_inode, // Generic inode deletion
-    .destroy_inode = osfs_destroy_inode,
-
+    .statfs = osfs_statfs,              // Provides filesystem statistics
+    .alloc_inode = osfs_alloc_inode,
+    .free_inode = osfs_free_inode,
+    .evict_inode = osfs_evict_inode,
+    .show_options = osfs_show_options,
+    .sync_fs = osfs_sync_fs,            // Saves the backing image, if any
 };
 
-void osfs_destroy_inode(struct inode *inode)
+/**
+ * Function: osfs_inode_init_once
+ * Description: Sets up the parts of an osfs_inode_info that survive reuse
+ *              of its slab object.
+ */
+static void osfs_inode_init_once(void *obj)
 {
-    if (inode->i_private) {
-        struct osfs_inode *osfs_inode = inode->i_private;
-        struct osfs_sb_info *sb_info = inode->i_sb->s_fs_info;
-        
-        // 釋放所有的 extents
-        for (int i = 0; i < osfs_inode->i_extent_count; i++) {
-            osfs_free_extent(sb_info, &osfs_inode->i_extents[i]);
-        }
-        inode->i_private = NULL;
+    struct osfs_inode_info *info = obj;
+
+    mutex_init(&info->i_dir_index_lock);
+    xa_init(&info->i_delalloc);
+    INIT_WORK(&info->i_compress_work, osfs_compress_work);
+    inode_init_once(&info->vfs_inode);
+}
+
+/**
+ * Function: osfs_init_inodecache
+ * Description: Creates the slab cache for in-memory inodes at module load.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOMEM if the cache cannot be created.
+ */
+int osfs_init_inodecache(void)
+{
+    osfs_inode_cachep = kmem_cache_create("osfs_inode_cache", sizeof(struct osfs_inode_info),
+                                          0, SLAB_RECLAIM_ACCOUNT | SLAB_ACCOUNT,
+                                          osfs_inode_init_once);
+    return osfs_inode_cachep ? 0 : -ENOMEM;
+}
+
+/**
+ * Function: osfs_destroy_inodecache
+ * Description: Destroys the inode slab cache at module unload.
+ */
+void osfs_destroy_inodecache(void)
+{
+    // Inodes are freed after an RCU grace period
+    rcu_barrier();
+    kmem_cache_destroy(osfs_inode_cachep);
+}
+
+/**
+ * Function: osfs_alloc_inode
+ * Description: Allocates a VFS inode inside its osfs_inode_info.
+ */
+static struct inode *osfs_alloc_inode(struct super_block *sb)
+{
+    struct osfs_inode_info *info;
+
+    info = alloc_inode_sb(sb, osfs_inode_cachep, GFP_KERNEL);
+    if (!info)
+        return NULL;
+    info->i_dir_index = NULL;
+    info->i_delalloc_count = 0;
+    info->i_state = 0;
+    return &info->vfs_inode;
+}
+
+/**
+ * Function: osfs_free_inode
+ * Description: Returns an inode to the slab cache.
+ */
+static void osfs_free_inode(struct inode *inode)
+{
+    kmem_cache_free(osfs_inode_cachep, OSFS_I(inode));
+}
+
+/**
+ * Function: osfs_evict_inode
+ * Description: Drops a VFS inode from the inode cache. Its attributes go
+ *              back to the inode table; once the last link is gone its
+ *              blocks and inode number are freed as well.
+ * Inputs:
+ *   - inode: The inode being evicted.
+ * Returns:
+ *   - None.
+ */
+void osfs_evict_inode(struct inode *inode)
+{
+    struct osfs_sb_info *sb_info = inode->i_sb->s_fs_info;
+    struct osfs_inode *osfs_inode = inode->i_private;
+
+    truncate_inode_pages_final(&inode->i_data);
+    clear_inode(inode);
+    if (!osfs_inode)
+        return;
+
+    // The name index is rebuilt from the entries on the next search
+    osfs_dirhash_free(OSFS_I(inode)->i_dir_index);
+    OSFS_I(inode)->i_dir_index = NULL;
+
+    // Pending data is placed on close; this only retries a failed placement
+    if (inode->i_nlink && osfs_delalloc_flush(inode, false))
+        pr_err("osfs: Lost unplaced data of inode %lu\n", inode->i_ino);
+    osfs_delalloc_drop(inode);
+    osfs_compress_forget(inode);
+
+    if (inode->i_nlink) {
+        osfs_mmap_mark_dirty(inode);
+        osfs_sync_inode(inode);
+        return;
     }
+
+    // 釋放所有的 extents
+    osfs_free_extents(inode);
+    osfs_put_free_inode(sb_info, inode->i_ino);
 }
 
 
 /**
- * Function: osfs_fill_super
- * Description: Initializes the superblock with filesystem-specific information during mount.
+ * Function: osfs_statfs
+ * Description: Reports block and inode usage, summing the per-CPU free
+ *              counters.
  * Inputs:
- *   - sb: The superblock to be filled.
- *   - data: Data passed during mount.
- *   - silent: If non-zero, suppress certain error messages.
+ *   - dentry: Any dentry of the filesystem.
+ *   - buf: The statistics to fill in.
  * Returns:
- *   - 0 on successful initialization.
- *   - A negative error code on failure.
+ *   - 0.
  */
-int osfs_fill_super(struct super_block *sb, void *data, int silent)
+static int osfs_statfs(struct dentry *dentry, struct kstatfs *buf)
 {
-    pr_info("osfs: Filling super start\n");
-    struct inode *root_inode;
-    struct osfs_sb_info *sb_info;
-    void *memory_region;
-    size_t total_memory_size;
-    int ret;
+    struct osfs_sb_info *sb_info = dentry->d_sb->s_fs_info;
 
-    // Calculate total memory size required
-    total_memory_size = sizeof(struct osfs_sb_info) +
-                       INODE_BITMAP_SIZE * sizeof(unsigned long) +
-                       BLOCK_BITMAP_SIZE * sizeof(unsigned long) +
-                       INODE_COUNT * sizeof(struct osfs_inode) +
-                       DATA_BLOCK_COUNT * BLOCK_SIZE;
+    buf->f_type = dentry->d_sb->s_magic;
+    buf->f_bsize = sb_info->block_size;
+    buf->f_blocks = sb_info->block_count;
+    buf->f_bfree = percpu_counter_sum_positive(&sb_info->free_blocks);
+    buf->f_bavail = buf->f_bfree;
+    buf->f_files = sb_info->inode_count - 1;   // Inode 0 is never used
+    buf->f_ffree = percpu_counter_sum_positive(&sb_info->free_inodes);
+    buf->f_namelen = MAX_FILENAME_LEN;
+    return 0;
+}
+
+/**
+ * Function: osfs_sync_fs
+ * Description: Saves the filesystem to its backing image. sync and unmount
+ *              call this twice; the image is written on the waiting pass.
+ * Inputs:
+ *   - sb: The superblock of the filesystem.
+ *   - wait: Nonzero on the pass that must finish the work.
+ * Returns:
+ *   - 0 on success or when there is no image.
+ *   - A negative error code if the image cannot be saved.
+ */
+static int osfs_sync_fs(struct super_block *sb, int wait)
+{
+    if (!wait)
+        return 0;
+    return osfs_image_save(sb);
+}
+
+/**
+ * Function: osfs_show_options
+ * Description: Reports the mount geometry in /proc/mounts.
+ * Inputs:
+ *   - m: The seq_file to print into.
+ *   - root: The root dentry of the mount.
+ * Returns:
+ *   - 0.
+ */
+static int osfs_show_options(struct seq_file *m, struct dentry *root)
+{
+    struct osfs_sb_info *sb_info = root->d_sb->s_fs_info;
+
+    seq_printf(m, ",size=%llu,inodes=%u,block_size=%u",
+               (unsigned long long)sb_info->block_count << sb_info->block_bits,
+               sb_info->inode_count, sb_info->block_size);
+    if (sb_info->image) {
+        seq_puts(m, ",image=");
+        seq_file_path(m, sb_info->image, ", \t\n\\");
+    }
+    if (sb_info->dax_dev)
+        seq_puts(m, ",dax");
+    if (sb_info->compress)
+        seq_puts(m, ",compress");
+    return 0;
+}
+
+enum {
+    Opt_size,
+    Opt_inodes,
+    Opt_block_size,
+    Opt_image,
+    Opt_dax,
+    Opt_compress,
+};
+
+const struct fs_parameter_spec osfs_fs_parameters[] = {
+    fsparam_string("size", Opt_size),
+    fsparam_u32("inodes", Opt_inodes),
+    fsparam_u32("block_size", Opt_block_size),
+    fsparam_string("image", Opt_image),
+    fsparam_flag("dax", Opt_dax),
+    fsparam_flag("compress", Opt_compress),
+    {}
+};
+
+/**
+ * Function: osfs_parse_param
+ * Description: Parses one mount option into the fs_context's osfs_mount_opts.
+ * Inputs:
+ *   - fc: The filesystem context being set up.
+ *   - param: The option to parse.
+ * Returns:
+ *   - 0 on success.
+ *   - -EINVAL if the option or its value is invalid.
+ */
+static int osfs_parse_param(struct fs_context *fc, struct fs_parameter *param)
+{
+    struct osfs_mount_opts *opts = fc->fs_private;
+    struct fs_parse_result result;
+    char *rest;
+    int opt;
+
+    opt = fs_parse(fc, osfs_fs_parameters, param, &result);
+    if (opt < 0)
+        return opt;
 
-    // Allocate memory for superblock information and related structures
-    memory_region = vmalloc(total_memory_size);
-    if (!memory_region)
+    switch (opt) {
+    case Opt_size:
+        // Accepts the usual K/M/G suffixes
+        opts->size = memparse(param->string, &rest);
+        if (*rest || !opts->size)
+            return invalfc(fc, "Bad size '%s'", param->string);
+        break;
+    case Opt_inodes:
+        opts->inode_count = result.uint_32;
+        break;
+    case Opt_block_size:
+        opts->block_size = result.uint_32;
+        break;
+    case Opt_image:
+        // Keep the string instead of copying it
+        kfree(opts->image);
+        opts->image = param->string;
+        param->string = NULL;
+        break;
+    case Opt_dax:
+        opts->dax = true;
+        break;
+    case Opt_compress:
+        opts->compress = true;
+        break;
+    }
+    return 0;
+}
+
+/**
+ * Function: osfs_get_tree
+ * Description: Creates the superblock for a new mount. A block device as
+ *              the source keeps the filesystem on that device; anything
+ *              else, e.g. "none", mounts a filesystem in memory.
+ */
+static int osfs_get_tree(struct fs_context *fc)
+{
+    struct osfs_mount_opts *opts = fc->fs_private;
+    dev_t dev;
+
+    // An image, on a device or in a file, is parsed by the kernel, so only
+    // the host admin may mount one, not root in a user namespace
+    if (fc->source && !lookup_bdev(fc->source, &dev)) {
+        if (!capable(CAP_SYS_ADMIN))
+            return -EPERM;
+        return get_tree_bdev(fc, osfs_fill_super);
+    }
+    if (opts->image && !capable(CAP_SYS_ADMIN))
+        return -EPERM;
+    return get_tree_nodev(fc, osfs_fill_super);
+}
+
+/**
+ * Function: osfs_free_fc
+ * Description: Releases the mount options attached to a filesystem context.
+ */
+static void osfs_free_fc(struct fs_context *fc)
+{
+    struct osfs_mount_opts *opts = fc->fs_private;
+
+    if (opts)
+        kfree(opts->image);
+    kfree(opts);
+}
+
+static const struct fs_context_operations osfs_context_ops = {
+    .parse_param = osfs_parse_param,
+    .get_tree = osfs_get_tree,
+    .free = osfs_free_fc,
+};
+
+/**
+ * Function: osfs_init_fs_context
+ * Description: Sets up a filesystem context with the default geometry.
+ * Inputs:
+ *   - fc: The filesystem context to initialize.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOMEM if the options cannot be allocated.
+ */
+int osfs_init_fs_context(struct fs_context *fc)
+{
+    struct osfs_mount_opts *opts;
+
+    opts = kzalloc(sizeof(*opts), GFP_KERNEL);
+    if (!opts)
         return -ENOMEM;
 
-    memset(memory_region, 0, total_memory_size);
+    opts->inode_count = OSFS_DEFAULT_INODE_COUNT;
+    opts->block_size = OSFS_DEFAULT_BLOCK_SIZE;
 
-    // Initialize superblock information
-    sb_info = (struct osfs_sb_info *)memory_region;
-    sb_info->magic = OSFS_MAGIC;
-    sb_info->block_size = BLOCK_SIZE;
-    sb_info->inode_count = INODE_COUNT;
-    sb_info->block_count = DATA_BLOCK_COUNT;
-    sb_info->nr_free_inodes = INODE_COUNT - 1;
-    sb_info->nr_free_blocks = DATA_BLOCK_COUNT;
-
-    // Partition the memory region into respective components
-    sb_info->inode_bitmap = (unsigned long *)(sb_info + 1);
-    sb_info->block_bitmap = sb_info->inode_bitmap + INODE_BITMAP_SIZE;
-    sb_info->inode_table = (void *)(sb_info->block_bitmap + BLOCK_BITMAP_SIZE);
-    sb_info->data_blocks = (void *)((char *)sb_info->inode_table +
-                                   INODE_COUNT * sizeof(struct osfs_inode));
-
-    // Initialize bitmaps
-    memset(sb_info->inode_bitmap, 0, INODE_BITMAP_SIZE * sizeof(unsigned long));
-    memset(sb_info->block_bitmap, 0, BLOCK_BITMAP_SIZE * sizeof(unsigned long));
+    fc->fs_private = opts;
+    fc->ops = &osfs_context_ops;
+    return 0;
+}
 
-    // Set superblock fields
-    sb->s_magic = sb_info->magic;
-    sb->s_fs_info = sb_info;
-    sb->s_op = &osfs_super_ops;
+/**
+ * Function: osfs_put_sb_info
+ * Description: Frees the superblock information and every region it owns.
+ * Inputs:
+ *   - sb_info: The superblock information to free.
+ * Returns:
+ *   - None.
+ */
+void osfs_put_sb_info(struct osfs_sb_info *sb_info)
+{
+    if (sb_info->chunks)
+        osfs_free_chunks(sb_info);
+    osfs_dax_close(sb_info);
+    osfs_destroy_block_pools(sb_info);
+    osfs_destroy_inode_pools(sb_info);
+    percpu_counter_destroy(&sb_info->free_blocks);
+    percpu_counter_destroy(&sb_info->free_inodes);
+    osfs_journal_destroy(sb_info);
+    osfs_compress_destroy(sb_info);
+    kvfree(sb_info->metadata);
+    if (sb_info->image)
+        filp_close(sb_info->image, NULL);
+    kfree(sb_info);
+}
+
+/**
+ * Function: osfs_new_root
+ * Description: Creates the root directory of a new filesystem.
+ * Inputs:
+ *   - sb: The superblock being filled.
+ * Returns:
+ *   - The root inode on success.
+ *   - ERR_PTR(-ENOMEM) if memory allocation fails.
+ *   - ERR_PTR(-EIO) if the root's osfs_inode cannot be retrieved.
+ *   - An ERR_PTR from the allocator if the root's block cannot be allocated.
+ */
+static struct inode *osfs_new_root(struct super_block *sb)
+{
+    struct inode *root_inode;
+    int ret;
 
     // Create root directory inode
     root_inode = new_inode(sb);
-    if (!root_inode) {
-        ret = -ENOMEM;
-        goto out_free;
-    }
+    if (!root_inode)
+        return ERR_PTR(-ENOMEM);
 
     root_inode->i_ino = ROOT_INODE;
     root_inode->i_sb = sb;
@@ -116,40 +411,251 @@ int osfs_fill_super(struct super_block *sb, void *data, int silent)
     root_osfs_inode->i_links_count = 2;
     root_osfs_inode->i_size = 0;
     root_osfs_inode->i_extent_count = 0;  // 初始化 extent 計數
+    osfs_init_extent_root(root_osfs_inode);
     simple_inode_init_ts(root_inode);
+    root_inode->i_private = root_osfs_inode;
 
     // Initialize root directory's osfs_inode
     // 改成extent結構
-    struct osfs_extent *root_extent = &root_osfs_inode->i_extents[0];
-    ret = osfs_alloc_extent(sb_info, 1, root_extent);
+    struct osfs_extent root_extent;
+    ret = osfs_alloc_file_blocks(root_inode, 0, 1, &root_extent);
     if (ret < 0) {
         goto out_iput;
     }
-    root_osfs_inode->i_extent_count = 1;
-    root_osfs_inode->i_blocks = 1;
-    root_inode->i_private = root_osfs_inode;
-
-    // Mark root directory inode as used
-    set_bit(ROOT_INODE, sb_info->inode_bitmap);
 
     // Update root directory size
     root_inode->i_size = 0;
     inode_init_owner(&nop_mnt_idmap, root_inode, NULL, root_inode->i_mode);
+    osfs_sync_inode(root_inode);
+    insert_inode_hash(root_inode);
+    return root_inode;
+
+out_iput:
+    iput(root_inode);
+    return ERR_PTR(ret);
+}
+
+/**
+ * Function: osfs_fill_super
+ * Description: Initializes the superblock with filesystem-specific information during mount.
+ * Inputs:
+ *   - sb: The superblock to be filled.
+ *   - fc: The filesystem context carrying the mount options.
+ * Returns:
+ *   - 0 on successful initialization.
+ *   - A negative error code on failure.
+ */
+int osfs_fill_super(struct super_block *sb, struct fs_context *fc)
+{
+    pr_info("osfs: Filling super start\n");
+    struct osfs_mount_opts *opts = fc->fs_private;
+    struct inode *root_inode;
+    struct osfs_sb_info *sb_info;
+    size_t inode_bitmap_size, inode_full_map_size, block_bitmap_size, full_map_size;
+    size_t inode_table_size, metadata_size;
+    unsigned long word;
+    uint64_t block_count;
+    uint32_t block_bits;
+    struct file *image = NULL;
+    bool loaded = false;
+    int ret;
+
+    // A saved image brings its own geometry
+    if (sb->s_bdev) {
+        if (opts->image)
+            return invalfc(fc, "image= cannot be used when mounting a block device");
+        ret = osfs_image_probe_bdev(sb, opts, &loaded);
+        if (ret)
+            return ret;
+    } else if (opts->image) {
+        image = osfs_image_open(opts, &loaded);
+        if (IS_ERR(image)) {
+            errorfc(fc, "Cannot use image '%s'", opts->image);
+            return PTR_ERR(image);
+        }
+    }
+
+    // Validate the requested geometry
+    if (!is_power_of_2(opts->block_size) ||
+        opts->block_size < OSFS_MIN_BLOCK_SIZE || opts->block_size > PAGE_SIZE) {
+        ret = invalfc(fc, "block_size must be a power of two between %u and %lu",
+                      OSFS_MIN_BLOCK_SIZE, PAGE_SIZE);
+        goto out_close;
+    }
+    block_bits = ilog2(opts->block_size);
+    if (opts->dax && (!sb->s_bdev || opts->block_size != PAGE_SIZE)) {
+        ret = invalfc(fc, "dax needs a block device mount with block_size %lu", PAGE_SIZE);
+        goto out_close;
+    }
+    // DAX data lives on the device, so there is no memory to save
+    if (opts->dax && opts->compress) {
+        ret = invalfc(fc, "compress cannot be used with dax");
+        goto out_close;
+    }
+
+    block_count = opts->size ? opts->size >> block_bits : OSFS_DEFAULT_BLOCK_COUNT;
+    if (block_count == 0 || block_count > U32_MAX) {
+        ret = invalfc(fc, "size must cover between 1 and %u blocks", U32_MAX);
+        goto out_close;
+    }
+
+    // The data area is held in memory as it fills, unless it is on a DAX device
+    if (!opts->dax && block_count > (uint64_t)totalram_pages() << (PAGE_SHIFT - block_bits)) {
+        ret = invalfc(fc, "size cannot exceed the memory of the machine");
+        goto out_close;
+    }
+
+    // Inode 0 is never used and inode 1 is the root directory
+    if (opts->inode_count <= ROOT_INODE ||
+        opts->inode_count > INT_MAX / sizeof(struct osfs_inode)) {
+        ret = invalfc(fc, "inodes must be between %u and %zu", ROOT_INODE + 1,
+                      INT_MAX / sizeof(struct osfs_inode));
+        goto out_close;
+    }
+
+    sb_info = kzalloc(sizeof(*sb_info), GFP_KERNEL);
+    if (!sb_info) {
+        ret = -ENOMEM;
+        goto out_close;
+    }
+    // From here on the image is closed with the rest of sb_info
+    sb_info->image = image;
+
+    // Initialize superblock information
+    sb_info->magic = OSFS_MAGIC;
+    sb_info->block_size = opts->block_size;
+    sb_info->block_bits = block_bits;
+    sb_info->inode_count = opts->inode_count;
+    sb_info->block_count = block_count;
+    sb_info->nr_free_blocks = sb_info->block_count;
+    mutex_init(&sb_info->block_lock);
+    mutex_init(&sb_info->image_lock);
+    spin_lock_init(&sb_info->inode_lock);
+    xa_init(&sb_info->journal_meta);
+    sb_info->compress = opts->compress;
+    spin_lock_init(&sb_info->cluster_lock);
+    INIT_LIST_HEAD(&sb_info->cluster_lru);
+    // Inode 0 and the root are never free
+    ret = percpu_counter_init(&sb_info->free_inodes, sb_info->inode_count - 2, GFP_KERNEL);
+    if (!ret)
+        ret = percpu_counter_init(&sb_info->free_blocks, sb_info->block_count, GFP_KERNEL);
+    if (!ret)
+        ret = osfs_init_inode_pools(sb_info);
+    if (!ret)
+        ret = osfs_init_block_pools(sb_info);
+    if (!ret)
+        ret = osfs_compress_init(sb_info);
+    if (ret)
+        goto out_free;
+    sb_info->chunk_bits = OSFS_CHUNK_SHIFT - block_bits;
+    sb_info->chunk_count = DIV_ROUND_UP(sb_info->block_count, 1U << sb_info->chunk_bits);
+
+    // The bitmaps, chunk map and inode table share one zeroed allocation;
+    // the data chunks themselves are only allocated as blocks are handed out
+    inode_bitmap_size = BITMAP_SIZE(sb_info->inode_count) * sizeof(unsigned long);
+    inode_full_map_size = BITMAP_SIZE(BITMAP_SIZE(sb_info->inode_count)) * sizeof(unsigned long);
+    block_bitmap_size = BITMAP_SIZE(sb_info->block_count) * sizeof(unsigned long);
+    full_map_size = BITMAP_SIZE(BITMAP_SIZE(sb_info->block_count)) * sizeof(unsigned long);
+    inode_table_size = (size_t)sb_info->inode_count * sizeof(struct osfs_inode);
+    metadata_size = inode_bitmap_size + inode_full_map_size + block_bitmap_size * 4 +
+                    full_map_size + sb_info->chunk_count * sizeof(void *) + inode_table_size +
+                    sb_info->chunk_count * sizeof(uint32_t);
+    // kvmalloc refuses anything past INT_MAX, and the rest must leave room for data
+    if (metadata_size > INT_MAX ||
+        metadata_size > ((uint64_t)totalram_pages() << PAGE_SHIFT) / 2) {
+        ret = invalfc(fc, "inodes and size need more metadata than memory allows");
+        goto out_free;
+    }
+    sb_info->metadata = kvzalloc(metadata_size, GFP_KERNEL);
+    if (!sb_info->metadata) {
+        ret = -ENOMEM;
+        goto out_free;
+    }
+
+    // Partition the metadata region into respective components
+    sb_info->inode_bitmap = sb_info->metadata;
+    sb_info->inode_full_map = (void *)((char *)sb_info->inode_bitmap + inode_bitmap_size);
+    sb_info->block_bitmap = (void *)((char *)sb_info->inode_full_map + inode_full_map_size);
+    sb_info->block_full_map = (void *)((char *)sb_info->block_bitmap + block_bitmap_size);
+    sb_info->block_deferred = (void *)((char *)sb_info->block_full_map + full_map_size);
+    sb_info->block_dirty = (void *)((char *)sb_info->block_deferred + block_bitmap_size);
+    sb_info->block_freed = (void *)((char *)sb_info->block_dirty + block_bitmap_size);
+    sb_info->chunks = (void **)((char *)sb_info->block_freed + block_bitmap_size);
+    sb_info->inode_table = (void *)(sb_info->chunks + sb_info->chunk_count);
+    sb_info->chunk_used = (uint32_t *)((char *)sb_info->inode_table + inode_table_size);
+    sb_info->block_hint = 0;
+
+    // Mark the padding past the last block as used so the final bitmap word
+    // can be reported full by the summary map
+    bitmap_set(sb_info->block_bitmap, sb_info->block_count,
+               block_bitmap_size * BITS_PER_BYTE - sb_info->block_count);
+
+    // Inode 0 is never handed out and inode 1 is the root directory; the
+    // inode bitmap's padding is marked used for its summary map the same way
+    set_bit(0, sb_info->inode_bitmap);
+    set_bit(ROOT_INODE, sb_info->inode_bitmap);
+    bitmap_set(sb_info->inode_bitmap, sb_info->inode_count,
+               inode_bitmap_size * BITS_PER_BYTE - sb_info->inode_count);
+    for (word = 0; word < BITMAP_SIZE(sb_info->inode_count); word++)
+        if (sb_info->inode_bitmap[word] == ~0UL)
+            set_bit(word, sb_info->inode_full_map);
+    sb_info->inode_rotor = ROOT_INODE + 1;
+
+
+    // Set superblock fields
+    sb->s_magic = sb_info->magic;
+    sb->s_fs_info = sb_info;
+    sb->s_op = &osfs_super_ops;
+    sb->s_blocksize = sb_info->block_size;
+    sb->s_blocksize_bits = block_bits;
+    // i_size is 32 bits, and so are the logical blocks of the extent tree
+    sb->s_maxbytes = min_t(loff_t, U32_MAX, (loff_t)U32_MAX << block_bits);
+
+    if (opts->dax) {
+        ret = osfs_dax_open(sb);
+        if (ret)
+            goto out_free;
+    }
+    if (image || sb->s_bdev) {
+        ret = osfs_image_attach(sb, loaded);
+        if (ret)
+            goto out_free;
+    }
+
+    // A loaded image already has its root directory
+    if (loaded)
+        root_inode = osfs_iget(sb, ROOT_INODE);
+    else
+        root_inode = osfs_new_root(sb);
+    if (IS_ERR(root_inode)) {
+        ret = PTR_ERR(root_inode);
+        goto out_free;
+    }
 
     // Set the root directory
     sb->s_root = d_make_root(root_inode);
     if (!sb->s_root) {
+        // d_make_root has already dropped the inode; its blocks go with the data area
         ret = -ENOMEM;
-        goto out_free_extent;
+        goto out_free;
+    }
+    // A DAX image is only whole again once unmounted; the root is set, so
+    // a failure here is cleaned up by unmount like any mounted filesystem
+    if (sb_info->dax_dev) {
+        ret = osfs_image_mark_unclean(sb);
+        if (ret)
+            return ret;
     }
     pr_info("osfs: Superblock filled successfully\n");
     return 0;
 
-out_free_extent:
-    osfs_free_extent(sb_info, root_extent);
-out_iput:
-    iput(root_inode);
 out_free:
-    vfree(memory_region);
+    sb->s_fs_info = NULL;
+    osfs_put_sb_info(sb_info);
+    return ret;
+
+out_close:
+    if (image)
+        filp_close(image, NULL);
     return ret;
 }
\ No newline at end of file